@@ -0,0 +1,138 @@
+/*
+	Sampling latency benchmark, runs the real box_query() of the sampling task against the simulated box
+
+	Build and run from the root of the repository :
+		g++ -std=gnu++11 -O2 -IBoxSimulator/host -ICommunicationModule -IMemory -IScheduler \
+			BoxSimulator/box_simulator.cpp BoxSimulator/box_bench.cpp \
+			CommunicationModule/sampling_task.cpp CommunicationModule/box_frame.cpp -o box_bench
+		./box_bench [samples per profile]
+
+	For each fault profile, reports the time spent by a sample (virtual ms, the UART pace and the box latency included),
+	the requests sent, the retries (requests that didn't get a valid answer) and the fields lost after MAX_TRIES
+	Then checks that the whole sampling task drops its interval to SAMPLING_MIN_INTERVAL on a battery current step,
+	the exit code is the number of failed checks
+*/
+
+#include "Arduino.h"
+#include "box_simulator.h"
+#include "sampling_task.h"
+#include "storage_manager.h"
+#include "task_scheduler.h"
+#include "alarm_task.h"
+#include "window_stats.h"
+
+#define BENCH_SAMPLES  1000
+#define BENCH_PERIOD   60  // Seconds between two samples
+#define BENCH_SEED     1
+
+// The first one must be fault free
+static const struct sim_profile profiles[] = {
+	// name        latency  loss   corrupt  drop
+	{ "ideal",     0,       0,     0,       0    },
+	{ "slow",      30,      0,     0,       0    },
+	{ "noisy",     5,       0,     0.002f,  0    },
+	{ "lossy",     5,       0.002f, 0,      0    },
+	{ "flaky",     5,       0,     0,       0.05f },
+	{ "combined",  20,      0.001f, 0.001f, 0.02f },
+};
+
+// Unused parts of the firmware, the bench only drives the box requests
+uint8_t stor_start(void) { return 0; }
+void stor_abort(void) {}
+void stor_end(void) {}
+uint16_t stor_write_timed(uint32_t temps, uint8_t *data, uint8_t len) { return 0; }
+uint8_t stor_write_config(uint8_t *data, uint8_t len) { return 0; }
+uint8_t stor_read_config(uint8_t *buffer, uint8_t maxlen) { return 0; }
+void compression(uint16_t len) {}
+uint8_t sched_task_id(void) { return 0; }
+static int32_t period = 0; // Last one set by the sampling task
+uint8_t sched_set_period(uint8_t id, int32_t looptime) { period = looptime; return 0; }
+void alarm_check(uint8_t box, const uint8_t *sample, uint16_t missing, int16_t payg_state) {}
+void stats_add(const uint8_t *sample, uint16_t missing, uint32_t now) {}
+
+// Fields of the sample that don't hold what the box answered
+static uint8_t bench_check(const uint8_t *sample) {
+	static const uint8_t regs[SAMPLE_FIELDS][2] = {
+		{ 0x06, 0x0c }, { 0x06, 0x0d }, { 0x06, 0x0e }, { 0x08, 0x3f }, { 0x08, 0x3e },
+		{ 0x08, 0x3d }, { 0x08, 0x3c }, { 0x08, 0x09 }, { 0x08, 0x08 }, { 0x08, 0x0a }
+	};
+	uint8_t wrong = 0;
+	for (uint8_t i = 0; i < SAMPLE_FIELDS; i++) {
+		uint16_t expected = sim_register(regs[i][0], regs[i][1]);
+		if (i == FIELD_RSOC) {
+			expected &= 0xFF;
+		}
+		wrong += (sample_field(sample, i) != expected);
+	}
+	return wrong;
+}
+
+static void bench_run(const struct sim_profile *profile, uint32_t samples) {
+	uint8_t sample[SAMPLE_SIZE];
+	uint8_t payg[PAYG_STATE_SIZE];
+	uint64_t total_us = 0;
+	uint64_t max_us = 0;
+	uint32_t failed = 0;
+	uint32_t wrong = 0;
+
+	sim_reset(profile, BENCH_SEED);
+	for (uint32_t i = 0; i < samples; i++) {
+		uint64_t start = sim_now();
+		failed += (get_data_from_box(0, sample) != 0);
+		get_paygState_from_box(0, payg); // Only goes to the box once an hour
+		uint64_t elapsed = sim_now() - start;
+		total_us += elapsed;
+		max_us = max(max_us, elapsed);
+		wrong += bench_check(sample);
+		sim_advance(BENCH_PERIOD * 1000000ull - elapsed);
+	}
+
+	// The first profile is fault free, its requests are the ones the samples need (the cached fields included)
+	struct sim_counters *c = sim_counters();
+	static uint32_t commands = 0;
+	if (profile == &profiles[0]) {
+		commands = c->requests;
+	}
+	printf("%-10s %8.2f %8.2f %9.2f %9.3f %9.4f %9.4f %8lu\n", profile->name,
+		total_us / 1000.0 / samples, max_us / 1000.0,
+		(double)c->requests / samples,
+		c->requests > commands ? (double)(c->requests - commands) / samples : 0.0,
+		(double)failed / samples, (double)wrong / samples,
+		(unsigned long)c->idle_calls / samples);
+}
+
+// A step of the battery current between two samples brings the next one to SAMPLING_MIN_INTERVAL
+static int bench_adaptive(void) {
+	int failures = 0;
+	sim_reset(&profiles[0], BENCH_SEED);
+	sampling_task();
+	sim_advance(period * 1000000ull);
+	sampling_task();
+	if (period != SAMPLING_LOOPTIME) {
+		printf("adaptive: stable current, interval %ld s instead of %d\n", (long)period, SAMPLING_LOOPTIME);
+		failures++;
+	}
+	sim_set_register(0x08, 0x0a, sim_register(0x08, 0x0a) + 2 * SAMPLING_BC_STEP);
+	sim_advance(period * 1000000ull);
+	sampling_task();
+	if (period != SAMPLING_MIN_INTERVAL) {
+		printf("adaptive: current step, interval %ld s instead of %d\n", (long)period, SAMPLING_MIN_INTERVAL);
+		failures++;
+	}
+	return failures;
+}
+
+int main(int argc, char **argv) {
+	uint32_t samples = (argc > 1) ? strtoul(argv[1], NULL, 10) : BENCH_SAMPLES;
+	if (samples == 0) {
+		samples = BENCH_SAMPLES;
+	}
+	printf("%lu samples per profile, one every %d s\n", (unsigned long)samples, BENCH_PERIOD);
+	printf("%-10s %8s %8s %9s %9s %9s %9s %8s\n", "profile", "ms/smpl", "max ms", "req/smpl", "retry", "failed", "bad flds", "idles");
+	for (uint8_t i = 0; i < sizeof(profiles) / sizeof(profiles[0]); i++) {
+		bench_run(&profiles[i], samples);
+	}
+	int failures = bench_adaptive();
+	printf("%d failure(s)\n", failures);
+	return failures;
+}
@@ -0,0 +1,152 @@
+/*
+	Host test of the box answer parser, feeds recorded answer streams to bf_feed() and checks what bf_peek() gives
+
+	Build and run from the root of the repository :
+		g++ -std=gnu++11 -Wall -ICommunicationModule \
+			BoxSimulator/box_frame_test.cpp CommunicationModule/box_frame.cpp -o box_frame_test
+		./box_frame_test
+
+	Prints the failed checks, the exit code is the number of failures
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "box_frame.h"
+
+static const uint8_t preamble[BF_PREAMBLE_LEN] = { 0xc5, 0x6a, 0x29 };
+
+// Answers recorded on the bus : RSOC (06 0d, 80 %) and BV (08 00 3f 02, 15000 mV)
+static const uint8_t rsoc[] = { 0xc5, 0x6a, 0x29, 0x08, 0x0d, 0x50, 0x00, 0xe5 };
+static const uint8_t bv[] = { 0xc5, 0x6a, 0x29, 0x0a, 0x00, 0x3f, 0x02, 0x98, 0x3a, 0x38 };
+
+static struct box_parser parser;
+static int failures = 0;
+
+#define CHECK(test, cond) do { \
+	if (!(cond)) { \
+		printf("%s: failed %s (line %d)\n", test, #cond, __LINE__); \
+		failures++; \
+	} \
+} while (0)
+
+static void feed(const uint8_t *bytes, uint8_t len) {
+	for (uint8_t i = 0; i < len; i++) {
+		bf_feed(&parser, bytes[i]);
+	}
+}
+
+// The next frame is <answer>, with a matching CRC or not
+static void check_frame(const char *test, const uint8_t *answer, uint8_t len, uint8_t ok) {
+	struct box_frame *f = bf_peek(&parser);
+	CHECK(test, f != NULL);
+	if (f == NULL) {
+		return;
+	}
+	CHECK(test, f->len == len);
+	CHECK(test, f->ok == ok);
+	CHECK(test, memcmp(f->data, answer, len - 1) == 0);
+	bf_pop(&parser);
+}
+
+static void test_split(void) {
+	bf_init(&parser, preamble);
+	bf_expect(&parser, sizeof(rsoc));
+	feed(rsoc, 5);
+	CHECK("split", bf_peek(&parser) == NULL);
+	feed(rsoc + 5, 2);
+	CHECK("split", bf_peek(&parser) == NULL);
+	feed(rsoc + 7, 1);
+	check_frame("split", rsoc, sizeof(rsoc), 1);
+	CHECK("split", bf_peek(&parser) == NULL);
+	CHECK("split", parser.dropped == 0);
+}
+
+static void test_bad_crc(void) {
+	uint8_t answer[sizeof(rsoc)];
+	bf_init(&parser, preamble);
+
+	memcpy(answer, rsoc, sizeof(rsoc));
+	answer[sizeof(answer) - 1] ^= 0x01; // CRC byte
+	bf_expect(&parser, sizeof(answer));
+	feed(answer, sizeof(answer));
+	check_frame("bad crc", answer, sizeof(answer), 0);
+
+	memcpy(answer, rsoc, sizeof(rsoc));
+	answer[5] ^= 0x10; // Data byte
+	bf_expect(&parser, sizeof(answer));
+	feed(answer, sizeof(answer));
+	check_frame("bad crc", answer, sizeof(answer), 0);
+
+	// The parser goes on with the next answer
+	bf_expect(&parser, sizeof(rsoc));
+	feed(rsoc, sizeof(rsoc));
+	check_frame("bad crc", rsoc, sizeof(rsoc), 1);
+}
+
+static void test_garbage(void) {
+	// Line noise, then a preamble cut short that starts again
+	static const uint8_t garbage[] = { 0x00, 0xff, 0x29, 0xc5, 0x6a };
+	bf_init(&parser, preamble);
+	bf_expect(&parser, sizeof(rsoc));
+	feed(garbage, sizeof(garbage));
+	CHECK("garbage", bf_peek(&parser) == NULL);
+	feed(rsoc, sizeof(rsoc));
+	check_frame("garbage", rsoc, sizeof(rsoc), 1);
+	CHECK("garbage", parser.dropped == sizeof(garbage));
+
+	// Nothing expected, the bytes are dropped
+	feed(bv, sizeof(bv));
+	CHECK("garbage", bf_peek(&parser) == NULL);
+	CHECK("garbage", parser.dropped == sizeof(garbage) + sizeof(bv));
+}
+
+static void test_back_to_back(void) {
+	uint8_t stream[sizeof(rsoc) + sizeof(bv)];
+	memcpy(stream, rsoc, sizeof(rsoc));
+	memcpy(stream + sizeof(rsoc), bv, sizeof(bv));
+
+	bf_init(&parser, preamble);
+	bf_expect(&parser, sizeof(rsoc));
+	bf_expect(&parser, sizeof(bv));
+	feed(stream, sizeof(stream));
+	check_frame("back to back", rsoc, sizeof(rsoc), 1);
+	check_frame("back to back", bv, sizeof(bv), 1);
+	CHECK("back to back", bf_peek(&parser) == NULL);
+	CHECK("back to back", parser.dropped == 0);
+
+	// Queue full : the third answer is dropped until the consumer frees a frame
+	bf_expect(&parser, sizeof(rsoc));
+	bf_expect(&parser, sizeof(rsoc));
+	bf_expect(&parser, sizeof(bv));
+	feed(rsoc, sizeof(rsoc));
+	feed(rsoc, sizeof(rsoc));
+	feed(bv, sizeof(bv));
+	CHECK("back to back", parser.dropped == sizeof(bv));
+	check_frame("back to back", rsoc, sizeof(rsoc), 1);
+	feed(bv, sizeof(bv));
+	check_frame("back to back", rsoc, sizeof(rsoc), 1);
+	check_frame("back to back", bv, sizeof(bv), 1);
+}
+
+static void test_reset(void) {
+	// Timeout in the middle of an answer, the rest of it is noise for the next one
+	bf_init(&parser, preamble);
+	bf_expect(&parser, sizeof(bv));
+	feed(bv, 6);
+	bf_reset(&parser);
+	feed(bv + 6, sizeof(bv) - 6);
+	CHECK("reset", bf_peek(&parser) == NULL);
+	bf_expect(&parser, sizeof(rsoc));
+	feed(rsoc, sizeof(rsoc));
+	check_frame("reset", rsoc, sizeof(rsoc), 1);
+}
+
+int main(void) {
+	test_split();
+	test_bad_crc();
+	test_garbage();
+	test_back_to_back();
+	test_reset();
+	printf("%d failure(s)\n", failures);
+	return failures;
+}
@@ -0,0 +1,293 @@
+//
+//
+//
+
+#include <deque> // Before Arduino.h and its min/max macros
+
+#include "Arduino.h"
+#include "box_simulator.h"
+#include "box_frame.h"
+
+#define SIM_ANSWER_MAX 64
+
+static const uint8_t sim_address[] = { 0xc5, 0x6a, 0x29 };
+
+struct sim_byte {
+	uint64_t time;   // Arrival time on the firmware side
+	uint8_t c;
+};
+
+static struct sim_profile profile;
+static struct sim_counters counters;
+static uint64_t now_us = 0;
+static uint32_t byte_us = 260;          // 10 bits at 38400 bauds
+static uint64_t line_free_us = 0;       // End of the answer being sent
+static uint64_t tx_free_us = 0;         // End of the request being sent
+static std::deque<struct sim_byte> rx;  // Answer bytes on their way to the firmware
+static uint8_t request[16];
+static uint8_t request_pos = 0;
+static bool port_open = false;
+static uint8_t set_count = 0;           // Registers set by the bench
+static struct {
+	uint8_t form;
+	uint8_t reg;
+	uint16_t value;
+} set_registers[4];
+
+SimSerial Serial1;
+SimSerial Serial;
+
+
+static float sim_random(void) {
+	return (float)rand() / ((float)RAND_MAX + 1);
+}
+
+void sim_reset(const struct sim_profile *p, uint32_t seed) {
+	profile = *p;
+	memset(&counters, 0, sizeof(counters));
+	now_us = 0;
+	line_free_us = 0;
+	tx_free_us = 0;
+	rx.clear();
+	request_pos = 0;
+	set_count = 0;
+	srand(seed);
+}
+
+uint64_t sim_now(void) {
+	return now_us;
+}
+
+void sim_advance(uint64_t us) {
+	now_us += us;
+}
+
+struct sim_counters *sim_counters(void) {
+	return &counters;
+}
+
+void sim_set_register(uint8_t form, uint8_t reg, uint16_t value) {
+	uint8_t i = 0;
+	while (i < set_count && (set_registers[i].form != form || set_registers[i].reg != reg)) {
+		i++;
+	}
+	if (i == sizeof(set_registers) / sizeof(set_registers[0])) {
+		return;
+	}
+	set_count = max(set_count, (uint8_t)(i + 1));
+	set_registers[i].form = form;
+	set_registers[i].reg = reg;
+	set_registers[i].value = value;
+}
+
+uint16_t sim_register(uint8_t form, uint8_t reg) {
+	for (uint8_t i = 0; i < set_count; i++) {
+		if (set_registers[i].form == form && set_registers[i].reg == reg) {
+			return set_registers[i].value;
+		}
+	}
+	if (form == 0x06) {
+		switch (reg) {
+		case 0x0c: return 76;      // RSOC (%)
+		case 0x0d: return 7600;    // RC (mAh)
+		case 0x0e: return 10000;   // FCC (mAh)
+		case 0x09: return 1;       // PAYG state
+		case 0x0a: return 3;       // Output state
+		case 0x0b: return 0;       // System status
+		case 0x05: return 12;      // Remaining PAYG days
+		default: return 0x100 + reg;
+		}
+	}
+	switch (reg) {
+	case 0x3f: return 3301;   // Cell voltages (mV)
+	case 0x3e: return 3299;
+	case 0x3d: return 3305;
+	case 0x3c: return 3297;
+	case 0x09: return 13202;  // Battery voltage (mV)
+	case 0x0a: return 1250;   // Battery current (mA)
+	case 0x08: return 2982;   // Battery temperature (0.1 K)
+	default: return 0x200 + reg;
+	}
+}
+
+// Queue an answer, through the fault profile
+static void sim_answer(const uint8_t *answer, uint8_t len, uint64_t end_of_request) {
+	counters.answers++;
+	if (sim_random() < profile.answer_drop) {
+		return;
+	}
+	uint64_t t = end_of_request + profile.latency_ms * 1000ull;
+	if (t < line_free_us) {
+		t = line_free_us;
+	}
+	for (uint8_t i = 0; i < len; i++) {
+		t += byte_us;
+		if (sim_random() < profile.byte_loss) {
+			continue;
+		}
+		uint8_t c = answer[i];
+		if (sim_random() < profile.corruption) {
+			c ^= 1 << (rand() % 8);
+		}
+		struct sim_byte b = { t, c };
+		rx.push_back(b);
+	}
+	line_free_us = t;
+}
+
+// Complete request in <request>, build the answer
+static void sim_request(uint8_t len, uint64_t end_of_request) {
+	uint8_t crc = 0;
+	for (uint8_t i = 0; i < len - 1; i++) {
+		crc = bf_crc_update(crc, request[i]);
+	}
+	if (crc != request[len - 1]) {
+		counters.bad_requests++;
+		return;
+	}
+	counters.requests++;
+
+	uint8_t form = request[3];
+	uint8_t data[SIM_ANSWER_MAX];
+	uint8_t datalen;
+	if (form == 0x06) {            // 06 reg CRC : a word, or the 8 bytes hash
+		uint8_t reg = request[4];
+		datalen = (reg == 0x11) ? 8 : 2;
+		for (uint8_t i = 0; i < datalen; i++) {
+			data[i] = (reg == 0x11) ? 0xA0 + i : (uint8_t)(sim_register(form, reg) >> (8 * i));
+		}
+	}
+	else if (form == 0x07) {       // 07 bank n CRC : n bytes block
+		datalen = request[5];
+		for (uint8_t i = 0; i < datalen; i++) {
+			data[i] = 'A' + (request[4] + i) % 26;
+		}
+	}
+	else {                         // 08 00 reg n CRC : n bytes register
+		datalen = request[6];
+		uint16_t val = sim_register(form, request[5]);
+		for (uint8_t i = 0; i < datalen; i++) {
+			data[i] = (uint8_t)(val >> (8 * i));
+		}
+	}
+
+	uint8_t answer[SIM_ANSWER_MAX];
+	uint8_t pos = 0;
+	memcpy(answer, sim_address, sizeof(sim_address));
+	pos += sizeof(sim_address);
+	uint8_t total = len + datalen; // Header of len - 1 bytes, data and CRC after the preamble
+	answer[pos++] = total;
+	for (uint8_t i = 4; i < len - 1; i++) {
+		answer[pos++] = request[i];
+	}
+	memcpy(answer + pos, data, datalen);
+	pos += datalen;
+	crc = 0;
+	for (uint8_t i = 0; i < pos; i++) {
+		crc = bf_crc_update(crc, answer[i]);
+	}
+	answer[pos++] = crc;
+	sim_answer(answer, pos, end_of_request);
+}
+
+// Request parser of the box
+static void sim_receive(uint8_t c, uint64_t time) {
+	if (request_pos < sizeof(sim_address)) {
+		if (c != sim_address[request_pos]) {
+			if (c != 0) { // Zeros are the wake-up sequence
+				counters.bad_requests += (request_pos > 0);
+			}
+			request_pos = (c == sim_address[0]);
+			if (request_pos) {
+				request[0] = c;
+			}
+			return;
+		}
+		request[request_pos++] = c;
+		return;
+	}
+	request[request_pos++] = c;
+	uint8_t len = request[3];
+	if (len < 6 || len > sizeof(request)) {
+		counters.bad_requests++;
+		request_pos = 0;
+		return;
+	}
+	if (request_pos == len) {
+		request_pos = 0;
+		sim_request(len, time);
+	}
+}
+
+
+void SimSerial::begin(unsigned long baud) {
+	byte_us = 10000000ul / baud;
+	port_open = true;
+	rx.clear();
+}
+
+void SimSerial::end(void) {
+	port_open = false;
+}
+
+int SimSerial::available(void) {
+	int n = 0;
+	for (size_t i = 0; i < rx.size() && rx[i].time <= now_us; i++) {
+		n++;
+	}
+	return n;
+}
+
+int SimSerial::read(void) {
+	if (rx.empty() || rx.front().time > now_us) {
+		return -1;
+	}
+	uint8_t c = rx.front().c;
+	rx.pop_front();
+	return c;
+}
+
+size_t SimSerial::write(uint8_t c) {
+	if (this != &Serial1 || !port_open) {
+		return 1;
+	}
+	// 64 bytes TX buffer, the firmware only waits if it is full
+	if (tx_free_us < now_us) {
+		tx_free_us = now_us;
+	}
+	if (tx_free_us > now_us + 64 * byte_us) {
+		now_us = tx_free_us - 64 * byte_us;
+	}
+	tx_free_us += byte_us;
+	sim_receive(c, tx_free_us);
+	return 1;
+}
+
+size_t SimSerial::write(const uint8_t *buffer, size_t len) {
+	for (size_t i = 0; i < len; i++) {
+		write(buffer[i]);
+	}
+	return len;
+}
+
+unsigned long millis(void) {
+	return (unsigned long)(now_us / 1000);
+}
+
+void delay(unsigned long ms) {
+	now_us += ms * 1000ull;
+}
+
+// Light sleep : wakes up on the next received byte or the next millis tick
+void sched_idle(void) {
+	counters.idle_calls++;
+	uint64_t wake = (now_us / 1000 + 1) * 1000;
+	if (!rx.empty() && rx.front().time > now_us && rx.front().time < wake) {
+		wake = rx.front().time;
+	}
+	now_us = wake;
+}
+
+uint32_t sched_time(void) {
+	return (uint32_t)(now_us / 1000000);
+}
@@ -0,0 +1,62 @@
+// box_simulator.h
+
+#ifndef _BOX_SIMULATOR_h
+#define _BOX_SIMULATOR_h
+
+#include <stdint.h>
+
+/*
+	Host simulation of a battery box on Serial1, driven by a virtual clock
+
+	The box parses the requests like the real one (address preamble, length byte, Maxim CRC8) and answers
+	[preamble, answer length, request bytes but the first one and the CRC, data, CRC] after <latency_ms>
+	Invalid requests are not answered
+	The answer bytes go through the fault profile : lost bytes, corrupted bytes, or a whole answer dropped
+
+	The clock only moves when the firmware waits : sched_idle() (next received byte or next millis tick),
+	delay(), and sim_advance() between two samples
+*/
+
+struct sim_profile {
+	const char *name;
+	uint16_t latency_ms;   // Between the end of a request and the start of its answer
+	float byte_loss;       // Probability of losing an answer byte
+	float corruption;      // Probability of flipping a bit of an answer byte
+	float answer_drop;     // Probability of not answering a valid request
+};
+
+struct sim_counters {
+	uint32_t requests;      // Valid requests received by the box
+	uint32_t bad_requests;  // Requests with a bad CRC or a wrong address
+	uint32_t answers;       // Answers sent (possibly damaged)
+	uint32_t idle_calls;    // sched_idle() calls
+};
+
+/*
+	Resets the box, the clock and the counters, and applies <profile>
+*/
+void sim_reset(const struct sim_profile *profile, uint32_t seed);
+
+/*
+	Virtual time, in microseconds
+*/
+uint64_t sim_now(void);
+
+/*
+	Moves the clock forward, the box keeps its state
+*/
+void sim_advance(uint64_t us);
+
+struct sim_counters *sim_counters(void);
+
+/*
+	Value of a box register, as answered by the simulator
+*/
+uint16_t sim_register(uint8_t form, uint8_t reg);
+
+/*
+	Makes the box answer <value> for a register, until the next sim_reset()
+*/
+void sim_set_register(uint8_t form, uint8_t reg, uint16_t value);
+
+#endif
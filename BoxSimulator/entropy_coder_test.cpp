@@ -0,0 +1,233 @@
+/*
+	Host test of the report range coder, codes byte streams with ec_encode() and decodes them back with the server
+	side decoder described in entropy_coder.h
+
+	Build and run from the root of the repository :
+		g++ -std=gnu++11 -Wall -IBoxSimulator/host -ICommunicationModule \
+			BoxSimulator/entropy_coder_test.cpp CommunicationModule/entropy_coder.cpp -o entropy_coder_test
+		./entropy_coder_test
+
+	The representative payload is a day of timed records (60s cadence, solar charge in the day, load at night) in
+	the stored layout, compressed block by block in the LZFX format. Prints its size before and after the coder
+	Prints the failed checks, the exit code is the number of failures
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "entropy_coder.h"
+#include "sampling_task.h"
+
+#define TEST_MAX      40000      // Bytes of a test stream
+#define LZFX_BLOCK    4560       // Raw bytes compressed together, as TAILLE_BLOC in the storage manager
+#define LZFX_MAX_OFF  8192
+#define LZFX_MAX_LEN  264
+#define DAY_RECORDS   1440
+
+static uint8_t coded[TEST_MAX + TEST_MAX / 8 + 16];
+static uint16_t coded_len;
+static uint8_t decoded[TEST_MAX];
+static int failures = 0;
+
+#define CHECK(test, cond) do { \
+	if (!(cond)) { \
+		printf("%s: failed %s (line %d)\n", test, #cond, __LINE__); \
+		failures++; \
+	} \
+} while (0)
+
+static void put(uint8_t c) {
+	if (coded_len < sizeof(coded)) {
+		coded[coded_len] = c;
+	}
+	coded_len++;
+}
+
+// Server side decoder, as documented in entropy_coder.h
+static void decode(const uint8_t *in, uint16_t in_len, uint8_t *out, uint16_t out_len) {
+	uint8_t probs[255];
+	uint16_t pos = 1; // First byte always 0
+	uint32_t code = 0;
+	uint32_t range = 0xFFFFFFFFul;
+	memset(probs, 128, sizeof(probs));
+	for (uint8_t i = 0; i < 4; i++) {
+		code = (code << 8) | (pos < in_len ? in[pos] : 0);
+		pos++;
+	}
+	for (uint16_t i = 0; i < out_len; i++) {
+		uint16_t node = 1;
+		for (uint8_t b = 0; b < 8; b++) {
+			uint8_t *prob = &probs[node - 1];
+			uint32_t bound = (range >> 8) * *prob;
+			uint8_t bit;
+			if (code < bound) {
+				range = bound;
+				*prob += (256 - *prob) >> 4;
+				bit = 0;
+			}
+			else {
+				code -= bound;
+				range -= bound;
+				*prob -= *prob >> 4;
+				bit = 1;
+			}
+			while (range < (1ul << 24)) {
+				range <<= 8;
+				code = (code << 8) | (pos < in_len ? in[pos] : 0);
+				pos++;
+			}
+			node = (node << 1) | bit;
+		}
+		out[i] = (uint8_t)node;
+	}
+}
+
+// Codes <data>, checks the coded length and that it decodes back to <data>, returns the coded length
+static uint16_t round_trip(const char *test, const uint8_t *data, uint16_t len) {
+	static struct entropy_coder ec;
+	coded_len = 0;
+	ec_init(&ec, put);
+	ec_encode(&ec, data, len);
+	uint16_t total = ec_finish(&ec);
+	CHECK(test, total == coded_len);
+	CHECK(test, coded_len <= sizeof(coded));
+	CHECK(test, coded[0] == 0);
+
+	decode(coded, coded_len, decoded, len);
+	CHECK(test, memcmp(decoded, data, len) == 0);
+
+	// Counting only (NULL sink) gives the same length, the report sizes the upload with it
+	ec_init(&ec, NULL);
+	ec_encode(&ec, data, len);
+	CHECK(test, ec_finish(&ec) == total);
+	return total;
+}
+
+// LZFX compression of <in>, literal runs of up to 32 bytes and back references of 3 to 264 bytes
+static uint16_t lzfx(const uint8_t *in, uint16_t len, uint8_t *out) {
+	uint16_t o = 0;
+	uint16_t lit = 0xFFFF; // Position of the control byte of the literal run in progress
+	uint16_t i = 0;
+	while (i < len) {
+		uint16_t best_len = 0;
+		uint16_t best_off = 0;
+		for (uint16_t ref = (i > LZFX_MAX_OFF) ? i - LZFX_MAX_OFF : 0; ref < i; ref++) {
+			uint16_t l = 0;
+			while (i + l < len && l < LZFX_MAX_LEN && in[ref + l] == in[i + l]) {
+				l++;
+			}
+			if (l >= best_len) { // The closest one on a tie
+				best_len = l;
+				best_off = i - ref - 1;
+			}
+		}
+		if (best_len >= 3) {
+			uint16_t l = best_len - 2;
+			if (l < 7) {
+				out[o++] = (l << 5) | (best_off >> 8);
+			}
+			else {
+				out[o++] = (7 << 5) | (best_off >> 8);
+				out[o++] = l - 7;
+			}
+			out[o++] = best_off & 0xFF;
+			i += best_len;
+			lit = 0xFFFF;
+		}
+		else {
+			if (lit == 0xFFFF || out[lit] == 31) {
+				lit = o;
+				out[o++] = 0xFF; // Incremented to 0 below
+			}
+			out[lit]++;
+			out[o++] = in[i++];
+		}
+	}
+	return o;
+}
+
+static void put_word(uint8_t *sample, uint8_t field, int32_t value) {
+	sample[sample_field_pos(field)] = value & 0xFF;
+	sample[sample_field_pos(field) + 1] = (value >> 8) & 0xFF;
+}
+
+// A day of timed records : delay, length, presence mask and the sample, the way stor_write_timed stores them
+static uint16_t day_records(uint8_t *out) {
+	uint32_t seed = 1;
+	int32_t charge = 20000; // mAh
+	uint16_t o = 0;
+	for (uint16_t m = 0; m < DAY_RECORDS; m++) {
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+		int32_t noise = (int32_t)(seed % 21) - 10;
+		uint16_t hour = m / 60;
+		int32_t current = (hour >= 8 && hour < 17) ? 1500 - 60 * (int32_t)((hour - 12) * (hour - 12)) : -300;
+		current += 3 * noise;
+		charge += current / 60;
+		uint8_t sample[SAMPLE_SIZE];
+		sample[sample_field_pos(FIELD_RSOC)] = (uint8_t)(charge / 400);
+		put_word(sample, FIELD_RC, charge);
+		put_word(sample, FIELD_FCC, 40000);
+		for (uint8_t cell = FIELD_CV1; cell <= FIELD_CV4; cell++) {
+			put_word(sample, cell, 3200 + charge / 200 + current / 20 + noise / 4);
+		}
+		put_word(sample, FIELD_BV, 12800 + charge / 50 + current / 5 + noise);
+		put_word(sample, FIELD_BT, 2981 + hour / 2 + noise / 8);
+		put_word(sample, FIELD_BC, current);
+
+		out[o++] = SAMPLING_LOOPTIME; // Delay, one byte
+		out[o++] = 2 + SAMPLE_SIZE;
+		out[o++] = 0xFF;              // Every field present, box 0
+		out[o++] = 0x03;
+		memcpy(out + o, sample, SAMPLE_SIZE);
+		o += SAMPLE_SIZE;
+	}
+	return o;
+}
+
+static void test_edges(void) {
+	static uint8_t data[TEST_MAX];
+	round_trip("empty", data, 0);
+
+	data[0] = 0x5A;
+	round_trip("one byte", data, 1);
+
+	// Long runs : probabilities at their bounds, long 0xFF runs held back for the carry
+	memset(data, 0, TEST_MAX);
+	uint16_t zeros = round_trip("zeros", data, TEST_MAX);
+	CHECK("zeros", zeros < TEST_MAX / 10); // 8 bit probabilities, 0.7 bit per byte at best
+	memset(data, 0xFF, TEST_MAX);
+	round_trip("ones", data, TEST_MAX);
+
+	// No redundancy, the fast adaptation costs a few percent
+	uint32_t seed = 7;
+	for (uint16_t i = 0; i < TEST_MAX; i++) {
+		seed = seed * 1103515245ul + 12345;
+		data[i] = seed >> 24;
+	}
+	uint16_t noise = round_trip("noise", data, TEST_MAX);
+	CHECK("noise", noise < TEST_MAX + TEST_MAX / 25);
+}
+
+static void test_report(void) {
+	static uint8_t raw[DAY_RECORDS * (4 + SAMPLE_SIZE)];
+	static uint8_t compressed[TEST_MAX];
+	uint16_t raw_len = day_records(raw);
+	uint16_t lzfx_len = 0;
+	for (uint16_t start = 0; start < raw_len; start += LZFX_BLOCK) {
+		uint16_t block = min((uint16_t)(raw_len - start), (uint16_t)LZFX_BLOCK);
+		lzfx_len += lzfx(raw + start, block, compressed + lzfx_len);
+	}
+	CHECK("report", lzfx_len < raw_len);
+	uint16_t coded = round_trip("report", compressed, lzfx_len);
+	CHECK("report", coded < lzfx_len);
+	printf("report : %u raw bytes, %u after LZFX, %u after the range coder (%.1f %% less)\n", raw_len, lzfx_len,
+		coded, 100.0 * (lzfx_len - coded) / lzfx_len);
+}
+
+int main(void) {
+	test_edges();
+	test_report();
+	printf("%d failure(s)\n", failures);
+	return failures;
+}
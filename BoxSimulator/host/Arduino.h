@@ -0,0 +1,61 @@
+// Arduino.h
+// Host stand-in for the few Arduino core features used by the sampling code, backed by the box simulator
+
+#ifndef _HOST_ARDUINO_h
+#define _HOST_ARDUINO_h
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define F(s) (s)
+
+#ifndef min
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+#endif
+
+/*
+	Serial port connected to the simulated box
+	Bytes written are handed to the box at the UART pace, its answers become available as the virtual clock reaches them
+*/
+class SimSerial {
+public:
+	void begin(unsigned long baud);
+	void end(void);
+	int available(void);
+	int read(void);
+	size_t write(uint8_t c);
+	size_t write(const uint8_t *buffer, size_t len);
+	// Debug console, discarded
+	template<class T> size_t print(T) { return 0; }
+	template<class T> size_t println(T) { return 0; }
+	size_t println(void) { return 0; }
+};
+
+extern SimSerial Serial1;
+extern SimSerial Serial;
+
+unsigned long millis(void);
+unsigned long micros(void);
+void delay(unsigned long ms);
+inline void noInterrupts(void) {}
+inline void interrupts(void) {}
+
+// No pins on the host, the external interrupts are posted by the simulations
+#define HIGH 1
+#define LOW 0
+#define LED_BUILTIN 13
+#define FALLING 2
+#define NOT_AN_INTERRUPT -1
+#define digitalPinToInterrupt(p) (p)
+inline void digitalWrite(uint8_t pin, uint8_t val) {}
+inline void attachInterrupt(uint8_t irq, void(*isr)(void), int mode) {}
+inline void detachInterrupt(uint8_t irq) {}
+
+#endif
@@ -0,0 +1,16 @@
+// debug.h
+// Host stand-in of the debug library, the traces are discarded
+
+#ifndef _HOST_DEBUG_h
+#define _HOST_DEBUG_h
+
+#include "Arduino.h"
+
+#define db(s)            do {} while (0)
+#define db_print(...)    do {} while (0)
+#define db_println(...)  do {} while (0)
+#define db_module()      do {} while (0)
+#define db_start()       do {} while (0)
+#define db_wait()        do {} while (0)
+
+#endif
@@ -0,0 +1,274 @@
+/*
+	Scheduler simulation, runs the real scheduler (sched_add_task, sched_mainloop) on a virtual clock
+
+	Build and run from the root of the repository :
+		g++ -std=gnu++11 -O2 -DSCHED_HOST -IBoxSimulator/host -IScheduler \
+			BoxSimulator/sched_sim.cpp Scheduler/task_scheduler.cpp -o sched_sim
+		./sched_sim [days per profile] [seed]
+
+	The clock only moves when the firmware spends time : the stub tasks consume their run time with delay(), and
+	sched_sleep() jumps straight to the next deadline (or to the next external event), so months of operation
+	take seconds
+	The stub tasks mimic the firmware ones : sampling every minute, a cooperative report every few hours with a
+	blocking modem power on, alarms posted by an external interrupt
+
+	For each load profile, reports per task :
+		runs     calls that started a run (the slices of a cooperative task are not counted)
+		missed   slots that got no run (a late sample skipped, reports merged, alarms merged or dropped)
+		sched    the same, as counted by the scheduler (sched_missed), merged and dropped events excluded
+		late     time from the start of its slot (the event for the alarms) to the start of the run, ms :
+		         mean, standard deviation (jitter) and worst
+		> 1s     runs started more than a second late
+	and the share of time spent awake
+*/
+
+#include <setjmp.h>
+#include <time.h>
+
+#include "Arduino.h"
+#include "task_scheduler.h"
+
+#define SIM_DAYS            90
+#define SIM_SEED            1
+
+#define SIM_SAMPLE_PERIOD   60       // s
+#define SIM_SAMPLE_MS       45       // Box query and storage write, + up to 10ms
+#define SIM_RETRY_MS        1500     // Extra time of a sample that needs retries
+#define SIM_REPORT_PERIOD   14400    // s
+#define SIM_POWER_ON_MS     3500     // Modem power on sequence, blocking
+#define SIM_HANG_MS         75000    // AT command timeout, blocking
+#define SIM_CHUNKS          40       // Report upload, in chunks written to the modem
+#define SIM_CHUNK_MS        250      // Blocking write of a chunk
+#define SIM_CHUNK_WAIT_MS   50       // Wait for the modem prompt between two chunks
+#define SIM_ALARM_MS        2000     // Alarm SMS, blocking
+#define SIM_LATE_MS         1000
+
+struct sim_load {
+	const char *name;
+	float sample_retry;     // Probability of a sample needing retries
+	uint32_t alarm_mean;    // Mean time between two alarms, s (0 : no alarm)
+	float modem_hang;       // Probability of a report blocked by an AT command timeout
+	uint16_t register_max;  // Longest network registration, s
+};
+
+static const struct sim_load loads[] = {
+	// name            retry  alarms  hang   register
+	{ "nominal",       0.01f, 0,      0,     30  },
+	{ "flaky box",     0.2f,  0,      0,     30  },
+	{ "alarms",        0.01f, 600,    0,     30  },
+	{ "bad coverage",  0.01f, 0,      0.1f,  120 },
+	{ "combined",      0.1f,  3600,   0.05f, 90  },
+};
+
+enum { SIM_SAMPLE, SIM_REPORT, SIM_ALARM, SIM_TASKS };
+
+struct sim_task {
+	const char *name;
+	uint8_t id;           // Scheduler task number
+	uint32_t period;      // ms, 0 for the alarms
+	uint64_t first;       // Start of the first slot, ms
+	uint32_t runs;
+	uint32_t late_count;  // Runs more than SIM_LATE_MS late
+	uint32_t late_max;
+	double late_sum;
+	double late_squares;
+};
+
+static const struct sim_load *load;
+static struct sim_task tasks[SIM_TASKS];
+static uint64_t now_ms;
+static uint64_t end_ms;
+static uint64_t slept_ms;
+static uint32_t sleeps;
+static uint64_t next_alarm;     // Time of the next external event, ms
+static uint64_t alarm_posted;   // Oldest event not handled yet, ms
+static bool alarm_pending;
+static uint32_t alarms;         // Events posted
+static uint32_t alarms_dropped; // Event queue full
+static uint32_t seed;
+static jmp_buf sim_over;
+static task_lc report_lc;       // Reset with the scheduler, the run in progress is dropped
+
+
+// xorshift32, the same sequence on every host
+static float sim_random(void) {
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return (float)(seed >> 8) / (1ul << 24);
+}
+
+static void sim_next_alarm(void) {
+	if (load->alarm_mean == 0) {
+		next_alarm = UINT64_MAX;
+		return;
+	}
+	next_alarm = now_ms + (uint64_t)(-log(1 - sim_random()) * load->alarm_mean * 1000) + 1;
+}
+
+static void alarm_task(void);
+
+// Moves the clock to <to>, the events on the way are posted like the interrupt routine would
+static void sim_advance(uint64_t to) {
+	while (next_alarm <= to) {
+		now_ms = next_alarm;
+		alarms++;
+		if (sched_post(alarm_task) != 0) {
+			alarms_dropped++;
+		}
+		else if (!alarm_pending) {
+			alarm_pending = true;
+			alarm_posted = now_ms;
+		}
+		sim_next_alarm();
+	}
+	now_ms = to;
+}
+
+uint64_t sched_host_clock(void) {
+	return now_ms;
+}
+
+void sched_host_sleep(uint32_t wake) {
+	uint64_t until = now_ms + (uint32_t)(wake - (uint32_t)now_ms);
+	if (next_alarm < until) { // Woken up by the interrupt
+		until = next_alarm;
+	}
+	if (until >= end_ms) {
+		longjmp(sim_over, 1); // Out of sched_mainloop()
+	}
+	slept_ms += until - now_ms;
+	sleeps++;
+	sim_advance(until);
+}
+
+unsigned long millis(void) {
+	return (unsigned long)now_ms;
+}
+
+unsigned long micros(void) {
+	return (unsigned long)(now_ms * 1000);
+}
+
+void delay(unsigned long ms) {
+	sim_advance(now_ms + ms);
+}
+
+// A run of <t> starts, <late> ms after its slot
+static void sim_late(struct sim_task *t, uint64_t late) {
+	t->runs++;
+	t->late_sum += late;
+	t->late_squares += (double)late * late;
+	t->late_max = max(t->late_max, (uint32_t)late);
+	t->late_count += (late > SIM_LATE_MS);
+}
+
+// A run of the cyclic task <t> starts, it belongs to the last slot started
+static void sim_slot(struct sim_task *t) {
+	sim_late(t, (now_ms - t->first) % t->period);
+}
+
+
+static void sample_task(void) {
+	sim_slot(&tasks[SIM_SAMPLE]);
+	uint32_t ms = SIM_SAMPLE_MS + (uint32_t)(sim_random() * 10);
+	if (sim_random() < load->sample_retry) {
+		ms += SIM_RETRY_MS;
+	}
+	delay(ms);
+}
+
+static void report_task(void) {
+	static uint64_t registered;
+	static uint8_t chunk;
+	task_lc &lc = report_lc;
+	TASK_BEGIN(lc);
+	sim_slot(&tasks[SIM_REPORT]);
+	delay(SIM_POWER_ON_MS);
+	registered = now_ms + 5000 + (uint64_t)(sim_random() * load->register_max * 1000);
+	TASK_WAIT_UNTIL_MS(lc, now_ms >= registered, 100);
+	if (sim_random() < load->modem_hang) {
+		delay(SIM_HANG_MS);
+	}
+	for (chunk = 0; chunk < SIM_CHUNKS; chunk++) {
+		delay(SIM_CHUNK_MS);
+		TASK_SLEEP_MS(lc, SIM_CHUNK_WAIT_MS);
+	}
+	TASK_END(lc);
+}
+
+static void alarm_task(void) {
+	sim_late(&tasks[SIM_ALARM], now_ms - alarm_posted);
+	alarm_pending = false; // The events posted until now are handled by this run
+	delay(SIM_ALARM_MS);
+}
+
+
+static void sim_print(const struct sim_task *t, uint32_t slots) {
+	double mean = t->runs ? t->late_sum / t->runs : 0;
+	double variance = t->runs ? t->late_squares / t->runs - mean * mean : 0;
+	uint32_t sched = (t->id != SCHED_NO_TASK) ? sched_missed(t->id) : 0;
+	printf("  %-8s %9lu %8lu %8lu %10.1f %10.1f %9lu %8lu\n", t->name, (unsigned long)t->runs,
+		(unsigned long)(slots - min(slots, t->runs)), (unsigned long)sched, mean, sqrt(max(variance, 0.0)),
+		(unsigned long)t->late_max, (unsigned long)t->late_count);
+}
+
+static void sim_run(const struct sim_load *l, uint32_t days, uint32_t s) {
+	load = l;
+	seed = s;
+	now_ms = 0;
+	end_ms = days * 86400000ull;
+	slept_ms = 0;
+	sleeps = 0;
+	alarm_pending = false;
+	alarms = 0;
+	alarms_dropped = 0;
+	report_lc = 0;
+	memset(tasks, 0, sizeof(tasks));
+	sim_next_alarm();
+
+	clock_t wall = clock();
+	sched_setup();
+	tasks[SIM_SAMPLE].name = "sample";
+	tasks[SIM_SAMPLE].period = SIM_SAMPLE_PERIOD * 1000ul;
+	tasks[SIM_SAMPLE].first = 1000;
+	tasks[SIM_SAMPLE].id = sched_add_task(sample_task, 1, SIM_SAMPLE_PERIOD, SCHED_PRIORITY_HIGH,
+		SCHED_CATCHUP_SKIP);
+	tasks[SIM_REPORT].name = "report";
+	tasks[SIM_REPORT].period = SIM_REPORT_PERIOD * 1000ul;
+	tasks[SIM_REPORT].first = 30000;
+	tasks[SIM_REPORT].id = sched_add_task(report_task, 30, SIM_REPORT_PERIOD, SCHED_PRIORITY_LOW,
+		SCHED_CATCHUP_COALESCE);
+	tasks[SIM_ALARM].name = "alarm";
+	tasks[SIM_ALARM].id = SCHED_NO_TASK; // A new task for every event
+	if (setjmp(sim_over) == 0) {
+		sched_mainloop();
+	}
+	double seconds = (double)(clock() - wall) / CLOCKS_PER_SEC;
+
+	printf("%s : %lu days in %.2f s, awake %.4f %%, %lu sleeps, %lu alarms (%lu dropped)\n", load->name,
+		(unsigned long)days, seconds, 100.0 * (now_ms - slept_ms) / now_ms, (unsigned long)sleeps,
+		(unsigned long)alarms, (unsigned long)alarms_dropped);
+	printf("  %-8s %9s %8s %8s %10s %10s %9s %8s\n", "task", "runs", "missed", "sched", "late ms", "jitter",
+		"worst", "> 1s");
+	for (uint8_t i = 0; i < SIM_TASKS; i++) {
+		const struct sim_task *t = &tasks[i];
+		uint32_t slots = t->period ? (uint32_t)((now_ms - t->first) / t->period + 1) : alarms;
+		sim_print(t, slots);
+	}
+}
+
+int main(int argc, char **argv) {
+	uint32_t days = (argc > 1) ? strtoul(argv[1], NULL, 10) : SIM_DAYS;
+	uint32_t s = (argc > 2) ? strtoul(argv[2], NULL, 10) : SIM_SEED;
+	if (days == 0) {
+		days = SIM_DAYS;
+	}
+	if (s == 0) { // xorshift never leaves 0
+		s = SIM_SEED;
+	}
+	for (uint8_t i = 0; i < sizeof(loads) / sizeof(loads[0]); i++) {
+		sim_run(&loads[i], days, s);
+	}
+	return 0;
+}
@@ -17,9 +17,8 @@
 #elif LORA
 #ifndef __SAMD21G18A__
 #error Wrong board !
-#include "lora_communication.h"
-#include "lora_jobs.h"
 #endif
+#include "lora_communication.h"
 #else
 #error Define either GSM or LORA on the project settings !
 #endif
@@ -86,10 +85,10 @@ void setup()
 	sched_setup();
 
 	db("scheduler add task");
-	sched_add_task(sampling_task, SAMPLING_LOOPTIME, SAMPLING_LOOPTIME);
+	sched_add_task(sampling_task, SAMPLING_LOOPTIME, SAMPLING_LOOPTIME, SCHED_PRIORITY_HIGH, SCHED_CATCHUP_COALESCE); // Adapts its period
 
 	db("scheduler add task");
-	sched_add_task(reporting_task, REPORTING_LOOPTIME, REPORTING_LOOPTIME);
+	sched_add_task(reporting_task, REPORTING_LOOPTIME, REPORTING_LOOPTIME, SCHED_PRIORITY_LOW, SCHED_CATCHUP_COALESCE);
 
 	db("scheduler mainloop");
 	delay(100);
@@ -0,0 +1,152 @@
+//
+//
+//
+
+#define DB_MODULE "Alarm Task"
+#include "debug.h"
+
+#include "alarm_task.h"
+#include "sampling_task.h"
+#include "reporting_task.h"
+#include "task_scheduler.h"
+#include "communication.h"
+
+#define ALARM_NO_FIELD 0xFF
+
+struct alarm_rule {
+	uint8_t field;    // Sample field checked
+	uint8_t minus;    // Field subtracted from <field> (absolute difference), ALARM_NO_FIELD if none
+	uint8_t above;    // 1 if the rule triggers above <set>, 0 if below
+	uint16_t set;     // Trigger threshold
+	uint16_t clear;   // Release threshold
+	uint8_t bit;      // Bit of the alarm mask
+};
+
+const struct alarm_rule alarm_rules[] = {
+	{ FIELD_RSOC, ALARM_NO_FIELD, 0, ALARM_SOC_LOW, ALARM_SOC_CLEAR, ALARM_SOC },
+	{ FIELD_BT, ALARM_NO_FIELD, 1, ALARM_TEMP_HIGH, ALARM_TEMP_CLEAR, ALARM_TEMP },
+	{ FIELD_CV1, FIELD_CV4, 1, ALARM_IMBALANCE_HIGH, ALARM_IMBALANCE_CLEAR, ALARM_IMBALANCE }
+};
+
+uint8_t alarm_active[BOX_MAX];    // Rules currently triggered
+uint8_t alarm_reported[BOX_MAX];  // Alarms waiting for the report
+uint8_t alarm_last_payg[BOX_MAX];
+uint8_t alarm_payg_known = 0;     // Bit per box
+uint8_t alarm_tries = 0;
+uint8_t alarm_box = 0;            // Box of the last raised alarm, the record of its sample goes with the report
+uint8_t alarm_record[RECORD_MAX_SIZE];
+uint8_t alarm_record_len = 0;
+uint8_t alarm_payload[ALARM_PAYLOAD_SIZE]; // Report in flight, the alarms raised meanwhile go with the next one
+uint8_t alarm_payload_len;
+
+
+void alarm_check(uint8_t box, const uint8_t *sample, uint16_t missing, int16_t payg_state) {
+	uint8_t raised = 0;
+	for (uint8_t i = 0; i < sizeof(alarm_rules) / sizeof(alarm_rules[0]); i++) {
+		const struct alarm_rule *rule = &alarm_rules[i];
+		if (missing & (1 << rule->field) || (rule->minus != ALARM_NO_FIELD && missing & (1 << rule->minus))) {
+			continue; // Keep the current state
+		}
+		uint16_t value = sample_field(sample, rule->field);
+		if (rule->minus != ALARM_NO_FIELD) {
+			value = abs((int32_t)value - (int32_t)sample_field(sample, rule->minus));
+		}
+		bool trigger = rule->above ? value > rule->set : value < rule->set;
+		bool release = rule->above ? value < rule->clear : value > rule->clear;
+		if (!(alarm_active[box] & rule->bit) && trigger) {
+			alarm_active[box] |= rule->bit;
+			raised |= rule->bit;
+		}
+		else if ((alarm_active[box] & rule->bit) && release) {
+			alarm_active[box] &= ~rule->bit;
+		}
+	}
+	if (payg_state >= 0) {
+		if ((alarm_payg_known & (1 << box)) && payg_state != alarm_last_payg[box]) {
+			raised |= ALARM_PAYG;
+		}
+		alarm_last_payg[box] = payg_state;
+		alarm_payg_known |= 1 << box;
+	}
+
+	if (raised) {
+		db_print("alarm raised: "); db_println(raised);
+		alarm_reported[box] |= raised;
+		alarm_box = box;
+		alarm_record_len = sample_record(box, sample, missing, alarm_record);
+		alarm_tries = 0;
+		// Right away, a pending report is moved forward (or called again once the one in flight is over)
+		sched_add_task(alarm_report_task, 0, 0, SCHED_PRIORITY_HIGH, SCHED_CATCHUP_ALL, SCHED_UNIQUE);
+	}
+}
+
+task_lc alarm_lc = 0;
+comm_status_code alarm_code;
+
+/*
+	Cooperative task, returns while the modem connects and waits for the server
+*/
+void alarm_run(void) {
+	uint8_t reply[50];
+
+	TASK_BEGIN(alarm_lc);
+	db("Start");
+
+	// Alarms of every box (one byte each), the box that raised the last one and the record of its sample
+	// The GSM parameters repeat the masks and the box
+	{
+		for (uint8_t box = 0; box < BOX_MAX; box++) {
+			alarm_payload[box] = alarm_reported[box] | alarm_active[box];
+		}
+		alarm_payload[BOX_MAX] = alarm_box;
+		memcpy(alarm_payload + BOX_MAX + 1, alarm_record, alarm_record_len);
+		alarm_payload_len = BOX_MAX + 1 + alarm_record_len;
+
+		strcpy(report_url, getIdBox(alarm_box));
+		char param[20];
+		sprintf(param, "&CL=%u&BOX=%u&ALM=", alarm_payload_len, alarm_box);
+		strcat(report_url, param);
+		for (uint8_t box = 0; box < BOX_MAX; box++) {
+			sprintf(param, "%02x", alarm_payload[box]);
+			strcat(report_url, param);
+		}
+		strcat(report_url, "\"");
+	}
+
+	REPORT_WAIT_UNTIL(alarm_lc, (alarm_code = comm_start_report(alarm_payload_len, COMM_REPORT_ALARM, report_url)) != COMM_PENDING);
+	if (alarm_code == COMM_OK) {
+		comm_fill_report(alarm_payload, alarm_payload_len);
+		REPORT_WAIT_UNTIL(alarm_lc, (alarm_code = comm_send_report(reply)) != COMM_PENDING);
+	}
+	else if (alarm_code == COMM_ERR_RETRY) {
+		REPORT_WAIT_UNTIL(alarm_lc, comm_abort() != COMM_PENDING);
+	}
+
+	if (alarm_code == COMM_OK) {
+		db("alarm reported");
+		for (uint8_t box = 0; box < BOX_MAX; box++) {
+			alarm_reported[box] &= ~alarm_payload[box];
+		}
+	}
+	else if (++alarm_tries < ALARM_MAX_TRIES) {
+		db("alarm report failed, retry later");
+		sched_add_task(alarm_report_task, ALARM_RETRY_TIME, 0, SCHED_PRIORITY_HIGH, SCHED_CATCHUP_ALL, SCHED_UNIQUE);
+	}
+	else {
+		// The alarms stay pending, tried again at the routine report pace (sooner if an other alarm is raised)
+		db("alarm report failed");
+		sched_add_task(alarm_report_task, REPORTING_LOOPTIME, 0, SCHED_PRIORITY_HIGH, SCHED_CATCHUP_ALL, SCHED_UNIQUE);
+	}
+	TASK_END(alarm_lc);
+}
+
+void alarm_report_task(void) {
+	if (!modem_take()) { // A report is in flight, the alarms go right after it
+		sched_resume(MODEM_BUSY_RETRY, REPORT_POLL_LIGHT);
+		return;
+	}
+	alarm_run();
+	if (alarm_lc == 0) {
+		modem_release();
+	}
+}
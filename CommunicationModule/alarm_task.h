@@ -0,0 +1,52 @@
+// alarm_task.h
+
+#ifndef _ALARM_TASK_h
+#define _ALARM_TASK_h
+
+#include "arduino.h"
+#include "sampling_task.h"
+
+/*
+	Critical conditions detection
+
+	Every new sample goes through a set of threshold rules with hysteresis :
+	a rule triggers when its value crosses <set>, and is only released once the value went back past <clear>
+	A PAYG state change is an alarm on its own
+	When a rule triggers, a short report is scheduled to run right away, instead of waiting for the next routine report
+	Its payload : the alarm masks of the boxes (one byte each, BOX_MAX), the index of the box that raised the last
+	alarm, then the record of its sample (see sample_record), sent on its own LoRa port
+	Every box of the site has its own alarm state
+*/
+
+// Thresholds, in box units
+#define ALARM_SOC_LOW          10    // %
+#define ALARM_SOC_CLEAR        15
+#define ALARM_TEMP_HIGH        3282  // 0.1 K, 55 C
+#define ALARM_TEMP_CLEAR       3232  // 50 C
+#define ALARM_IMBALANCE_HIGH   200   // mV between CV1 and CV4
+#define ALARM_IMBALANCE_CLEAR  100
+
+// Bits of the alarm mask sent with the report
+#define ALARM_SOC        0x01
+#define ALARM_TEMP       0x02
+#define ALARM_IMBALANCE  0x04
+#define ALARM_PAYG       0x08
+
+#define ALARM_RETRY_TIME  300  // Seconds before retrying a failed alarm report
+#define ALARM_MAX_TRIES   3    // Then tried again at the routine report pace, until it goes
+#define ALARM_PAYLOAD_SIZE  (BOX_MAX + 1 + RECORD_MAX_SIZE)
+
+
+/*
+	Runs the rules on a new sample of <box>, <missing> is the mask of the fields that couldn't be read
+	<payg_state> is the current PAYG state byte, or -1 if unknown
+*/
+void alarm_check(uint8_t box, const uint8_t *sample, uint16_t missing, int16_t payg_state);
+
+/*
+	Sends the alarm report, scheduled by alarm_check()
+	Cooperative task, waits for the modem if a routine report is in flight
+*/
+void alarm_report_task(void);
+
+#endif
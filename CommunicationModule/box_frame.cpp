@@ -0,0 +1,100 @@
+//
+//
+//
+
+#include <stddef.h>
+#include "box_frame.h"
+
+#ifdef __AVR__
+#include "util/crc16.h"
+#endif
+
+
+uint8_t bf_crc_update(uint8_t crc, uint8_t data) {
+#ifdef __AVR__
+	return _crc_ibutton_update(crc, data);
+#else
+	crc = crc ^ data;
+	for (uint8_t i = 0; i < 8; i++) {
+		if (crc & 0x01) {
+			crc = (crc >> 1) ^ 0x8C;
+		}
+		else {
+			crc >>= 1;
+		}
+	}
+	return crc;
+#endif
+}
+
+void bf_init(struct box_parser *p, const uint8_t *preamble) {
+	p->preamble = preamble;
+	p->head = 0;
+	p->tail = 0;
+	p->exp_head = 0;
+	p->exp_tail = 0;
+	p->pos = 0;
+	p->crc = 0;
+	p->dropped = 0;
+}
+
+uint8_t bf_expect(struct box_parser *p, uint8_t len) {
+	if ((uint8_t)(p->exp_head - p->exp_tail) >= BOX_EXPECT_MAX || len > BOX_FRAME_MAX || len <= BF_PREAMBLE_LEN) {
+		return -1;
+	}
+	p->expected[p->exp_head % BOX_EXPECT_MAX] = len;
+	p->exp_head++;
+	return 0;
+}
+
+void bf_feed(struct box_parser *p, uint8_t c) {
+	if (p->exp_head == p->exp_tail || (uint8_t)(p->head - p->tail) >= BOX_FRAME_QUEUE) { // No answer expected, or no room to store it
+		p->dropped++;
+		return;
+	}
+
+	struct box_frame *f = &p->frames[p->head % BOX_FRAME_QUEUE];
+	if (p->pos < BF_PREAMBLE_LEN && c != p->preamble[p->pos]) { // Lost sync, the byte may start a new preamble
+		p->dropped += p->pos + 1;
+		p->pos = 0;
+		p->crc = 0;
+		if (c != p->preamble[0]) {
+			return;
+		}
+		p->dropped--;
+	}
+
+	uint8_t len = p->expected[p->exp_tail % BOX_EXPECT_MAX];
+	f->data[p->pos++] = c;
+	if (p->pos < len) {
+		p->crc = bf_crc_update(p->crc, c);
+		return;
+	}
+
+	// Last byte is the CRC
+	f->len = len;
+	f->ok = (p->crc == c);
+	p->pos = 0;
+	p->crc = 0;
+	p->exp_tail++;
+	p->head++;
+}
+
+struct box_frame *bf_peek(struct box_parser *p) {
+	if (p->tail == p->head) {
+		return NULL;
+	}
+	return &p->frames[p->tail % BOX_FRAME_QUEUE];
+}
+
+void bf_pop(struct box_parser *p) {
+	if (p->tail != p->head) {
+		p->tail++;
+	}
+}
+
+void bf_reset(struct box_parser *p) {
+	p->pos = 0;
+	p->crc = 0;
+	p->exp_tail = p->exp_head;
+}
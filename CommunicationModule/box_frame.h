@@ -0,0 +1,99 @@
+// box_frame.h
+
+#ifndef _BOX_FRAME_h
+#define _BOX_FRAME_h
+
+#include <stdint.h>
+
+/*
+	Incremental parser of the battery box answers
+
+	Bytes are fed one at a time as they are received (from the UART receive event or from a recorded stream)
+	The parser syncs on the address preamble of the box (C5 6A 29 by default), collects the number of bytes announced by bf_expect()
+	and keeps the Maxim/Dallas CRC8 up to date on the way, so a frame is checked as soon as its last byte arrives
+	Completed frames are queued until the caller gets them with bf_peek() / bf_pop()
+
+	Only depends on stdint, so it can be compiled on the host and fed with recorded byte streams
+	bf_feed() is the only producer and may run from an interrupt, every other call belongs to the consumer
+*/
+
+#define BOX_FRAME_MAX     32  // Longest answer, preamble and CRC included
+#define BOX_FRAME_QUEUE   2   // Completed frames waiting for the consumer (power of 2)
+#define BOX_EXPECT_MAX    4   // Answers that can be expected at the same time (power of 2)
+#define BF_PREAMBLE_LEN   3
+
+struct box_frame {
+	uint8_t len;    // Number of bytes in data, preamble and CRC included
+	uint8_t ok;     // 1 if the CRC matched
+	uint8_t data[BOX_FRAME_MAX];
+};
+
+struct box_parser {
+	struct box_frame frames[BOX_FRAME_QUEUE];
+	volatile uint8_t head;        // Frames completed so far (free running, the slot is head % BOX_FRAME_QUEUE)
+	volatile uint8_t tail;        // Frames released so far
+	uint8_t pos;                  // Bytes received for the current frame
+	uint8_t crc;                  // Running CRC of the current frame
+	uint8_t expected[BOX_EXPECT_MAX];
+	volatile uint8_t exp_head;    // Answers announced so far (free running)
+	volatile uint8_t exp_tail;    // Answers received so far
+	uint8_t dropped;              // Bytes dropped (noise, nothing expected or queue full)
+	const uint8_t *preamble;      // Address preamble of the box, BF_PREAMBLE_LEN bytes
+};
+
+/*
+	Maxim/Dallas CRC8, same as _crc_ibutton_update of avr-libc
+*/
+uint8_t bf_crc_update(uint8_t crc, uint8_t data);
+
+/*
+	Compile time versions of the CRC, for the command tables
+	bf_crc_frame() is the CRC of the default preamble followed by <b0>..<b3> (only the first <n> bytes are used)
+*/
+constexpr uint8_t bf_crc_bits(uint8_t crc, uint8_t n) {
+	return n == 0 ? crc : bf_crc_bits((crc & 0x01) ? (crc >> 1) ^ 0x8C : crc >> 1, n - 1);
+}
+
+constexpr uint8_t bf_crc_const(uint8_t crc, uint8_t data) {
+	return bf_crc_bits(crc ^ data, 8);
+}
+
+constexpr uint8_t bf_crc_frame(uint8_t n, uint8_t b0, uint8_t b1 = 0, uint8_t b2 = 0, uint8_t b3 = 0) {
+	return n == 0 ? bf_crc_const(bf_crc_const(bf_crc_const(0, 0xc5), 0x6a), 0x29)
+		: bf_crc_const(bf_crc_frame(n - 1, b0, b1, b2), n == 1 ? b0 : n == 2 ? b1 : n == 3 ? b2 : b3);
+}
+
+/*
+	Clear the parser, the queued frames and the expected answers, then sync on the answers of the box at <preamble>
+*/
+void bf_init(struct box_parser *p, const uint8_t *preamble);
+
+/*
+	Announce the length (preamble and CRC included) of the next answer, in the order the requests are sent
+	Returns -1 if too many answers are already expected
+*/
+uint8_t bf_expect(struct box_parser *p, uint8_t len);
+
+/*
+	Feed one received byte
+*/
+void bf_feed(struct box_parser *p, uint8_t c);
+
+/*
+	Returns the oldest completed frame, or NULL if there is none
+*/
+struct box_frame *bf_peek(struct box_parser *p);
+
+/*
+	Release the frame returned by bf_peek()
+*/
+void bf_pop(struct box_parser *p);
+
+/*
+	Drop the frame in progress and every expected answer, the queued frames are kept
+	To be used after a timeout, when the answers still in flight can't be trusted anymore
+	Must not race with bf_feed(), mask the receive event first if it feeds from an interrupt
+*/
+void bf_reset(struct box_parser *p);
+
+#endif
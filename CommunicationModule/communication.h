@@ -11,9 +11,18 @@
 enum comm_status_code {
 	COMM_OK,          // Function executed
 	COMM_ERR_RETRY,       // Module unexpected error, retry a few times or abort
-	COMM_ERR_RETRY_LATER    // Connection error, connection closed, data discarded, report aborted, module shutdown
+	COMM_ERR_RETRY_LATER,    // Connection error, connection closed, data discarded, report aborted, module shutdown
+	COMM_PENDING      // Waiting on the module, call the function again (same arguments) to go on
 };
 
+// Report types (see comm_start_report)
+#define COMM_REPORT_TEST     1  // Setup test, GSM : posted to the test URL
+#define COMM_REPORT_DATA     2  // Compressed samples
+#define COMM_REPORT_SUMMARY  3  // Window summary record (see window_stats.h)
+#define COMM_REPORT_ALARM    4  // Alarm masks and record (see alarm_task.h)
+#define COMM_REPORT_PROFILE  5  // Scheduler profile record, LoRa (the GSM reports carry it in their parameters)
+#define COMM_REPORT_RANGE    6  // Stored records asked again by the server (see reporting_task.h)
+
 /*
 	Configure Serial and IO pins to operate the communication module. If the module is ON, turn it OFF
 	Always returns COMM_OK
@@ -22,11 +31,14 @@ enum comm_status_code comm_setup(void);
 
 /*
 	Turn on the module, connect to the network, start a session and prepare to send data
+	<type> is one of COMM_REPORT_, the GSM module posts the data reports with the <url> parameters, the LoRa module
+	drops them and sends each type on its own FPort (the server tells the payloads apart by port)
 	Returns COMM_OK if the module is connected and a data session was open.
 	Returns COMM_ERR_RETRY if the boot or some of the issued commands failed.
 	Returns COMM_ERR_RETRY_LATER if the timeout of the network subscription was reached
+	Returns COMM_PENDING while waiting for the network (the calls only block for the short command exchanges)
 */
-enum comm_status_code comm_start_report(uint16_t totallen, uint8_t type, char * opid);
+enum comm_status_code comm_start_report(uint16_t totallen, uint8_t type, char * url);
 
 /*
 	Send binary data for the report contents
@@ -36,13 +48,16 @@ enum comm_status_code comm_fill_report(const uint8_t *buffer, int length);
 
 /*
 	Issue the report and await for results, then shut down the module
+	The server reply is copied to <buffer> (50 bytes at most, not terminated), NULL to drop it
 	Returns COMM_OK on a successfuly sent report. Returns COMM_ERR_RETRY on module error. Returns COMM_ERR_RETRY_LATER on timeouts and connection errors
+	Returns COMM_PENDING while waiting for the server answer
 */
 enum comm_status_code comm_send_report(uint8_t *buffer);
 
 /*
 	Stop any on-going opperation and shut down the module. Performs a hardware reset if the module is not responding (might take several seconds)
 	Returns COMM_OK if the module was shut down, COMM_ERR_RETRY if the module didn't answer to the shutdown command even after reset
+	Returns COMM_PENDING while the module reboots
 */
 enum comm_status_code comm_abort(void);
 
@@ -0,0 +1,86 @@
+//
+//
+//
+
+#include "entropy_coder.h"
+
+#define EC_TOP        (1ul << 24)  // Renormalisation threshold
+#define EC_PROB_INIT  128
+#define EC_ADAPT      4            // Adaptation speed, 1/16th
+
+
+inline void ec_emit(struct entropy_coder *ec, uint8_t c) {
+	if (ec->put) {
+		ec->put(c);
+	}
+	ec->out_len++;
+}
+
+// Output the top byte of low, holding back the 0xFF runs that a carry could still modify
+static void ec_shift_low(struct entropy_coder *ec) {
+	if (ec->low < 0xFF000000ul || ec->carry) {
+		uint8_t temp = ec->cache;
+		do {
+			ec_emit(ec, temp + ec->carry);
+			temp = 0xFF;
+		} while (--ec->cache_size != 0);
+		ec->cache = (uint8_t)(ec->low >> 24);
+	}
+	ec->cache_size++;
+	ec->low <<= 8;
+	ec->carry = 0;
+}
+
+void ec_init(struct entropy_coder *ec, void(*put)(uint8_t)) {
+	ec->low = 0;
+	ec->range = 0xFFFFFFFFul;
+	ec->carry = 0;
+	ec->cache = 0;
+	ec->cache_size = 1;
+	ec->out_len = 0;
+	ec->put = put;
+	for (int i = 0; i < 255; i++) {
+		ec->probs[i] = EC_PROB_INIT;
+	}
+}
+
+inline void ec_encode_bit(struct entropy_coder *ec, uint8_t *prob, uint8_t bit) {
+	uint32_t bound = (ec->range >> 8) * *prob;
+	if (bit) {
+		uint32_t old = ec->low;
+		ec->low += bound;
+		if (ec->low < old) { // Overflow, propagate on the next shift
+			ec->carry = 1;
+		}
+		ec->range -= bound;
+		*prob -= *prob >> EC_ADAPT;
+	}
+	else {
+		ec->range = bound;
+		*prob += (256 - *prob) >> EC_ADAPT;
+	}
+	while (ec->range < EC_TOP) {
+		ec->range <<= 8;
+		ec_shift_low(ec);
+	}
+}
+
+void ec_encode(struct entropy_coder *ec, const uint8_t *data, uint16_t len) {
+	for (uint16_t i = 0; i < len; i++) {
+		uint8_t c = data[i];
+		uint8_t node = 1;
+		for (uint8_t b = 0; b < 8; b++) { // MSB first, walking down the bit tree
+			uint8_t bit = (c >> 7) & 1;
+			ec_encode_bit(ec, &ec->probs[node - 1], bit);
+			node = (node << 1) | bit;
+			c <<= 1;
+		}
+	}
+}
+
+uint16_t ec_finish(struct entropy_coder *ec) {
+	for (uint8_t i = 0; i < 5; i++) {
+		ec_shift_low(ec);
+	}
+	return ec->out_len;
+}
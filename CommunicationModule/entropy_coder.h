@@ -0,0 +1,51 @@
+// entropy_coder.h
+
+#ifndef _ENTROPY_CODER_h
+#define _ENTROPY_CODER_h
+
+#include "arduino.h"
+
+/*
+	Entropy coding stage applied to the report payload, after the LZFX compression
+
+	Adaptive order-0 binary range coder (same arithmetic as the LZMA range coder, with 8 bit probabilities)
+	Each byte is coded MSB first on a 255 nodes bit tree, every node holding the probability of a 0 bit in 1/256th
+	The model starts flat (128) and adapts by 1/16th after every bit, no table has to be sent with the data
+
+	Server side decoder :
+		skip the first byte (always 0), code = next 4 bytes (big endian), range = 0xFFFFFFFF, every prob = 128
+		for each bit : bound = (range >> 8) * prob
+			if code < bound : range = bound, bit = 0, prob += (256 - prob) >> 4
+			else            : code -= bound, range -= bound, bit = 1, prob -= prob >> 4
+			while range < 2^24 : range <<= 8, code = (code << 8) | next byte
+	The number of bytes to decode is given by the ENC parameter of the report url
+*/
+
+struct entropy_coder {
+	uint32_t low;
+	uint32_t range;
+	uint8_t carry;            // 33rd bit of low
+	uint8_t cache;            // Last byte held back until the carry is known
+	uint16_t cache_size;      // Number of pending bytes (cache + 0xFF run)
+	uint16_t out_len;         // Number of bytes produced so far
+	void(*put)(uint8_t);      // Output sink, NULL to only count the produced bytes
+	uint8_t probs[255];
+};
+
+/*
+	Reset the coder and its model, coded bytes are handed to <put> (or only counted if NULL)
+*/
+void ec_init(struct entropy_coder *ec, void(*put)(uint8_t));
+
+/*
+	Code <len> bytes from <data>
+*/
+void ec_encode(struct entropy_coder *ec, const uint8_t *data, uint16_t len);
+
+/*
+	Flush the pending bytes
+	Returns the total number of coded bytes
+*/
+uint16_t ec_finish(struct entropy_coder *ec);
+
+#endif
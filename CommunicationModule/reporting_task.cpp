@@ -10,6 +10,9 @@
 #include "sampling_task.h"
 #include "storage_manager.h"
 #include "communication.h"
+#include "entropy_coder.h"
+#include "window_stats.h"
+#include "box_frame.h"
 
 
 uint8_t connection_retries = 0;
@@ -19,33 +22,34 @@ void reporting_setup(void){
 
 }
 
-// Retry reporting_task later
+// Retry reporting_task later, merged with its next run if it's pending already
 void reschedule(void) {
 	if (connection_retries < RETRY_CONNECTION_MAX_TRIES) {
 		db("rescheduling");
-		sched_add_task(reporting_task, RETRY_CONNECTION_TIME, 0);
+		sched_add_task(reporting_task, RETRY_CONNECTION_TIME, 0, SCHED_PRIORITY_LOW, SCHED_CATCHUP_ALL, SCHED_UNIQUE);
 		connection_retries++;
 	}
 }
 
-char * getIdBox(void) {
-	char buff[15] = "";
-	uint8_t code = get_opid_from_box((uint8_t *) buff);
+char * getIdBox(uint8_t box) {
+	static char buff[OPID_SIZE + 1];
+	buff[OPID_SIZE] = 0;
+	uint8_t code = get_opid_from_box(box, (uint8_t *) buff);
 	if (code != 0) {
 		for (int j = 0; j < OPID_SIZE; j++) {
 			buff[j] = '0';
 		}
-		buff[14] = 0;
 	}
 	return buff;
 }
 
 char * getPaygstate(void) {
-	char buff[31] = "";
-	uint8_t temp[15];
-	uint8_t code = get_paygState_from_box(temp);
+	static char buff[2 * PAYG_STATE_SIZE + 1];
+	uint8_t temp[PAYG_STATE_SIZE];
+	buff[0] = 0;
+	uint8_t code = get_paygState_from_box(0, temp);
 	if (code != 0) {
-		for (int j = 0; j < 15; j++) {
+		for (int j = 0; j < PAYG_STATE_SIZE; j++) {
 			temp[j] = 0;
 		}
 	}
@@ -61,6 +65,112 @@ char * getPaygstate(void) {
 	return buff;
 }
 
+#ifdef REPORT_ENTROPY_CODING
+#define CODED_CHUNK_SIZE 32
+uint8_t coded_chunk[CODED_CHUNK_SIZE];
+uint8_t coded_chunk_len = 0;
+struct entropy_coder report_coder; // Off the stack, report_run() already holds the fetch buffer and the reply
+
+// Range coder output, forwarded to the report by small chunks
+void coded_put(uint8_t c) {
+	coded_chunk[coded_chunk_len++] = c;
+	if (coded_chunk_len == CODED_CHUNK_SIZE) {
+		comm_fill_report(coded_chunk, coded_chunk_len);
+		coded_chunk_len = 0;
+	}
+}
+
+/*
+	Dry run of the range coder over the next <len> bytes of compressed data, then rewind the read head
+	Returns the coded length, 0 if the memory could not be read
+*/
+uint16_t coded_length(struct entropy_coder *ec, uint16_t len) {
+	uint8_t chunk[CODED_CHUNK_SIZE];
+	ec_init(ec, NULL);
+	while (len != 0) {
+		uint16_t fetchlen = min(len, CODED_CHUNK_SIZE);
+		if (stor_read_comp(chunk, fetchlen) != fetchlen) {
+			stor_abort_comp();
+			return 0;
+		}
+		ec_encode(ec, chunk, fetchlen);
+		len -= fetchlen;
+	}
+	stor_abort_comp();
+	return ec_finish(ec);
+}
+#endif
+
+#ifdef SCHED_PROFILE
+/*
+	Sums up the scheduler profile since its last reset, in <values> :
+	awake time in 1/1000th of the elapsed time, calls longer than SCHED_OVERRUN_MS, worst start lateness (s)
+*/
+#define PROFILE_AWAKE     0
+#define PROFILE_OVERRUNS  1
+#define PROFILE_LATE      2
+#define PROFILE_VALUES    3
+void profile_values(uint16_t *values) {
+	struct sched_profile profile;
+	sched_profile_snapshot(&profile);
+	uint16_t overruns = 0;
+	uint32_t late = 0;
+	for (uint8_t i = 0; i < SCHED_MAX_TASKS; i++) {
+		overruns += profile.tasks[i].overruns;
+		if (profile.tasks[i].late_max > late) {
+			late = profile.tasks[i].late_max;
+		}
+	}
+	uint32_t awake = profile.elapsed ? profile.awake / profile.elapsed : 0; // ms per s
+	values[PROFILE_AWAKE] = awake > 1000 ? 1000 : awake;
+	values[PROFILE_OVERRUNS] = overruns;
+	values[PROFILE_LATE] = late / 1000;
+}
+
+#ifdef REPORT_PROFILE_RECORD
+#define PROFILE_RECORD_SIZE (2 * PROFILE_VALUES)
+uint32_t profile_sent = 0; // sched_time() of the last profile uplink
+
+/*
+	Fills the report with the profile record : awake, overruns and lateness (see profile_values), 16 bits little endian
+*/
+void profile_fill(void) {
+	uint16_t values[PROFILE_VALUES];
+	uint8_t record[PROFILE_RECORD_SIZE];
+	profile_values(values);
+	for (uint8_t i = 0; i < PROFILE_VALUES; i++) {
+		record[2 * i] = values[i];
+		record[2 * i + 1] = values[i] >> 8;
+	}
+	comm_fill_report(record, PROFILE_RECORD_SIZE);
+}
+#else
+/*
+	Appends the scheduler profile since the last report to <url> :
+	AWK awake time in 1/1000th of the elapsed time, OVR calls longer than SCHED_OVERRUN_MS, LAT worst start lateness (s)
+*/
+void profile_url(char *url) {
+	uint16_t values[PROFILE_VALUES];
+	profile_values(values);
+	char param[30];
+	sprintf(param, "&AWK=%u&OVR=%u&LAT=%u", values[PROFILE_AWAKE], values[PROFILE_OVERRUNS], values[PROFILE_LATE]);
+	strcat(url, param);
+}
+#endif
+#endif
+
+#ifdef REPORT_SUMMARY
+static_assert(STATS_RECORD_SIZE <= MAX_BYTES_PER_REPORT, "summary record doesn't fit in a report");
+
+/*
+	Fills the report with the summary of the current window
+*/
+void summary_fill(void) {
+	uint8_t record[STATS_RECORD_SIZE];
+	comm_fill_report(record, stats_summary(record, sched_time()));
+}
+#endif
+
 /*
 	Check available data,
 	Start report,
@@ -68,200 +178,478 @@ char * getPaygstate(void) {
 	Send report
 
 	For a complete explanation, see flow chart : https://docs.google.com/drawings/d/1VrfocBie4MKbHMRCDibGaBfLuZse3hcOaG2OG4jfAq4/edit
+
+	Cooperative task : while the modem connects or waits for the server, the task returns and is called again every
+	REPORT_POLL_MS, the sampling task keeps its cadence
+	The memory is only used (SPI on) between the waits, the read head is committed once the report was sent
 */
 #define STOR_FUN_MAX_RETRIES 3
-void reporting_task(void){
+
+// State of the report in flight, kept across the waits
+struct report_state {
+	task_lc lc;
+	uint8_t tries;
+	boolean memfailed;
+	bool samples_remaining;
+	bool coded;
+	uint16_t available;
+	uint16_t payload;
+	comm_status_code code;
+	uint32_t range_t0;     // Range asked by the server
+	uint32_t range_t1;
+	uint32_t range_first;  // Time of the first record of the range report
+	uint16_t range_len;
+};
+
+struct report_state report;
+char report_url[REPORT_URL_SIZE];
+
+uint8_t modem_owner = SCHED_NO_TASK;
+
+bool modem_take(void) {
+	uint8_t id = sched_task_id();
+	if (modem_owner != SCHED_NO_TASK && modem_owner != id) {
+		return false;
+	}
+	modem_owner = id;
+	return true;
+}
+
+void modem_release(void) {
+	modem_owner = SCHED_NO_TASK;
+}
+
+// Gives the data back to the memory for the next report
+inline void report_rewind(void) {
+	stor_abort_comp();
+}
+
+/*
+	Looks for a range request in the server <reply> (terminated) : RNG=<t0>,<t1>
+	Returns true and sets report.range_t0 and report.range_t1 if there's one
+*/
+bool range_request(const char *reply) {
+	const char *command = strstr(reply, "RNG=");
+	if (command == NULL) {
+		return false;
+	}
+	char *end;
+	report.range_t0 = strtoul(command + 4, &end, 10);
+	if (*end != ',') {
+		return false;
+	}
+	report.range_t1 = strtoul(end + 1, &end, 10);
+	return report.range_t1 >= report.range_t0;
+}
+
+/*
+	Looks for the box list in the server <reply> (terminated) : BOX=<address>,<address>... , the preambles of the
+	other boxes of the site in hex (c56a2a), an empty list for a single box. Hands it to the sampling task
+*/
+void box_request(const char *reply) {
+	const char *command = strstr(reply, "BOX=");
+	if (command == NULL) {
+		return;
+	}
+	uint8_t addresses[(BOX_MAX - 1) * BF_PREAMBLE_LEN];
+	uint8_t len = 0;
+	command += 4;
+	while (true) {
+		char hex[3] = { command[0], 0, 0 };
+		char *end;
+		if (hex[0] != 0) {
+			hex[1] = command[1];
+		}
+		uint8_t value = strtoul(hex, &end, 16);
+		if (end != hex + 2) { // End of the list
+			break;
+		}
+		if (len == sizeof(addresses)) {
+			db("too many boxes");
+			return;
+		}
+		addresses[len++] = value;
+		command += 2;
+		if (len % BF_PREAMBLE_LEN == 0 && *command == ',') {
+			command++;
+		}
+	}
+	if (len % BF_PREAMBLE_LEN != 0) {
+		db("bad box list");
+		return;
+	}
+	sampling_set_boxes(addresses, len / BF_PREAMBLE_LEN);
+}
+
+/*
+	Length of the records of the requested range, 0 if there's none or if the memory could not be read
+*/
+uint16_t range_length(void) {
+	uint16_t len = 0;
+	if (stor_start() == 0) {
+		len = stor_read_range(report.range_t0, report.range_t1, NULL, RANGE_RECORDS_MAX, &report.range_first);
+	}
+	stor_abort();
+	return len;
+}
+
+/*
+	Fills the report with the requested range : time of the first record, then the records
+	Returns false if they changed since range_length() (overwritten by the new samples meanwhile)
+*/
+bool range_fill(void) {
+	uint8_t records[RANGE_RECORDS_MAX];
+	uint32_t first = 0;
+	uint16_t len = 0;
+	if (stor_start() == 0) {
+		len = stor_read_range(report.range_t0, report.range_t1, records, report.range_len, &first);
+	}
+	stor_abort();
+	if (len != report.range_len || first != report.range_first) {
+		return false;
+	}
+	uint8_t header[RANGE_HEADER_SIZE];
+	for (uint8_t i = 0; i < RANGE_HEADER_SIZE; i++) {
+		header[i] = first >> (8 * i);
+	}
+	comm_fill_report(header, RANGE_HEADER_SIZE);
+	comm_fill_report(records, len);
+	return true;
+}
+
+void report_run(void) {
+	uint8_t reply[301];
+
+	TASK_BEGIN(report.lc);
 	db("Start");
 	// Check
 	// Turn on memory
-	uint8_t tries = 0;
-	boolean memfailed = false;
-	while (stor_start() && tries < STOR_FUN_MAX_RETRIES) tries++;
-	if (tries == STOR_FUN_MAX_RETRIES) {
+	report.tries = 0;
+	report.memfailed = false;
+	while (stor_start() && report.tries < STOR_FUN_MAX_RETRIES) report.tries++;
+	if (report.tries == STOR_FUN_MAX_RETRIES) {
 		db("Failed to start memory");
 		stor_abort_comp();
 		stor_abort();
-		memfailed = true;
+		report.memfailed = true;
 	}
 	
 	
 	// Query available data
 	db("querrying data");
-	uint16_t available = 0;
-	if (memfailed)
-		available = SAMPLE_SIZE;
+	report.available = 0;
+	if (report.memfailed)
+		report.available = SAMPLE_SIZE;
 	else
-		available = stor_available_comp();
+		report.available = stor_available_comp();
 		db("available = ");
-		Serial.println(available);
+		Serial.println(report.available);
 
-	if (available == 0) { // If not enough samples available, abort
+	if (report.available == 0) { // If not enough samples available, abort
 		db("not enough samples, abort");
 		stor_abort();
 		stor_abort_comp(); 
-		memfailed = true;
-		available = SAMPLE_SIZE;
+		report.memfailed = true;
+		report.available = SAMPLE_SIZE;
 	}
 	// If too many samples, trim and signal that the task has to be re-run later
-	bool samples_remaining = false;
-	if (available > MAX_BYTES_PER_REPORT) {
+	report.samples_remaining = false;
+	if (report.available > MAX_BYTES_PER_REPORT) {
 		db("too many samples, trim");
-		samples_remaining = true;
-		available = MAX_BYTES_PER_REPORT - (MAX_BYTES_PER_REPORT % SAMPLE_SIZE); // Fit a full number of samples
+		report.samples_remaining = true;
+		report.available = MAX_BYTES_PER_REPORT - (MAX_BYTES_PER_REPORT % SAMPLE_SIZE); // Fit a full number of samples
+	}
+#ifdef REPORT_SUMMARY
+	// Backlog too long for one report : the summary of the window goes first, in its own report, then the samples
+	// are drained by trimmed reports as usual
+	if (report.samples_remaining) {
+		if (!report.memfailed) {
+			stor_abort(); // SPI off while the modem connects, nothing was read yet
+		}
+		db("sending summary");
+		strcpy(report_url, getIdBox(0));
+		strcat(report_url, "&SUM=1\"");
+		REPORT_WAIT_UNTIL(report.lc, (report.code = comm_start_report(STATS_RECORD_SIZE, COMM_REPORT_SUMMARY, report_url)) != COMM_PENDING);
+		if (report.code == COMM_OK) {
+			summary_fill();
+			REPORT_WAIT_UNTIL(report.lc, (report.code = comm_send_report(reply)) != COMM_PENDING);
+		}
+		if (report.code != COMM_OK) {
+			db("summary failed");
+			if (report.code == COMM_ERR_RETRY) { // RETRY_LATER shuts down the module already
+				REPORT_WAIT_UNTIL(report.lc, comm_abort() != COMM_PENDING);
+			}
+			reschedule();
+			TASK_EXIT(report.lc);
+		}
+		stats_reset(sched_time());
+		if (!report.memfailed) {
+			stor_start(); // Back on for the samples
+		}
 	}
+#endif
 	db("got amount of data");
 
-	// Start Comm session
-	comm_status_code code;
-	tries = 0;
-	while (tries < START_COMM_MAX_RETRIES) {
-		db("attempting to start report");
+	// Entropy coding, only kept if the coded data is smaller
+	report.payload = report.available;
+	report.coded = false;
+#ifdef REPORT_ENTROPY_CODING
+	if (!report.memfailed) {
+		uint16_t codedlen = coded_length(&report_coder, report.available);
+		db_print("coded length: "); db_println(codedlen);
+		if (codedlen != 0 && codedlen < report.available) {
+			report.coded = true;
+			report.payload = codedlen;
+		}
+	}
+#endif
+	if (!report.memfailed) {
+		stor_abort(); // SPI off while the modem connects, the sampling task uses the memory meanwhile
+	}
 
-		char url_add[100];
-		strcpy(url_add, getIdBox());
+	// Report parameters, the box values come from the sampling cache
+	// The records are tagged with the index of their box, B<index> gives the OPID of the other boxes of the site
+	{
+		strcpy(report_url, getIdBox(0));
 		char contLen[30];
-		sprintf(contLen, "&CL=%u", available);
-		strcat(url_add, contLen);
-		db_print("url add: ");
-		db_println(url_add);
-		char paygState[50];
-		strcat(url_add, "&PGS=");
-		strcat(url_add, getPaygstate());
-		strcat(url_add, "\"");
+		sprintf(contLen, "&CL=%u", report.payload);
+		strcat(report_url, contLen);
+		if (report.coded) {
+			sprintf(contLen, "&ENC=%u", report.available); // Decoded length
+			strcat(report_url, contLen);
+		}
+		strcat(report_url, "&PGS=");
+		strcat(report_url, getPaygstate());
+#if defined(SCHED_PROFILE) && !defined(REPORT_PROFILE_RECORD)
+		profile_url(report_url);
+#endif
+		for (uint8_t box = 1; box < BOX_MAX; box++) {
+			if (sampling_boxes() & (1 << box)) {
+				sprintf(contLen, "&B%u=", box);
+				strcat(report_url, contLen);
+				strcat(report_url, getIdBox(box));
+			}
+		}
+		strcat(report_url, "\"");
 		db_print("url add: ");
-		db_println(url_add);
+		db_println(report_url);
+	}
 
-		code = comm_start_report(available, 2, url_add); // 2 == post data
+	// Start Comm session
+	report.tries = 0;
+	while (report.tries < START_COMM_MAX_RETRIES) {
+		db("attempting to start report");
+
+		REPORT_WAIT_UNTIL(report.lc, (report.code = comm_start_report(report.payload, COMM_REPORT_DATA, report_url)) != COMM_PENDING);
 
 		// If module error: Try a few more times and die
-		if (code == COMM_ERR_RETRY) {
+		if (report.code == COMM_ERR_RETRY) {
 			db("module error");
-			tries++;
+			report.tries++;
 			continue;
 		}
 
 		// If connection error: 
-		if (code == COMM_ERR_RETRY_LATER) { // Reschedule task for later
+		if (report.code == COMM_ERR_RETRY_LATER) { // Reschedule task for later
 			db("connection failed");
 			reschedule();
 			//comm_abort(); RETRY_LATER shuts down the module already
-			if(!memfailed)
-				stor_abort();
-				stor_abort_comp();
-			return;
+			report_rewind();
+			TASK_EXIT(report.lc);
 		}
 		
 		// Else: We did it !
 		break;
 	}
-	if (tries == START_COMM_MAX_RETRIES) { // Failed to start report.
+	if (report.tries == START_COMM_MAX_RETRIES) { // Failed to start report.
 		db("reached max retries on start");
 		reschedule();
-		comm_abort();
-		if(!memfailed)
-			stor_abort();
-			stor_abort_comp();
-		return;
+		REPORT_WAIT_UNTIL(report.lc, comm_abort() != COMM_PENDING);
+		report_rewind();
+		TASK_EXIT(report.lc);
 	}
 	// Else :
 	db("module connected");
 
 	// Fill in the samples
-	uint8_t buffer[FETCH_BUFFER_MAX_SIZE/2];
-	while (available != 0) {
-	//	Fetch a reasonable amount of samples
-		db("reading samples from memory");
-		uint16_t fetchlen = FETCH_BUFFER_MAX_SIZE/2;
-		if (fetchlen > available) {
-			fetchlen = available;
-		}
-
-		if (memfailed) {
-			for (int i = 0; i < SAMPLE_SIZE; i++)
-				buffer[i] = 101;
-		}
-		else {
-			uint16_t readlen;
-			tries = 0;
-			while ((readlen = stor_read_comp(buffer, fetchlen)) && readlen != fetchlen && tries < STOR_FUN_MAX_RETRIES) tries++;
-			if (tries == STOR_FUN_MAX_RETRIES) {
-				db("Failed to read memory");
-				reschedule();
-				comm_abort();
-				stor_abort();
-				stor_abort_comp();
-				return;
-			}
+	report.tries = 0;
+	if (!report.memfailed) {
+		while (stor_start() && report.tries < STOR_FUN_MAX_RETRIES) report.tries++;
+	}
+	if (report.tries < STOR_FUN_MAX_RETRIES) {
+		uint8_t buffer[FETCH_BUFFER_MAX_SIZE/2];
+#ifdef REPORT_ENTROPY_CODING
+		if (report.coded) {
+			ec_init(&report_coder, coded_put);
+			coded_chunk_len = 0;
 		}
-		available -= fetchlen;
+#endif
+		uint16_t available = report.available;
+		while (available != 0) {
+		//	Fetch a reasonable amount of samples
+			db("reading samples from memory");
+			uint16_t fetchlen = FETCH_BUFFER_MAX_SIZE/2;
+			if (fetchlen > available) {
+				fetchlen = available;
+			}
+
+			if (report.memfailed) {
+				for (int i = 0; i < SAMPLE_SIZE; i++)
+					buffer[i] = 101;
+			}
+			else {
+				uint16_t readlen;
+				report.tries = 0;
+				while ((readlen = stor_read_comp(buffer, fetchlen)) && readlen != fetchlen && report.tries < STOR_FUN_MAX_RETRIES) report.tries++;
+				if (report.tries == STOR_FUN_MAX_RETRIES) {
+					break;
+				}
+			}
+			available -= fetchlen;
 
 
 	
 
-	//	Fill in Comm report
-		comm_fill_report(buffer, fetchlen); 
+		//	Fill in Comm report
+#ifdef REPORT_ENTROPY_CODING
+			if (report.coded) {
+				ec_encode(&report_coder, buffer, fetchlen);
+				continue;
+			}
+#endif
+			comm_fill_report(buffer, fetchlen); 
+		}
+#ifdef REPORT_ENTROPY_CODING
+		if (report.coded && available == 0) {
+			ec_finish(&report_coder);
+			comm_fill_report(coded_chunk, coded_chunk_len);
+		}
+#endif
+		if (!report.memfailed) {
+			stor_abort(); // SPI off while waiting for the server, the read head is committed on success
+		}
+	}
+	if (report.tries == STOR_FUN_MAX_RETRIES) {
+		db("Failed to read memory");
+		reschedule();
+		REPORT_WAIT_UNTIL(report.lc, comm_abort() != COMM_PENDING);
+		report_rewind();
+		TASK_EXIT(report.lc);
 	}
 
 	// Dispatch report
 	db("sending report");
-	tries = 0;
-	uint8_t reply[301];
-	for (int i = 0; i < 300; i++)
-		reply[i] = '0';
-	reply[300] = 0;
-	while (tries < START_COMM_MAX_RETRIES) {
-		code = comm_send_report(reply);
+	report.tries = 0;
+	while (report.tries < START_COMM_MAX_RETRIES) {
+		memset(reply, 0, sizeof(reply)); // Terminated for range_request()
+		REPORT_WAIT_UNTIL(report.lc, (report.code = comm_send_report(reply)) != COMM_PENDING);
 		// If connection error: Reschedule
-		if (code == COMM_ERR_RETRY_LATER) {
+		if (report.code == COMM_ERR_RETRY_LATER) {
 			db("connection error");
 			reschedule();
 			//comm_abort(); RETRY_LATER shuts down the module already
-			if(!memfailed)
-				stor_abort();
-				stor_abort_comp();
-			return;
+			report_rewind();
+			TASK_EXIT(report.lc);
 		}
 		// If other errors: Retry
-		if (code == COMM_ERR_RETRY) {
+		if (report.code == COMM_ERR_RETRY) {
 			db("module error, retrying");
-			tries++;
+			report.tries++;
 			continue;
 		}
 		// else: We did it!
 		db("report sent");
 		break;
 	}
-	if (tries == START_COMM_MAX_RETRIES) { // Failed to send report.
+	if (report.tries == START_COMM_MAX_RETRIES) { // Failed to send report.
 		db("reached max retries on send");
-		comm_abort();
-		if(!memfailed)
-			stor_abort();
-			stor_abort_comp();
-		return;
+		REPORT_WAIT_UNTIL(report.lc, comm_abort() != COMM_PENDING);
+		report_rewind();
+		TASK_EXIT(report.lc);
 	}
 	// Else : success
 	
 	// Commit read head
-	if (memfailed) {
+	if (report.memfailed) {
 		db("Finished - memfailed");
 	}
 	else {
 		db("confirming read data");
+		stor_start();
 		stor_end();
 		stor_end_comp();
 	}
 	// Communication closed on successful send_report :)
 
+	// New statistics window
+	stats_reset(sched_time());
+
 	// Samples left to send ? Time slot left to send ?
-	if (samples_remaining && connection_retries < RETRY_CONNECTION_MAX_TRIES-1) {
+	if (report.samples_remaining && connection_retries < RETRY_CONNECTION_MAX_TRIES-1) {
 		db("scheduling extra job");
-		sched_add_task(reporting_task, RETRY_CONNECTION_TIME, 0);
+		sched_add_task(reporting_task, RETRY_CONNECTION_TIME, 0, SCHED_PRIORITY_LOW, SCHED_CATCHUP_ALL, SCHED_UNIQUE);
 	}
 
 	// Reporting successful, reset retry counter
 	connection_retries = 0; // We did it, it's over...
-	
-	return;
+
+	// Box list set by the server
+	box_request((char *)reply);
+
+	// Records asked again by the server, in a report of their own
+	if (!report.memfailed && range_request((char *)reply) && (report.range_len = range_length()) != 0) {
+		db("sending range");
+		strcpy(report_url, getIdBox(0));
+		strcat(report_url, "&RNG=1\"");
+		REPORT_WAIT_UNTIL(report.lc, (report.code = comm_start_report(RANGE_HEADER_SIZE + report.range_len, COMM_REPORT_RANGE, report_url)) != COMM_PENDING);
+		if (report.code == COMM_OK) {
+			if (range_fill()) {
+				REPORT_WAIT_UNTIL(report.lc, (report.code = comm_send_report(reply)) != COMM_PENDING);
+			}
+			else {
+				db("range changed");
+				report.code = COMM_ERR_RETRY; // The length given to the module is wrong, drop the report
+			}
+		}
+		if (report.code == COMM_ERR_RETRY) { // RETRY_LATER shuts down the module already
+			REPORT_WAIT_UNTIL(report.lc, comm_abort() != COMM_PENDING);
+		}
+	}
+
+#if defined(SCHED_PROFILE) && defined(REPORT_PROFILE_RECORD)
+	// The profile goes right after a routine report, in its own uplink once every PROFILE_REPORT_TIME
+	// It keeps accumulating until it was sent
+	if (sched_time() - profile_sent >= PROFILE_REPORT_TIME) {
+		db("sending profile");
+		REPORT_WAIT_UNTIL(report.lc, (report.code = comm_start_report(PROFILE_RECORD_SIZE, COMM_REPORT_PROFILE, report_url)) != COMM_PENDING);
+		if (report.code == COMM_OK) {
+			profile_fill();
+			REPORT_WAIT_UNTIL(report.lc, (report.code = comm_send_report(reply)) != COMM_PENDING);
+		}
+		if (report.code == COMM_OK) {
+			sched_profile_reset();
+			profile_sent = sched_time();
+		}
+		else if (report.code == COMM_ERR_RETRY) { // RETRY_LATER shuts down the module already
+			REPORT_WAIT_UNTIL(report.lc, comm_abort() != COMM_PENDING);
+		}
+	}
+#elif defined(SCHED_PROFILE)
+	sched_profile_reset();
+#endif
+	TASK_END(report.lc);
+}
+
+void reporting_task(void) {
+	if (!modem_take()) { // An other report is in flight, the report starts once it's over
+		db("modem busy");
+		sched_resume(MODEM_BUSY_RETRY, REPORT_POLL_LIGHT);
+		return;
+	}
+	report_run();
+	if (report.lc == 0) { // Done, not waiting
+		modem_release();
+	}
 }
 
 uint8_t reporting_test(uint8_t *buffer, int length) {
@@ -270,11 +658,15 @@ uint8_t reporting_test(uint8_t *buffer, int length) {
 	comm_status_code code;
 
 	db("attempting to start report");
-	code = comm_start_report(length, 1, getIdBox()); // 1 = test
+	while ((code = comm_start_report(length, COMM_REPORT_TEST, getIdBox(0))) == COMM_PENDING) { // Blocking (setup)
+		sched_idle();
+	}
 
 	// If module error: stop
 	if (code == COMM_ERR_RETRY || code == COMM_ERR_RETRY_LATER) {
-		comm_abort();
+		while (comm_abort() == COMM_PENDING) {
+			sched_idle();
+		}
 		return RETEST;
 	}
 	// Else :
@@ -291,7 +683,9 @@ uint8_t reporting_test(uint8_t *buffer, int length) {
 		reply[i] = '0';
 	reply[49] = 0;
 	while (tries < START_COMM_MAX_RETRIES) {
-		code = comm_send_report(reply);
+		while ((code = comm_send_report(reply)) == COMM_PENDING) {
+			sched_idle();
+		}
 		if (code == COMM_ERR_RETRY || code == COMM_ERR_RETRY_LATER) {
 			db("module error, retrying");
 			tries++;
@@ -303,7 +697,9 @@ uint8_t reporting_test(uint8_t *buffer, int length) {
 	}
 	if (tries == START_COMM_MAX_RETRIES) { // Failed to send report.
 		db("reached max retries on send");
-		comm_abort();
+		while (comm_abort() == COMM_PENDING) {
+			sched_idle();
+		}
 		return RETEST;
 	}
 	// Else : success
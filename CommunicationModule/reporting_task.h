@@ -8,9 +8,15 @@
 #ifdef GSM
 #define REPORTING_LOOPTIME 14400
 #define MAX_BYTES_PER_REPORT 65536u
+#define REPORT_ENTROPY_CODING  // Range code the compressed data before sending it (see entropy_coder.h)
+#define REPORT_POLL_LIGHT true  // The modem answers on the UART, polled in a light sleep
 #elif LORA
 #define REPORTING_LOOPTIME  600
 #define MAX_BYTES_PER_REPORT 55u
+#define REPORT_SUMMARY  // Send the window summary ahead of the samples when they don't fit (see window_stats.h)
+#define REPORT_PROFILE_RECORD  // The scheduler profile goes in an uplink of its own, the URL parameters are dropped
+#define PROFILE_REPORT_TIME  3600  // Seconds between two profile uplinks, the profile covers the whole time
+#define REPORT_POLL_LIGHT false  // lora_task runs the MAC, the reports only wait for its events in a deep sleep
 #endif
 
 // Variables for module state
@@ -26,15 +32,43 @@
 
 #define FETCH_BUFFER_MAX_SIZE 512u
 
+#define MODEM_BUSY_RETRY 10 // Seconds before a report checks again for the modem used by an other one
+#define REPORT_POLL_MS 100   // Milliseconds between two calls of a report task while it waits on the modem
+#define REPORT_WAIT_UNTIL(lc, cond) TASK_WAIT_UNTIL_MS_SLEEP(lc, cond, REPORT_POLL_MS, REPORT_POLL_LIGHT)
+#define REPORT_URL_SIZE (130 + (BOX_MAX - 1) * (OPID_SIZE + 4)) // Scheduler profile included
+
+// Range reports : the server can ask again for the stored records of a time window by putting RNG=<t0>,<t1> in
+// its reply to a routine report (seconds since the last restart, counted from the restart marker of the records)
+// The records still in the memory go right after it, in a report of their own : the time of the first one
+// (4 bytes, little endian) then the records as stored, up to RANGE_RECORDS_MAX bytes. The server asks again from
+// the end of what it got for the rest of the window
+#define RANGE_HEADER_SIZE 4
+#define RANGE_RECORDS_MAX min(FETCH_BUFFER_MAX_SIZE / 4, MAX_BYTES_PER_REPORT - RANGE_HEADER_SIZE)
+
 
 void reporting_setup(void);
 
 void reporting_task(void);
 
+/*
+	The modem is used by one report at a time : the reporting and alarm tasks take it for the whole report,
+	waits included. Returns false if an other task holds it (true if the calling task already does)
+*/
+bool modem_take(void);
+
+void modem_release(void);
+
+/*
+	Parameters of the report in flight, given to every call of comm_start_report() (owned by the modem holder)
+*/
+extern char report_url[];
+
 uint8_t reporting_test(uint8_t *buffer, int length);
 
 char * getPaygstate(void);
 
+char * getIdBox(uint8_t box);
+
 
 
 #endif
@@ -7,33 +7,42 @@
 
 #include "sampling_task.h"
 #include "storage_manager.h"
+#include "task_scheduler.h"
+#include "box_frame.h"
+#include "alarm_task.h"
+#include "window_stats.h"
+
+
+// Address preambles of the boxes of the site, every request and every answer starts with it
+// The first one is the default address of the boxes (the command table CRCs are computed for it), the others are
+// set by the server for sites with several boxes on the bus and kept in the memory (see sampling_set_boxes)
+// The index in this table is the box id tagged on the records
+byte box_addresses[BOX_MAX][BF_PREAMBLE_LEN] = {
+	{ 0xc5, 0x6a, 0x29 },
+};
+uint8_t box_count = 1;   // Addresses in box_addresses
 
-#ifdef __AVR__
-#include "util/crc16.h"
-#else
-static inline uint8_t _crc_ibutton_update(uint8_t crc, uint8_t data) __attribute__((always_inline, unused));
-static inline uint8_t _crc_ibutton_update(uint8_t crc, uint8_t data)
-{
-	unsigned int i;
+#define BOX_PROBE_PERIOD  3600 // Seconds between two probes of the absent boxes
 
-	crc = crc ^ data;
-	for (i = 0; i < 8; i++) {
-		if (crc & 0x01) {
-			crc = (crc >> 1) ^ 0x8C;
-		}
-		else {
-			crc >>= 1;
-		}
-	}
-	return crc;
-}
+#define BOX_WAKE_LEN        16   // Zeros sent once at the start of a session
+#define BOX_ANSWER_TIMEOUT  100  // ms of silence before an answer is considered lost
+#define BOX_PIPELINE_DEPTH  1    // Requests sent ahead of their answers, raise it if the box queues them (up to BOX_EXPECT_MAX)
 
-#endif // __AVR__
 
+#define CMD_REFRESH_NEVER 0xFFFF  // Read once, then always served from the cache
+#define PAYG_REFRESH      3600    // Payg state is read by the sampling task at this pace, for the reporting task
+#define PS_REFRESH        60      // PAYG state byte, watched by the alarms : a lock or unlock is seen on the next sample
 
-// Fills 0 until the 16th, then preamble address
-const byte msg_header[] = {0,0,0,0, 0,0,0,0, 0,0,0,0, 0,0,0,0, 0xc5,0x6a,0x29};
+// Last answer of a slow-changing value, for each box
+struct command_cache {
+	uint8_t valid;            // Bit per box
+	uint32_t time[BOX_MAX];   // sched_time() of the last answer
+	uint8_t *data;            // BOX_MAX x datalen bytes
+};
 
+#define COMMAND_CACHE(name, size) \
+	uint8_t name##_data[BOX_MAX * size]; \
+	struct command_cache name = { 0, { 0 }, name##_data };
 
 struct command {
 	byte bytes[8]; // The message 'string'
@@ -41,33 +50,99 @@ struct command {
 	uint8_t anslen; // The lenght of the expected answer
 	uint8_t datapos; // The position of the data on the answer
 	uint8_t datalen; // The lenght of the data
+	uint16_t refresh; // Seconds during which the cached answer is used instead of querying the box
+	struct command_cache *cache; // NULL if the command is sent every time
 };
 
-const struct command cmd_OPID = { { 0x07, 0x01, 0x0e, 0x9a }, 4, 21, 6, 14}; // OEM Product ID
-const struct command cmd_PPID = { { 0x07, 0x08, 0x14, 0xcb }, 4, 27, 6, 20}; // PAYG Product ID
-const struct command cmd_PS = { { 0x06, 0x09, 0x57 }, 3, 8, 5, 1 }; // PAYG state
-const struct command cmd_OCS = { { 0x06, 0x0a, 0xb5 }, 3, 8, 5, 1 }; // Output state
-const struct command cmd_SSC = { { 0x06, 0x0b, 0xeb }, 3, 8, 5, 1 }; // System Status Code
-const struct command cmd_RPD = { { 0x06, 0x05, 0xf4 }, 3, 8, 5, 2 }; // Remaining PAYG days
-const struct command cmd_RSOC = { { 0x06, 0x0c, 0x68 }, 3, 8, 5, 1 }; // Relative SOC
-const struct command cmd_RC = { { 0x06, 0x0d, 0x36 }, 3, 8, 5, 2 }; // Remaining Capaciry
-const struct command cmd_FCC = { { 0x06, 0x0e, 0xd4 }, 3, 8, 5, 2 }; // Full Charge Capacity
-const struct command cmd_ACC = { { 0x06, 0x0f, 0x8a }, 3, 8, 5, 2 }; // Accumulative energy output
-const struct command cmd_AC = { { 0x06, 0x10, 0x56 }, 3, 8, 5, 2 }; // Discharge cycles
-const struct command cmd_PD = { { 0x06, 0x07, 0x48 }, 3, 8, 5, 2 }; // Top up days
-const struct command cmd_RDB = { { 0x06, 0x013, 0xb4 }, 3, 8, 5, 2 }; // Running days
-const struct command cmd_HTOP = { { 0x06, 0x11, 0x08 }, 3, 14, 5, 8 }; // HASH TOP
-const struct command cmd_CV1 = { { 0x08, 0x00, 0x3f, 0x02, 0x0b }, 5, 10, 7, 2 }; // Cell voltage
-const struct command cmd_CV2 = { { 0x08, 0x00, 0x3e, 0x02, 0xcf }, 5, 10, 7, 2 };
-const struct command cmd_CV3 = { { 0x08, 0x00, 0x3d, 0x02, 0x9a }, 5, 10, 7, 2 };
-const struct command cmd_CV4 = { { 0x08, 0x00, 0x3c, 0x02, 0x5e }, 5, 10, 7, 2 };
-const struct command cmd_BV = { { 0x08, 0x00, 0x09, 0x02, 0x8c }, 5, 10, 7, 2 }; // Battery voltage
-const struct command cmd_BC = { { 0x08, 0x00, 0x0a, 0x02, 0xd9 }, 5, 10, 7, 2 }; // Battery current
-const struct command cmd_BT = { { 0x08, 0x00, 0x08, 0x02, 0x48 }, 5, 10, 7, 2 }; // Battery temperature
-// cmd_passcode write passcode ...
+COMMAND_CACHE(cache_OPID, 14)
+COMMAND_CACHE(cache_PS, 1)
+COMMAND_CACHE(cache_OCS, 1)
+COMMAND_CACHE(cache_SSC, 1)
+COMMAND_CACHE(cache_RPD, 2)
+COMMAND_CACHE(cache_FCC, 2)
+COMMAND_CACHE(cache_ACC, 2)
+COMMAND_CACHE(cache_HTOP, 8)
+
+struct command_cache * const box_caches[] = { &cache_OPID, &cache_PS, &cache_OCS, &cache_SSC, &cache_RPD, &cache_FCC,
+	&cache_ACC, &cache_HTOP };
+
+/*
+	Command builders, the frame length, checksum (for the default address) and answer layout are computed at compile time
+	Every answer is [preamble, len - 1 header bytes (answer length, echo of the command bytes but the first one and the CRC), data, CRC]
+
+	box_read(reg, datalen)          : 06 reg CRC, answers a 2 bytes word (or a datalen bytes block if longer)
+	box_read_block(bank, datalen)   : 07 bank datalen CRC
+	box_read_word(reg)              : 08 00 reg 02 CRC
+*/
+constexpr struct command box_read(uint8_t reg, uint8_t datalen, uint16_t refresh = 0, struct command_cache *cache = NULL) {
+	return { { 0x06, reg, bf_crc_frame(2, 0x06, reg) }, 3, (uint8_t)(5 + (datalen < 2 ? 2 : datalen) + 1), 5, datalen, refresh, cache };
+}
 
+constexpr struct command box_read_block(uint8_t bank, uint8_t datalen, uint16_t refresh = 0, struct command_cache *cache = NULL) {
+	return { { 0x07, bank, datalen, bf_crc_frame(3, 0x07, bank, datalen) }, 4, (uint8_t)(6 + datalen + 1), 6, datalen, refresh, cache };
+}
+
+constexpr struct command box_read_word(uint8_t reg) {
+	return { { 0x08, 0x00, reg, 0x02, bf_crc_frame(4, 0x08, 0x00, reg, 0x02) }, 5, 10, 7, 2, 0, NULL };
+}
 
-const struct command * const msg_commands[] = {
+// Declares a command and checks at compile time that its answer fits the parser
+#define BOX_COMMAND(name, builder) \
+	constexpr struct command name = builder; \
+	static_assert(name.anslen <= BOX_FRAME_MAX && name.datapos + name.datalen < name.anslen, #name " answer layout");
+
+BOX_COMMAND(cmd_OPID, box_read_block(0x01, 14, CMD_REFRESH_NEVER, &cache_OPID)) // OEM Product ID
+BOX_COMMAND(cmd_PPID, box_read_block(0x08, 20))                                 // PAYG Product ID
+BOX_COMMAND(cmd_PS, box_read(0x09, 1, PS_REFRESH, &cache_PS))                   // PAYG state
+BOX_COMMAND(cmd_OCS, box_read(0x0a, 1, PAYG_REFRESH, &cache_OCS))               // Output state
+BOX_COMMAND(cmd_SSC, box_read(0x0b, 1, PAYG_REFRESH, &cache_SSC))               // System Status Code
+BOX_COMMAND(cmd_RPD, box_read(0x05, 2, PAYG_REFRESH, &cache_RPD))               // Remaining PAYG days
+BOX_COMMAND(cmd_RSOC, box_read(0x0c, 1))                                        // Relative SOC
+BOX_COMMAND(cmd_RC, box_read(0x0d, 2))                                          // Remaining Capaciry
+BOX_COMMAND(cmd_FCC, box_read(0x0e, 2, 43200, &cache_FCC))                      // Full Charge Capacity, drifts over weeks
+BOX_COMMAND(cmd_ACC, box_read(0x0f, 2, PAYG_REFRESH, &cache_ACC))               // Accumulative energy output
+BOX_COMMAND(cmd_AC, box_read(0x10, 2))                                          // Discharge cycles
+BOX_COMMAND(cmd_PD, box_read(0x07, 2))                                          // Top up days
+BOX_COMMAND(cmd_RDB, box_read(0x13, 2))                                         // Running days
+BOX_COMMAND(cmd_HTOP, box_read(0x11, 8, PAYG_REFRESH, &cache_HTOP))             // HASH TOP
+BOX_COMMAND(cmd_CV1, box_read_word(0x3f))                                       // Cell voltage
+BOX_COMMAND(cmd_CV2, box_read_word(0x3e))
+BOX_COMMAND(cmd_CV3, box_read_word(0x3d))
+BOX_COMMAND(cmd_CV4, box_read_word(0x3c))
+BOX_COMMAND(cmd_BV, box_read_word(0x09))                                        // Battery voltage
+BOX_COMMAND(cmd_BC, box_read_word(0x0a))                                        // Battery current
+BOX_COMMAND(cmd_BT, box_read_word(0x08))                                        // Battery temperature
+// cmd_passcode write passcode ...
+
+// The generated commands are the hand written ones they replaced : CRC, answer length, data position and length
+#define BOX_COMMAND_WAS(name, crc, anslen_, datapos_, datalen_) \
+	static_assert(name.bytes[name.len - 1] == crc && name.anslen == anslen_ && name.datapos == datapos_ \
+		&& name.datalen == datalen_, #name " differs from the former table");
+
+BOX_COMMAND_WAS(cmd_OPID, 0x9a, 21, 6, 14)
+BOX_COMMAND_WAS(cmd_PPID, 0xcb, 27, 6, 20)
+BOX_COMMAND_WAS(cmd_PS, 0x57, 8, 5, 1)
+BOX_COMMAND_WAS(cmd_OCS, 0xb5, 8, 5, 1)
+BOX_COMMAND_WAS(cmd_SSC, 0xeb, 8, 5, 1)
+BOX_COMMAND_WAS(cmd_RPD, 0xf4, 8, 5, 2)
+BOX_COMMAND_WAS(cmd_RSOC, 0x68, 8, 5, 1)
+BOX_COMMAND_WAS(cmd_RC, 0x36, 8, 5, 2)
+BOX_COMMAND_WAS(cmd_FCC, 0xd4, 8, 5, 2)
+BOX_COMMAND_WAS(cmd_ACC, 0x8a, 8, 5, 2)
+BOX_COMMAND_WAS(cmd_AC, 0x56, 8, 5, 2)
+BOX_COMMAND_WAS(cmd_PD, 0x48, 8, 5, 2)
+BOX_COMMAND_WAS(cmd_RDB, 0xb4, 8, 5, 2)
+BOX_COMMAND_WAS(cmd_HTOP, 0x08, 14, 5, 8)
+BOX_COMMAND_WAS(cmd_CV1, 0x0b, 10, 7, 2)
+BOX_COMMAND_WAS(cmd_CV2, 0xcf, 10, 7, 2)
+BOX_COMMAND_WAS(cmd_CV3, 0x9a, 10, 7, 2)
+BOX_COMMAND_WAS(cmd_CV4, 0x5e, 10, 7, 2)
+BOX_COMMAND_WAS(cmd_BV, 0x8c, 10, 7, 2)
+BOX_COMMAND_WAS(cmd_BC, 0xd9, 10, 7, 2)
+BOX_COMMAND_WAS(cmd_BT, 0x48, 10, 7, 2)
+
+
+constexpr const struct command * msg_commands[] = {
 	&cmd_RSOC,
 	&cmd_RC,
 	&cmd_FCC,
@@ -80,7 +155,7 @@ const struct command * const msg_commands[] = {
 	&cmd_BC
 };
 
-const struct command * const paygState_commands[] = {
+constexpr const struct command * paygState_commands[] = {
 	&cmd_HTOP,
 	&cmd_RPD,
 	&cmd_ACC,
@@ -89,9 +164,213 @@ const struct command * const paygState_commands[] = {
 	&cmd_SSC
 };
 
+#define BOX_COMMANDS(list) (sizeof(list) / sizeof(list[0]))
+
+// Number of data bytes produced by a command list
+constexpr uint8_t layout_size(const struct command * const *cmds, uint8_t n) {
+	return n == 0 ? 0 : cmds[0]->datalen + layout_size(cmds + 1, n - 1);
+}
+
+static_assert(BOX_COMMANDS(msg_commands) == SAMPLE_FIELDS, "msg_commands doesn't match SAMPLE_FIELDS");
+static_assert(layout_size(msg_commands, BOX_COMMANDS(msg_commands)) == SAMPLE_SIZE, "msg_commands doesn't add up to SAMPLE_SIZE");
+static_assert(layout_size(paygState_commands, BOX_COMMANDS(paygState_commands)) == PAYG_STATE_SIZE, "paygState_commands doesn't add up to PAYG_STATE_SIZE");
+static_assert(cmd_OPID.datalen == OPID_SIZE, "cmd_OPID doesn't match OPID_SIZE");
+
+#ifdef SAMPLING_DEADBAND
+// Error bound of each field of msg_commands, in LSB of the box value
+const uint16_t field_deadband[SAMPLE_FIELDS] = {
+	1,  // RSOC (%)
+	10, // RC (mAh)
+	10, // FCC (mAh)
+	5,  // CV1 (mV)
+	5,  // CV2 (mV)
+	5,  // CV3 (mV)
+	5,  // CV4 (mV)
+	20, // BV (mV)
+	1,  // BT
+	20  // BC (mA)
+};
+
+uint8_t last_stored[BOX_MAX][SAMPLE_SIZE];
+uint8_t samples_since_refresh[BOX_MAX];
+
+/*
+	Tells if the field at <pos> moved beyond its deadband since its last stored value
+*/
+inline bool deadband_exceeded(const uint8_t *sample, const uint8_t *last_stored, uint8_t field, uint8_t pos, uint8_t datalen) {
+	uint16_t delta;
+	if (datalen == 1) {
+		delta = abs((int16_t)sample[pos] - (int16_t)last_stored[pos]);
+	}
+	else {
+		uint16_t val = sample[pos] | (sample[pos + 1] << 8);
+		uint16_t last = last_stored[pos] | (last_stored[pos + 1] << 8);
+		delta = abs((int16_t)(val - last));
+	}
+	return delta > field_deadband[field];
+}
+#endif
+
+/*
+	Builds the record of <sample> : presence mask then the present fields
+	The fields flagged in <missing> couldn't be read from the box, they are left out, SAMPLE_PARTIAL is set and
+	<missing> follows the presence mask
+	The mask is tagged with <box>
+	In deadband mode (and <deadband> set) the fields that didn't move beyond their deadband are left out too, and the
+	last stored values are updated, so the error on a skipped field never exceeds its bound
+	Returns the record length
+*/
+uint8_t build_record(uint8_t box, const uint8_t *sample, uint16_t missing, uint8_t *record, bool deadband) {
+	uint16_t mask = (missing ? SAMPLE_PARTIAL : 0) | ((uint16_t)box << SAMPLE_BOX_SHIFT);
+	uint8_t len = 2;
+	if (missing) {
+		record[len++] = missing;
+		record[len++] = missing >> 8;
+	}
+	uint8_t pos = 0;
+#ifdef SAMPLING_DEADBAND
+	uint8_t *last = last_stored[box];
+	bool full = samples_since_refresh[box] == 0; // First record is a full one
+#endif
+	for (int i = 0; i < SAMPLE_FIELDS; i++) {
+		uint8_t datalen = msg_commands[i]->datalen;
+		bool keep = !(missing & (1 << i));
+#ifdef SAMPLING_DEADBAND
+		if (deadband) {
+			keep = keep && (full || deadband_exceeded(sample, last, i, pos, datalen));
+			if (keep) {
+				memcpy(last + pos, sample + pos, datalen);
+			}
+		}
+#endif
+		if (keep) {
+			mask |= 1 << i;
+			memcpy(record + len, sample + pos, datalen);
+			len += datalen;
+		}
+		pos += datalen;
+	}
+	record[0] = mask;
+	record[1] = mask >> 8;
+#ifdef SAMPLING_DEADBAND
+	if (deadband) {
+		samples_since_refresh[box] = (samples_since_refresh[box] + 1) % DEADBAND_REFRESH;
+	}
+#endif
+	return len;
+}
+
+uint8_t sample_record(uint8_t box, const uint8_t *sample, uint16_t missing, uint8_t *record) {
+	return build_record(box, sample, missing, record, false);
+}
+
+// The layout of sample_field() is the one of msg_commands, from field <i> on
+constexpr bool fields_match(uint8_t i) {
+	return i == SAMPLE_FIELDS || (layout_size(msg_commands, i) == sample_field_pos(i)
+		&& msg_commands[i]->datalen == sample_field_len(i) && fields_match(i + 1));
+}
+
+static_assert(msg_commands[FIELD_RSOC] == &cmd_RSOC && msg_commands[FIELD_CV1] == &cmd_CV1 && msg_commands[FIELD_CV4] == &cmd_CV4
+	&& msg_commands[FIELD_BT] == &cmd_BT && msg_commands[FIELD_BC] == &cmd_BC, "FIELD_ doesn't match msg_commands");
+static_assert(fields_match(0), "sample_field doesn't match msg_commands");
+static_assert(paygState_commands[3] == &cmd_PS && layout_size(paygState_commands, 3) == PAYG_STATE_PS, "PAYG_STATE_PS doesn't match paygState_commands");
+
+uint16_t sampling_interval = SAMPLING_LOOPTIME;
+uint8_t stable_samples = 0;
+uint8_t adapt_started = 0; // Bit per box
+uint8_t last_soc[BOX_MAX];
+int16_t last_bc[BOX_MAX];
+
+#define ACTIVITY_UNKNOWN  0
+#define ACTIVITY_STABLE   1
+#define ACTIVITY_MOVING   2
+
+/*
+	Tells if the battery current or the SOC of <box> moved since its previous sample
+*/
+uint8_t box_activity(uint8_t box, const uint8_t *sample, uint16_t missing) {
+	if (missing & ((1 << FIELD_RSOC) | (1 << FIELD_BC))) { // Can't tell
+		return ACTIVITY_UNKNOWN;
+	}
+	uint8_t soc = sample_field(sample, FIELD_RSOC);
+	int16_t bc = (int16_t)sample_field(sample, FIELD_BC);
+	bool moving = (adapt_started & (1 << box))
+		&& (abs(bc - last_bc[box]) > SAMPLING_BC_STEP || abs((int16_t)soc - (int16_t)last_soc[box]) >= SAMPLING_SOC_STEP);
+	last_soc[box] = soc;
+	last_bc[box] = bc;
+	adapt_started |= 1 << box;
+	return moving ? ACTIVITY_MOVING : ACTIVITY_STABLE;
+}
+
+/*
+	Adapts the sampling interval to the highest <activity> seen on the boxes
+	Returns the delay before the next sample
+*/
+uint16_t adapt_interval(uint8_t activity) {
+	if (activity == ACTIVITY_MOVING) {
+		sampling_interval = SAMPLING_MIN_INTERVAL;
+		stable_samples = 0;
+	}
+	else if (activity == ACTIVITY_STABLE && ++stable_samples >= SAMPLING_STABLE_COUNT) {
+		sampling_interval = min(2 * sampling_interval, SAMPLING_MAX_INTERVAL);
+		stable_samples = 0;
+	}
+
+	db_print("next sample in: "); db_println(sampling_interval);
+	return sampling_interval;
+}
+
+uint16_t box_query(uint8_t box, const struct command * const *cmds, uint8_t n, uint8_t *buffer);
+
+uint8_t box_present = 1;   // Boxes found on the bus, the default one is always polled
+uint32_t box_probed = 0;   // sched_time() of the last probe
+
+/*
+	Looks for the boxes of box_addresses that aren't known yet, by reading their OPID
+*/
+void probe_boxes(void) {
+	uint8_t id[OPID_SIZE];
+	for (uint8_t box = 1; box < box_count; box++) {
+		if (!(box_present & (1 << box)) && get_opid_from_box(box, id) == 0) {
+			db_print("found box: "); db_println(box);
+			box_present |= 1 << box;
+		}
+	}
+	box_probed = sched_time();
+}
+
+uint8_t sampling_boxes(void) {
+	return box_present;
+}
+
 void sampling_setup(void) {
 	db("Setup");
+	box_count = 1 + stor_read_config(box_addresses[1], (BOX_MAX - 1) * BF_PREAMBLE_LEN) / BF_PREAMBLE_LEN;
+	probe_boxes();
+}
 
+uint8_t sampling_set_boxes(const uint8_t *addresses, uint8_t count) {
+	if (count > BOX_MAX - 1) {
+		return -1;
+	}
+	if (count == box_count - 1 && memcmp(box_addresses[1], addresses, count * BF_PREAMBLE_LEN) == 0) {
+		return 0; // Same list, the memory isn't written again
+	}
+	db_print("boxes: "); db_println(count + 1);
+	memcpy(box_addresses[1], addresses, count * BF_PREAMBLE_LEN);
+	box_count = 1 + count;
+
+	// The other ids may be other boxes now, what's known about them is dropped and they're looked for again
+	box_present = 1;
+	box_probed = sched_time() - BOX_PROBE_PERIOD - 1;
+	for (uint8_t i = 0; i < sizeof(box_caches) / sizeof(box_caches[0]); i++) {
+		box_caches[i]->valid &= 1;
+	}
+	adapt_started &= 1;
+#ifdef SAMPLING_DEADBAND
+	memset(samples_since_refresh + 1, 0, BOX_MAX - 1);
+#endif
+	return stor_write_config(box_addresses[1], count * BF_PREAMBLE_LEN);
 }
 
 static uint16_t total_samples = 0;
@@ -117,167 +396,215 @@ inline void get_dummy_data(uint8_t *buffer) {
 
 
 #define MAX_TRIES 5
-inline uint8_t send_command(const struct command *comm, uint8_t *databuff) {
-	uint8_t recv[32];
-
-	// Flush the input buffer
-	delay(50);
-	while (Serial1.available())
-	{
-		Serial1.read();
-		delay(5);
-	}
 
-	// send the command
-	db("sending command");
-	Serial1.write(msg_header, 19);
-	Serial1.write(comm->bytes, comm->len);
+struct box_parser box_rx; // Answers of the box, fed from the Serial1 receive buffer
 
-	// get the answer
-	Serial1.setTimeout(1000);
-	uint8_t nbytes = Serial1.readBytes(recv, comm->anslen);
-
-	// Check answer
-	if (nbytes != comm->anslen) { // Command timeout
-		db("command timeout");
-		return -1;
+/*
+	Sends <comm> to the box at <address>, the CRC of the table is only valid for the default address and is computed
+	again for the others
+*/
+void box_send(const byte *address, const struct command *comm) {
+	Serial1.write(address, BF_PREAMBLE_LEN);
+	if (address == box_addresses[0]) {
+		Serial1.write(comm->bytes, comm->len);
+		return;
 	}
-
-	// Check [C56A29] header/preamble
-	if (recv[0] != 0xC5 || recv[1] != 0x6A || recv[2] != 0x29) {
-		db("bad header");
-		return -1;
+	uint8_t crc = 0;
+	for (uint8_t i = 0; i < BF_PREAMBLE_LEN; i++) {
+		crc = bf_crc_update(crc, address[i]);
 	}
-
-	// Check sum
-	uint8_t sum = 0;
-	for (int j = 0; j < comm->anslen - 1; j++) sum = _crc_ibutton_update(sum, recv[j]); // Maxim/Dallas CRC8
-	if (sum != recv[comm->anslen - 1]) { // Bad checksum
-		db("bad checksum");
-		return -1;
-	}
-
-	// we did it, copy the data
-	memcpy(databuff, recv + comm->datapos, comm->datalen);
-	db_module(); db_print("got :");
-#ifdef _DEBUG
-	for (int i; i < comm->datalen; i++) {
-		Serial.print(" ");
-		Serial.print((byte)databuff[i], HEX);
+	for (uint8_t i = 0; i < comm->len - 1; i++) {
+		crc = bf_crc_update(crc, comm->bytes[i]);
 	}
-	db_println();
-#endif // _DEBUG
-	return 0;
+	Serial1.write(comm->bytes, comm->len - 1);
+	Serial1.write(crc);
 }
 
-inline uint8_t get_data_from_box(uint8_t *buffer) {
-	db("getting data from box");
+/*
+	Runs a list of commands in a single session with <box>
+	The wake-up zeros are sent once, then the requests are sent back to back (up to BOX_PIPELINE_DEPTH ahead)
+	The answers are parsed byte by byte as they are received, the MCU idles between the bytes
+	A command without a valid answer is requeued after the others, each command has its own budget of MAX_TRIES
+	so only the missing answers are requested again
+	Cached commands are only sent once their refresh period is over, the session isn't opened if none is due
+	The data of each command is copied to <buffer>, in the list order (zeros for the failed ones)
+	Returns a bitmask of the failed commands, 0 if all of them were answered
+*/
+uint16_t box_query(uint8_t box, const struct command * const *cmds, uint8_t n, uint8_t *buffer) {
+	uint16_t pending = (n < 16) ? (1u << n) - 1 : 0xFFFF; // Commands still to be answered
+	uint16_t inflight_mask = 0;
+	uint16_t failed = 0;
+	uint8_t inflight[BOX_PIPELINE_DEPTH] = { 0 }; // Commands sent and not answered yet, oldest first
+	uint8_t sent = 0;                     // Free running counters of the requests sent and answered
+	uint8_t answered = 0;
+	uint8_t cursor = 0;                   // Where to look for the next command to send
+	uint8_t tries[16];
+	uint8_t offset[16];                   // Position of the data of each command in <buffer>
+	unsigned long last_activity = millis();
+	uint32_t now = sched_time();
+
+	memset(tries, 0, sizeof(tries));
+
+	// Serve what's still fresh from the cache
+	uint8_t pos = 0;
+	for (uint8_t i = 0; i < n; i++) {
+		offset[i] = pos;
+		struct command_cache *cache = cmds[i]->cache;
+		if (cache && (cache->valid & (1 << box)) && (cmds[i]->refresh == CMD_REFRESH_NEVER || now - cache->time[box] < cmds[i]->refresh)) {
+			memcpy(buffer + pos, cache->data + box * cmds[i]->datalen, cmds[i]->datalen);
+			pending &= ~(1u << i);
+		}
+		pos += cmds[i]->datalen;
+	}
+	if (!pending) {
+		return 0;
+	}
+	if (box >= box_count) { // No address for it, nothing is cached either
+		memset(buffer, 0, pos);
+		return pending;
+	}
+	const byte *address = box_addresses[box];
 
 	// (Re)Configure serial interface to the box
 	Serial1.begin(38400);
+	while (Serial1.available()) {
+		Serial1.read();
+	}
+	bf_init(&box_rx, address);
+	for (uint8_t i = 0; i < BOX_WAKE_LEN; i++) {
+		Serial1.write((uint8_t)0);
+	}
 
-	//digitalWrite(LED_BUILTIN, HIGH);
+	while (pending) {
+		// Keep the pipeline full, going round the list of the commands still pending
+		while ((uint8_t)(sent - answered) < BOX_PIPELINE_DEPTH && (pending & ~inflight_mask)) {
+			while (!((pending & ~inflight_mask) & (1u << cursor))) {
+				cursor = (cursor + 1) % n;
+			}
+			const struct command *comm = cmds[cursor];
+			bf_expect(&box_rx, comm->anslen);
+			box_send(address, comm);
+			if (sent == answered) {
+				last_activity = millis();
+			}
+			inflight[sent % BOX_PIPELINE_DEPTH] = cursor;
+			inflight_mask |= 1u << cursor;
+			sent++;
+			cursor = (cursor + 1) % n;
+		}
 
-	// run all sampling commands
-	uint8_t tries = 0;
-	for (int i = 0; i < 10; i++) {
-		tries = 0;
-		while (send_command(msg_commands[i], buffer) && tries < MAX_TRIES) {
-			tries++;
+		// Hand the received bytes to the parser
+		while (Serial1.available()) {
+			bf_feed(&box_rx, Serial1.read());
+			last_activity = millis();
+		}
+
+		uint8_t idx = inflight[answered % BOX_PIPELINE_DEPTH];
+		struct box_frame *frame = bf_peek(&box_rx);
+		bool bad = false;
+		if (frame) {
+			answered++;
+			inflight_mask &= ~(1u << idx);
+			if (frame->ok) {
+				const struct command *comm = cmds[idx];
+				memcpy(buffer + offset[idx], frame->data + comm->datapos, comm->datalen);
+				pending &= ~(1u << idx);
+				if (comm->cache) {
+					memcpy(comm->cache->data + box * comm->datalen, frame->data + comm->datapos, comm->datalen);
+					comm->cache->time[box] = now;
+					comm->cache->valid |= 1 << box;
+				}
+			}
+			else {
+				db("bad checksum");
+				bad = true;
+			}
+			bf_pop(&box_rx);
+		}
+		else if (millis() - last_activity > BOX_ANSWER_TIMEOUT) {
+			db("command timeout");
+			bad = true;
+			// Answers still in flight are out of step, forget them and send them again
+			while (Serial1.available()) {
+				Serial1.read();
+			}
+			bf_reset(&box_rx);
+			answered = sent;
+			inflight_mask = 0;
+		}
+		else {
+			sched_idle(); // Woken up by the next received byte (or the millis timer)
 		}
-		if (tries == MAX_TRIES) { // We didn't make it
+
+		if (bad && ++tries[idx] >= MAX_TRIES) {
 			db("excessive retries");
-			break;
+			failed |= 1u << idx;
+			pending &= ~(1u << idx);
 		}
+	}
 
-		buffer += msg_commands[i]->datalen;
-		//delay(1000);
+	// Zero the data of the failed commands
+	for (uint8_t i = 0; i < n; i++) {
+		if (failed & (1u << i)) {
+			memset(buffer + offset[i], 0, cmds[i]->datalen);
+		}
 	}
+
+	Serial1.end();
+	return failed;
+}
+
+uint8_t get_data_from_box(uint8_t box, uint8_t *buffer) {
+	db("getting data from box");
+
 	uint8_t result = 0;
-	if (tries == MAX_TRIES) {
+	if (box_query(box, msg_commands, BOX_COMMANDS(msg_commands), buffer)) {
 		db("excessive retries - return 0 sample");
 		result = -1;
 	}
 	else {
 		db("sampling successful");
 	}
-	Serial1.end();
-	//digitalWrite(LED_BUILTIN, LOW);
 	return result;
 }
 
-uint8_t get_paygState_from_box(uint8_t *buffer) {
+uint8_t get_paygState_from_box(uint8_t box, uint8_t *buffer) {
 	db("getting paygstate from box");
 
-	// (Re)Configure serial interface to the box
-	Serial1.begin(38400);
-	//digitalWrite(LED_BUILTIN, HIGH);
-
-	// run all paygstate commands
-	uint8_t tries = 0;
-	for (int i = 0; i < 6; i++) {
-		tries = 0;
-		while (send_command(paygState_commands[i], buffer) && tries < MAX_TRIES) {
-			tries++;
-		}
-		if (tries == MAX_TRIES) { // We didn't make it
-			break;
-		}
-
-		buffer += paygState_commands[i]->datalen;
-		//delay(1000);
-	} 
 	uint8_t result = 0;
-	if (tries == MAX_TRIES) {
+	if (box_query(box, paygState_commands, BOX_COMMANDS(paygState_commands), buffer)) {
 		db("excessive retries - return 0 payg state");
 		result = -1;
 	}
 	else {
 		db("paygstate successful");
 	}
-	Serial1.end();
-	//digitalWrite(LED_BUILTIN, LOW);
 	return result;
 }
 
-uint8_t get_opid_from_box(uint8_t *buffer) {
+uint8_t get_opid_from_box(uint8_t box, uint8_t *buffer) {
 	db("getting opid from box");
 
-	// (Re)Configure serial interface to the box
-	Serial1.begin(38400);
-	
-	uint8_t tries = 0;
-	while (send_command(&cmd_OPID, buffer) && tries < MAX_TRIES) {
-		tries++;
-		//delay(1000);
-	}
-
+	const struct command * const opid_command[] = { &cmd_OPID };
 	uint8_t result = 0;
-	if (tries == MAX_TRIES) { // We didn't make it
+	if (box_query(box, opid_command, 1, buffer)) {
 		db("excessive retries - return 0 opid");
 		result = -1;
 	}
 	else {
 		db("opid successful");
 	}
-	Serial1.end();
 	return result;
 }
 
 
 inline uint8_t get_special_data_from_box(uint8_t *buffer) {
-	uint8_t recv[2];
-	uint8_t tries = 0;
-	// RSOC
-	while(send_command(msg_commands[0], recv) && tries < MAX_TRIES) tries++;
+	uint8_t recv[3];
+	const struct command * const special_commands[] = { &cmd_RSOC, &cmd_BC };
+	box_query(0, special_commands, 2, recv);
 
 	uint8_t soc = recv[0];
-
-	tries = 0;
-	// BC
-	while (send_command(msg_commands[9], recv) && tries < MAX_TRIES) tries++;
-
-	int bc = (int)((recv[1] << 8) + recv[0]);
+	int bc = (int)((recv[2] << 8) + recv[1]);
 
 	db_module(); db_print(F("got soc: ")); db_print(soc); db_print(F(", bc: ")); db_println(bc);
 
@@ -346,24 +673,59 @@ void sampling_task(void) {
 	if (tries == STOR_FUN_MAX_RETRIES) {
 		db("Failed to start memory");
 		stor_abort();
-		return;
+		return; // Cyclic, tried again at the current interval
 	}
 
-	// Get sample data
-	uint8_t buff[SAMPLE_SIZE];
-	uint8_t code = get_data_from_box(buff);
-	if (code != 0) {
-		for (int j = 0; j < SAMPLE_SIZE; j++) {
-			buff[j] = 0;
+	// One pass per box of the site
+	uint8_t activity = ACTIVITY_UNKNOWN;
+	for (uint8_t box = 0; box < box_count; box++) {
+		if (!(box_present & (1 << box))) {
+			continue;
+		}
+
+		// Get sample data, the fields that couldn't be read are left out of the record
+		uint8_t buff[SAMPLE_SIZE];
+		db_print("getting data from box: "); db_println(box);
+		uint16_t missing = box_query(box, msg_commands, BOX_COMMANDS(msg_commands), buff);
+		if (missing) {
+			db("partial sample");
+		}
+
+		// Store this sample to the external eeprom, tagged with the box
+		db("writting sample to storage");
+		uint8_t record[RECORD_MAX_SIZE];
+		uint8_t len = build_record(box, buff, missing, record, true);
+		uint16_t stored = stor_write_timed(sched_time(), record, len);
+		if (stored != 0) {
+			compression(stored);
 		}
-	}
 
-	// Store this sample to the external eeprom
-	db("writting sample to storage");
-	stor_write(buff, SAMPLE_SIZE);
-	compression();
+		// Keep the slow-changing values fresh for the reporting task, the box is only queried when they're due
+		uint8_t background[PAYG_STATE_SIZE];
+		uint8_t opid[OPID_SIZE]; // Not in background, the payg state is still needed by alarm_check
+		bool payg_valid = (get_paygState_from_box(box, background) == 0);
+		get_opid_from_box(box, opid);
+
+		if (box == 0) { // The window statistics follow the default box
+			stats_add(buff, missing, sched_time());
+		}
+
+		// Look for critical conditions, an alarm report is scheduled right away if any rule triggers
+		alarm_check(box, buff, missing, payg_valid ? background[PAYG_STATE_PS] : -1);
+
+		uint8_t box_moves = box_activity(box, buff, missing); // Called once, max() is a macro
+		activity = max(activity, box_moves);
+	}
 	stor_end();
-	
+
+	// Look again for the boxes that didn't answer at setup
+	if (box_present != (1 << box_count) - 1 && sched_time() - box_probed > BOX_PROBE_PERIOD) {
+		probe_boxes();
+	}
+
+	// Cyclic task at the pace of the battery activity, the next run counts from the start of this one
+	// Its slot is kept, the other tasks can't take it between two samples
+	sched_set_period(sched_task_id(), adapt_interval(activity));
 
 	// Go back to sleep
 	db("end");
@@ -373,7 +735,7 @@ void sampling_task(void) {
 uint8_t sampling_test(uint8_t *buffer)
 {
 	uint8_t id[14];
-	uint8_t code = get_opid_from_box(id);
+	uint8_t code = get_opid_from_box(0, id);
 	if (code != 0) {
 		for (int j = 0; j < OPID_SIZE; j++) {
 			id[j] = '0';
@@ -385,7 +747,7 @@ uint8_t sampling_test(uint8_t *buffer)
 	}
 
 	uint8_t sample[SAMPLE_SIZE];
-	code = code + get_data_from_box(sample);
+	code = code + get_data_from_box(0, sample);
 	if (code != 0) {
 		for (int j = 0; j < SAMPLE_SIZE; j++) {
 			sample[j] = 0;
@@ -3,11 +3,57 @@
 
 #include "arduino.h"
 
-#define SAMPLING_LOOPTIME  60
+#define SAMPLING_LOOPTIME  60  // Initial interval, then adapted to the activity of the battery
+
+// Adaptive sampling : the interval drops to SAMPLING_MIN_INTERVAL as soon as the battery current or the SOC
+// moves by more than their step between two samples, and doubles after SAMPLING_STABLE_COUNT stable samples
+// The delay stored in front of every record keeps track of the cadence
+#define SAMPLING_MIN_INTERVAL  15
+#define SAMPLING_MAX_INTERVAL  900
+#define SAMPLING_STABLE_COUNT  5
+#define SAMPLING_BC_STEP       100  // mA
+#define SAMPLING_SOC_STEP      2    // %
 
 #define SAMPLE_SIZE 19
+#define SAMPLE_FIELDS 10
+#define RECORD_MAX_SIZE (2 + 2 + SAMPLE_SIZE - 1) // Both masks, a partial record misses one field at least
+
+// Records are a 2 bytes presence mask (bit i for msg_commands[i], LSB first) followed by the present fields
+// Fields that couldn't be read from the box are left out : SAMPLE_PARTIAL is set and a second mask of the missing
+// fields follows the presence mask, the other absent fields are deadband skips
+// The mask also carries the index of the box the sample comes from
+#define SAMPLE_PARTIAL    0x8000
+#define SAMPLE_BOX_SHIFT  12
+#define SAMPLE_BOX_MASK   0x7000
+
+// Boxes sharing the serial bus (see box_addresses), each one gets its own records and caches
+#ifdef GSM
+#define BOX_MAX 2
+#else
+#define BOX_MAX 4
+#endif
+
+// Deadband mode : a field is only stored when it moved beyond its bound since its last stored value
+//#define SAMPLING_DEADBAND
+#define DEADBAND_REFRESH 60  // Store a full record every DEADBAND_REFRESH samples
 #define OPID_SIZE   14
 #define PAYG_SIZE   13
+#define PAYG_STATE_SIZE 15  // HTOP, RPD, ACC, PS, OCS, SSC
+#define PAYG_STATE_PS   12  // Position of the PAYG state byte in the payg state
+
+// Fields of a sample, in the msg_commands order
+enum sample_field {
+	FIELD_RSOC,
+	FIELD_RC,
+	FIELD_FCC,
+	FIELD_CV1,
+	FIELD_CV2,
+	FIELD_CV3,
+	FIELD_CV4,
+	FIELD_BV,
+	FIELD_BT,
+	FIELD_BC
+};
 
 
 void sampling_setup(void);
@@ -16,10 +62,54 @@ void sampling_task(void);
 
 uint8_t sampling_test(uint8_t *buffer);
 
-uint8_t get_paygState_from_box(uint8_t *buffer);
+/*
+	Layout of a sample : RSOC is a byte, every other field a word (checked against msg_commands at compile time)
+*/
+constexpr uint8_t sample_field_len(uint8_t field) {
+	return field == FIELD_RSOC ? 1 : 2;
+}
+
+constexpr uint8_t sample_field_pos(uint8_t field) {
+	return field == FIELD_RSOC ? 0 : 1 + 2 * (field - FIELD_RC);
+}
+
+/*
+	Returns the raw value of <field> in <sample> (little endian, to be cast to int16_t for the signed ones)
+	No table lookup, with a constant <field> the position and length are folded at compile time
+*/
+inline uint16_t sample_field(const uint8_t *sample, uint8_t field) {
+	const uint8_t *p = sample + sample_field_pos(field);
+	return (sample_field_len(field) == 1) ? p[0] : p[0] | (p[1] << 8);
+}
+
+/*
+	Builds the record of <sample> taken on <box>, <missing> is the mask of the fields that couldn't be read
+	Every other field is kept whatever the deadband mode, the deadband state of the stored records is left untouched
+	Returns the record length, RECORD_MAX_SIZE at most
+*/
+uint8_t sample_record(uint8_t box, const uint8_t *sample, uint16_t missing, uint8_t *record);
+
+/*
+	Returns the mask of the boxes found on the bus (bit 0, the default box, is always set)
+*/
+uint8_t sampling_boxes(void);
+
+/*
+	Sets the addresses of the other boxes of the site, <count> preambles of BF_PREAMBLE_LEN bytes for the boxes 1 on
+	(the default box stays box 0). The list is kept in the memory and loaded again by sampling_setup()
+	On a change the boxes are looked for again on the next sample, their caches are dropped
+	Returns 0, -1 if the list is too long or couldn't be written to the memory (it's used until the next restart anyway)
+*/
+uint8_t sampling_set_boxes(const uint8_t *addresses, uint8_t count);
+
+/*
+	The OPID and payg state are cached, the box is only queried once their refresh period is over
+	The sampling task keeps them fresh, so the reporting task normally gets them without any box I/O
+*/
+uint8_t get_paygState_from_box(uint8_t box, uint8_t *buffer);
 
-uint8_t get_data_from_box(uint8_t *buffer);
+uint8_t get_data_from_box(uint8_t box, uint8_t *buffer);
 
-uint8_t get_opid_from_box(uint8_t *buffer);
+uint8_t get_opid_from_box(uint8_t box, uint8_t *buffer);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,108 @@
+//
+//
+//
+
+#define DB_MODULE "Window Stats"
+#include "debug.h"
+
+#include "window_stats.h"
+#include "sampling_task.h"
+
+// Summarized fields, BC is the only signed one (BV goes beyond 32767 mV on 48V packs)
+const uint8_t stats_fields[STATS_FIELDS] = { FIELD_RSOC, FIELD_BV, FIELD_BT, FIELD_BC };
+#define STATS_SIGNED  (1 << FIELD_BC)
+
+struct field_stats {
+	uint16_t count;
+	uint16_t min;   // Raw box value, signed or not (see field_value)
+	uint16_t max;
+	float mean;
+	float m2;       // Sum of the squared deviations from the mean
+};
+
+struct field_stats window_fields[STATS_FIELDS];
+uint32_t window_start = 0;
+uint16_t window_samples = 0;
+float energy_in = 0;   // mWh
+float energy_out = 0;
+
+bool power_known = false;  // Last power and time, for the energy integral
+float last_power;          // mW, positive when charging
+uint32_t last_power_time;
+
+
+// Value of the raw <raw> of <field>, sign extended for the signed fields
+inline int32_t field_value(uint8_t field, uint16_t raw) {
+	return (STATS_SIGNED & (1 << field)) ? (int32_t)(int16_t)raw : (int32_t)raw;
+}
+
+void stats_reset(uint32_t now) {
+	memset(window_fields, 0, sizeof(window_fields));
+	window_start = now;
+	window_samples = 0;
+	energy_in = 0;
+	energy_out = 0;
+}
+
+void stats_add(const uint8_t *sample, uint16_t missing, uint32_t now) {
+	window_samples++;
+	for (uint8_t i = 0; i < STATS_FIELDS; i++) {
+		if (missing & (1 << stats_fields[i])) {
+			continue;
+		}
+		uint16_t raw = sample_field(sample, stats_fields[i]);
+		int32_t value = field_value(stats_fields[i], raw);
+		struct field_stats *f = &window_fields[i];
+		if (f->count == 0 || value < field_value(stats_fields[i], f->min)) f->min = raw;
+		if (f->count == 0 || value > field_value(stats_fields[i], f->max)) f->max = raw;
+		f->count++;
+		float delta = value - f->mean;
+		f->mean += delta / f->count;
+		f->m2 += delta * (value - f->mean);
+	}
+
+	// Energy, the power of the previous sample is held until this one
+	if (missing & ((1 << FIELD_BC) | (1 << FIELD_BV))) {
+		power_known = false;
+		return;
+	}
+	if (power_known) {
+		float energy = last_power * (now - last_power_time) / 3600.0;
+		if (energy > 0) {
+			energy_in += energy;
+		}
+		else {
+			energy_out -= energy;
+		}
+	}
+	last_power = (float)(int16_t)sample_field(sample, FIELD_BC) * sample_field(sample, FIELD_BV) / 1000.0;
+	last_power_time = now;
+	power_known = true;
+}
+
+inline uint8_t put16(uint8_t *record, uint8_t pos, uint16_t val) {
+	record[pos] = val;
+	record[pos + 1] = val >> 8;
+	return pos + 2;
+}
+
+inline uint8_t put32(uint8_t *record, uint8_t pos, uint32_t val) {
+	pos = put16(record, pos, val);
+	return put16(record, pos, val >> 16);
+}
+
+uint8_t stats_summary(uint8_t *record, uint32_t now) {
+	uint8_t pos = 0;
+	pos = put16(record, pos, min((now - window_start) / 60, 0xFFFFul));
+	pos = put16(record, pos, window_samples);
+	for (uint8_t i = 0; i < STATS_FIELDS; i++) {
+		struct field_stats *f = &window_fields[i];
+		pos = put16(record, pos, f->min);
+		pos = put16(record, pos, f->max);
+		pos = put16(record, pos, (uint16_t)lround(f->mean)); // Same type as the field
+		pos = put16(record, pos, f->count > 1 ? (uint16_t)lround(sqrt(f->m2 / (f->count - 1))) : 0);
+	}
+	pos = put32(record, pos, lround(energy_in));
+	pos = put32(record, pos, lround(energy_out));
+	return pos;
+}
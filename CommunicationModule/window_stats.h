@@ -0,0 +1,41 @@
+// window_stats.h
+
+#ifndef _WINDOW_STATS_h
+#define _WINDOW_STATS_h
+
+#include "arduino.h"
+
+/*
+	Per report window statistics of the samples
+
+	Every sample updates, for the fields of stats_fields, the count, min, max and the running mean and variance
+	(Welford's method, no sample is kept), and the energy that went in and out of the battery (BC x BV, integrated
+	between two samples). RAM use doesn't depend on the window length
+
+	Summary record (little endian, STATS_RECORD_SIZE bytes) :
+		uint16 window length (minutes), uint16 number of samples
+		for each field of stats_fields : min, max, mean (16 bits, int16 for BC, uint16 for the others),
+		uint16 standard deviation (box units)
+		uint32 charged energy (mWh), uint32 discharged energy (mWh)
+*/
+
+#define STATS_FIELDS       4   // RSOC, BV, BT, BC
+#define STATS_RECORD_SIZE  (4 + 8 * STATS_FIELDS + 8)
+
+/*
+	Starts a new window at <now> (seconds)
+*/
+void stats_reset(uint32_t now);
+
+/*
+	Adds a sample taken at <now>, <missing> is the mask of the fields that couldn't be read
+*/
+void stats_add(const uint8_t *sample, uint16_t missing, uint32_t now);
+
+/*
+	Writes the summary record of the current window to <record>, at <now>
+	Returns the record length
+*/
+uint8_t stats_summary(uint8_t *record, uint32_t now);
+
+#endif
@@ -54,7 +54,9 @@ void setup() {
 	}
 
 	db("\ncomm abort\n");
-	code = comm_abort();
+	while ((code = comm_abort()) == COMM_PENDING) {
+		delay(10);
+	}
 	db("\n comm abort return code :");
 	db_println(code);
 
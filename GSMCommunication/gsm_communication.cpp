@@ -7,6 +7,7 @@
 #ifdef GSM
 
 #include <SoftwareSerial.h>
+#include "task_scheduler.h"
 
 #define DB_MODULE "GSM Comm"
 #include "debug.h"
@@ -73,7 +74,8 @@ enum comm_status_code get_reply(const char *tosend, const char *expected_reply,
 		sim_serial.println((const char*)tosend);
 	}
 	db_print("<<<");
-	while (timeout > 0) {
+	unsigned long start = millis();
+	while (millis() - start < timeout) {
 
 		while (sim_serial.available()) {
 			reply = sim_serial.read();
@@ -90,14 +92,69 @@ enum comm_status_code get_reply(const char *tosend, const char *expected_reply,
 				return COMM_OK;
 			}
 		}
-		delay(1);
-		timeout--;
+		sched_idle(); // Woken up by the next received byte (or the millis timer)
 	}
 	db_println(""); // end line
 	return COMM_ERR_RETRY;
 }
 
 
+/*
+	Resumable operations : instead of waiting for the module, a call returns COMM_PENDING and the next call goes on
+	from the same point (Duff's device on the line of the wait, no local survives a wait)
+	The waits are timed with millis(), whatever the pace of the calls
+*/
+struct comm_op {
+	uint16_t lc;          // Line of the wait in progress, 0 if the operation isn't started
+	unsigned long since;  // millis() at the start of the wait
+	unsigned long timer;  // millis() at the start of a multi-wait step
+	uint8_t match;        // Characters of the expected reply received so far
+	bool found;           // Expected reply received
+};
+
+#define COMM_BEGIN(op)          switch ((op)->lc) { case 0:
+#define COMM_END(op)            } (op)->lc = 0
+#define COMM_RETURN(op, code)   do { (op)->lc = 0; return code; } while (0)
+#define COMM_WAIT_UNTIL(op, cond) \
+	do { (op)->lc = __LINE__; case __LINE__: if (!(cond)) return COMM_PENDING; } while (0)
+#define COMM_DELAY(op, ms) \
+	do { (op)->since = millis(); COMM_WAIT_UNTIL(op, millis() - (op)->since >= (ms)); } while (0)
+
+struct comm_op start_op;
+struct comm_op send_op;
+struct comm_op abort_op;
+
+// Sends <tosend> (flash string, NULL for none) and starts waiting for a reply with reply_poll()
+void reply_start(struct comm_op *op, const char *tosend) {
+	if (tosend) {
+		db_module();
+		db_print(">>>");
+		db_println((const __FlashStringHelper *)tosend);
+		sim_serial.println((const __FlashStringHelper *)tosend);
+	}
+	op->since = millis();
+	op->match = 0;
+	op->found = false;
+}
+
+// Reads the available characters, true once <expected> (flash string) was received
+bool reply_poll(struct comm_op *op, const char *expected) {
+	while (!op->found && sim_serial.available()) {
+		char reply = sim_serial.read();
+		db_print(reply);
+		if (reply != (char)pgm_read_byte(expected + op->match)) { // No match, break sequence
+			op->match = 0;
+			if (reply != (char)pgm_read_byte(expected)) { // No match on new sequence
+				continue;
+			}
+		}
+		op->match++;  // Match
+		op->found = (pgm_read_byte(expected + op->match) == 0x00);  // End sequence
+	}
+	return op->found;
+}
+
+
 #define UITOA_BUFFER_SIZE 6
 void uitoa(uint16_t val, uint8_t *buff);
 
@@ -115,7 +172,9 @@ enum comm_status_code comm_setup(void) {
 	db("starting serial");
 	sim_serial.begin(9600);
 
-	comm_abort(); // Force a hardware reset and shut down the module
+	while (comm_abort() == COMM_PENDING) { // Force a hardware reset and shut down the module
+		delay(10);
+	}
 
 	flush_input();
 
@@ -170,46 +229,49 @@ enum comm_status_code power_off(void) {
 	return code;
 }
 
+#define GPRS_TIMEOUT 60000   // ms, network attach
+#define SAPBR_TIMEOUT 30000  // ms, bearer bringup
+
 enum comm_status_code comm_start_report(uint16_t totallen, uint8_t type, char * url_add) {
+	struct comm_op *op = &start_op;
+	COMM_BEGIN(op);
 	db("Start report");
 
 	// Start Serial
 	db("starting serial");
 	sim_serial.begin(9600);
-	delay(500);
-	uint16_t timeout;
-	timeout = 60000;  // timeout for GPRS connection
+	COMM_DELAY(op, 500);
 
 	// Power on
 	if (!module_is_on) {
 		if (power_on() != COMM_OK) {
-			return COMM_ERR_RETRY;
+			COMM_RETURN(op, COMM_ERR_RETRY);
 		}
 	}
 	db("Module is on");
 	// While not connection timeout
 	db("Attempting connection");
-	while (timeout > 0) {
+	op->timer = millis();
+	while (1) {
 		// Query GPRS availability
 		flush_input();
 		if (get_reply_P(PSTR("AT+CGATT?"), PSTR("+CGATT: 1"), 200) == COMM_OK) {
 			break;
 		}
-		delay(800);
-		timeout -= 1000;
-	}
-	// If timeout
-	if (timeout == 0) {
-		// Shutdown
-		db("Connection timeout");
-		power_off();
-		return COMM_ERR_RETRY_LATER;
+		// If timeout
+		if (millis() - op->timer >= GPRS_TIMEOUT) {
+			// Shutdown
+			db("Connection timeout");
+			power_off();
+			COMM_RETURN(op, COMM_ERR_RETRY_LATER);
+		}
+		COMM_DELAY(op, 800);
 	}
 
 	db("Connection stablished");
 	// GPRS available
 
-	delay(1000);
+	COMM_DELAY(op, 1000);
 	flush_input(); // Dismiss unrequested messages
 	db("Configuring APN");
 	if (get_reply_P(PSTR("AT+SAPBR=3,1,\"Contype\", \"GPRS\""), PSTR(OK_REPLY), 200) != COMM_OK
@@ -217,15 +279,18 @@ enum comm_status_code comm_start_report(uint16_t totallen, uint8_t type, char *
 		|| get_reply_P(PSTR("AT+SAPBR=3,1,\"USER\", \"" SIM_USER "\""), PSTR(OK_REPLY), 200) != COMM_OK
 		|| get_reply_P(PSTR("AT+SAPBR=3,1,\"PWD\", \"" SIM_PWD "\""), PSTR(OK_REPLY), 200) != COMM_OK) {
 		db("Failed to configure APN");
-		return COMM_ERR_RETRY;
+		COMM_RETURN(op, COMM_ERR_RETRY);
 	}
-	if(get_reply_P(PSTR("AT+SAPBR=2,1"), PSTR("+SAPBR: 1,1"), 500) == COMM_OK) {
-		// Module already connected
-	} 
-	else if( get_reply_P(PSTR("AT+SAPBR=1,1"), PSTR(OK_REPLY), 30000) != COMM_OK) {  // 1.85s max connection bringup time on the specifications, but sometimes...
-		db("Failed to configure APN");
-		return COMM_ERR_RETRY;
+	if(get_reply_P(PSTR("AT+SAPBR=2,1"), PSTR("+SAPBR: 1,1"), 500) != COMM_OK) { // Module not connected yet
+		reply_start(op, PSTR("AT+SAPBR=1,1"));
+		COMM_WAIT_UNTIL(op, reply_poll(op, PSTR(OK_REPLY)) || millis() - op->since >= SAPBR_TIMEOUT);  // 1.85s max connection bringup time on the specifications, but sometimes...
+		if (!op->found) {
+			db("Failed to configure APN");
+			COMM_RETURN(op, COMM_ERR_RETRY);
+		}
 	}
+	COMM_END(op);
+
 	flush_input();
 	db("Configuring HTTP module");
 	if (get_reply_P(PSTR("AT+HTTPINIT"), PSTR(OK_REPLY), 200) != COMM_OK
@@ -233,13 +298,13 @@ enum comm_status_code comm_start_report(uint16_t totallen, uint8_t type, char *
 		db("Failed to configure HTTP module");
 		return COMM_ERR_RETRY;
 	}
-	if (type == 1) {	// Test results
+	if (type == COMM_REPORT_TEST) {	// Test results
 		if (get_reply_P(PSTR("AT+HTTPPARA=\"URL\",\"" TEST_URL "\""), PSTR(OK_REPLY), 200) != COMM_OK) {
 			db("Failed to configure HTTP module");
 			return COMM_ERR_RETRY;
 		}
 	}
-	else if (type == 2) {	// Post data
+	else {	// Post data, the parameters tell the report types apart
 		char post_url[200];
 		strcpy(post_url, "AT+HTTPPARA=\"URL\",\"" POST_URL);
 		strcat(post_url, url_add);
@@ -273,31 +338,37 @@ enum comm_status_code comm_fill_report(const uint8_t *buffer, int lenght) {
 }
 
 
+#define HTTPACTION_TIMEOUT 60000 // ms
+
 enum comm_status_code comm_send_report(uint8_t *buffer) {
+	struct comm_op *op = &send_op;
+	COMM_BEGIN(op);
 	db("Send Report");
 	flush_input();
 	if (get_reply_P(PSTR("AT+HTTPACTION=1"), PSTR(OK_REPLY), 500) != COMM_OK) { // Do POST
 		db("POST action failed");
-		return COMM_ERR_RETRY;
+		COMM_RETURN(op, COMM_ERR_RETRY);
 	}
-	if (get_reply_P(NULL, PSTR("+HTTPACTION: 1,"), 60000) != COMM_OK) { // Send nothing, wait for the +httaction response
+	reply_start(op, NULL); // Send nothing, wait for the +httaction response
+	COMM_WAIT_UNTIL(op, reply_poll(op, PSTR("+HTTPACTION: 1,")) || millis() - op->since >= HTTPACTION_TIMEOUT);
+	if (!op->found) {
 		db("Module did not respond");                            // somehow no http timeout ???
-		comm_abort();
-		return COMM_ERR_RETRY_LATER;						// Assume the data was lost (got "ok" on action)
+		COMM_WAIT_UNTIL(op, comm_abort() != COMM_PENDING);
+		COMM_RETURN(op, COMM_ERR_RETRY_LATER);						// Assume the data was lost (got "ok" on action)
 	}
+	COMM_END(op);
 	db("Got answer from request");
 	char http_code[4] = { '1', '1', '1', 0 };
-	uint16_t timeout = 500;
+	unsigned long start = millis();
 	uint8_t index = 0;
-	while (timeout > 0 && index < 3) {
+	while (millis() - start < 500 && index < 3) {
 		while (sim_serial.available() && index < 3) {
 			uint8_t reply = sim_serial.read();
 			db_print((char)reply);
 			http_code[index] = reply;
 			index++;
 		}
-		delay(1);
-		timeout--;
+		sched_idle();
 	}
 	http_code[3] = 0;
 	db_module(); db_print(F("HTTP code : ")); db_println(http_code);
@@ -308,7 +379,7 @@ enum comm_status_code comm_send_report(uint8_t *buffer) {
 		uint8_t value = sim_serial.read();
 		if(value >= '0' && value <= '9')
 			length = length * 10 + (value - '0');
-		delay(1);
+		sched_idle(); // Lets the next digit come in
 	}
 	db_print("length: "); db_println(length);
 	length = (length > 50) ? 50 : length; // TODO: max length of reply
@@ -320,16 +391,15 @@ enum comm_status_code comm_send_report(uint8_t *buffer) {
 	get_reply(str, rep, 500);
 	
 	index = 0;
-	timeout = 500;
-	while (timeout > 0 && index < length) {
+	start = millis();
+	while (millis() - start < 500 && index < length) {
 		while (sim_serial.available() && index < length) {
 			uint8_t reply = sim_serial.read();
 			db_print((char)reply);
 			buffer[index] = reply;
 			index++;
 		}
-		delay(1);
-		timeout--;
+		sched_idle();
 	}
 	db("flush");
 	flush_input();
@@ -348,15 +418,18 @@ enum comm_status_code comm_send_report(uint8_t *buffer) {
 
 
 enum comm_status_code comm_abort(void) {
+	struct comm_op *op = &abort_op;
+	COMM_BEGIN(op);
 	db("Abort");
 	if (get_reply_P(PSTR("AT"), PSTR(OK_REPLY), 200) != COMM_OK) { // Module stuck
 		digitalWrite(SIM_RESET, LOW);// Hardware reset
 		delay(200);
 		digitalWrite(SIM_RESET, HIGH);
-		delay(2000);
+		COMM_DELAY(op, 2000);
 		power_on();
-		delay(3000);
+		COMM_DELAY(op, 3000);
 	}
+	COMM_END(op);
 	return power_off();
 }
 
@@ -1,6 +1,5 @@
-
 #include "lora_communication.h"
-#include "lora_jobs.h"
+#include "task_scheduler.h"
 
 #define DB_MODULE "LORA Communication"
 
@@ -10,6 +9,48 @@
 #define Serial SERIAL_PORT_USBVIRTUAL
 #endif
 
+// Schedule TX every this many seconds (might become longer due to duty
+// cycle limitations).
+#define TX_INTERVAL 20
+
+#define TEST_SIZE 19
+
+const char* getcode(enum comm_status_code code)
+{
+	switch (code)
+	{
+	case COMM_OK: return "COMM_OK";
+	case COMM_ERR_RETRY: return "COMM_ERR_RETRY";
+	case COMM_ERR_RETRY_LATER: return "COMM_ERR_RETRY_LATER";
+	case COMM_PENDING: return "COMM_PENDING";
+	}
+	return "";
+}
+
+/*
+	Test report, joins the network if needed and sends a dummy sample
+	The waits are deep sleeps, lora_task runs the LMIC jobs meanwhile
+*/
+void lora_test_task(void)
+{
+	static task_lc lc = 0;
+	static enum comm_status_code code;
+	static uint8_t buff[TEST_SIZE];
+
+	TASK_BEGIN(lc);
+	TASK_WAIT_UNTIL_MS_SLEEP(lc, (code = comm_start_report(TEST_SIZE, COMM_REPORT_DATA, NULL)) != COMM_PENDING, 100, false);
+	Serial.println(getcode(code));
+	if (code != COMM_OK) {
+		TASK_EXIT(lc);
+	}
+	for (int i = 0; i < TEST_SIZE; i++)
+		buff[i] = '0';
+	comm_fill_report(buff, TEST_SIZE);
+	TASK_WAIT_UNTIL_MS_SLEEP(lc, (code = comm_send_report(NULL)) != COMM_PENDING, 100, false);
+	Serial.println(getcode(code));
+	TASK_END(lc);
+}
+
 void setup()
 {
 	// Configure pins
@@ -27,13 +68,13 @@ void setup()
 	delay(2000);
 	digitalWrite(lmic_pins.rst, HIGH);
 
-	// Starting OS
-	os_init();
-
 	// LMIC init
-	os_setCallback(&lora_setup, lora_init);
+	comm_setup();
 
-	os_runloop();
+	// Reports and LMIC jobs share the scheduler
+	sched_setup();
+	sched_add_task(lora_test_task, 0, TX_INTERVAL, SCHED_PRIORITY_NORMAL, SCHED_CATCHUP_SKIP);
+	sched_mainloop();
 }
 
 
@@ -2,9 +2,7 @@
 
 #ifdef LORA
 
-#include "lora_jobs.h"
-
-#define SAMPLE_SIZE 19
+#include "task_scheduler.h"
 
 /*
 Communication library for the Feather FONA GSM board and the Feather LORA
@@ -13,9 +11,6 @@ Communication library for the Feather FONA GSM board and the Feather LORA
 #define UITOA_BUFFER_SIZE 6
 void uitoa(uint16_t val, uint8_t *buff);
 
-static osjob_t blinkjob;
-void blinkfunc(osjob_t* job);
-
 // Configuration
 
 // application router ID -> Gateway EUI (little-endian format)
@@ -31,17 +26,6 @@ devaddr_t DevAddr = 0x74345678;
 static const u1_t PROGMEM APPKEY[16] = { 0x01, 0x23, 0x45, 0x67, 0x89, 0x01, 0x23, 0x45, 0x67, 0x89, 0x01, 0x23, 0x45, 0x67, 0x89, 0x01 };
 void os_getDevKey(u1_t* buf) { memcpy_P(buf, APPKEY, 16); }
 
-// Schedule TX every this many seconds (might become longer due to duty
-// cycle limitations).
-const unsigned TX_INTERVAL = 20;
-
-//Retry joining after this many seconds
-const unsigned RETRY_JOIN = 120;
-
-//Set conection & TX timeout
-ostime_t JOIN_TIME = sec2osticks(60); // wait x secondes before timeout
-ostime_t TX_TIME = sec2osticks(120);
-
 // Pin mapping
 const lmic_pinmap lmic_pins = {
 	.nss = 8,
@@ -50,48 +34,47 @@ const lmic_pinmap lmic_pins = {
 	.dio = { 3,SDA,6 },
 };
 
-// interval with which the LED blinks in seconds
-// used to give information about the LoRa state
-// 5 s    - default
-// 500 ms - LoRa module trying to join network
-// 1 s    - LoRa module successfully joined network
-// 100 ms - LoRa module not joined network after retrying.
-uint8_t BLINK_INTERVAL = 1;
-
 // LMIC Event Callback
 
 // false - default
 // true - Module is successfully connected to the gateway
 boolean isJoined = false;
 
+// true - The network didn't accept the join request
+boolean joinFailed = false;
+
 // false - default
 // true - Data successfully sent
 boolean isSent = false;
 
+// Report in progress
+uint8_t lora_buffer[LORA_MAX_PAYLOAD];
+uint8_t lora_len = 0;
+uint8_t lora_port = LORA_PORT_DATA;
+boolean lora_joining = false;  // comm_start_report() waits for the join
+boolean lora_sending = false;  // comm_send_report() waits for the end of the transmission
+uint32_t lora_since;           // sched_millis() at the start of the join or of the transmission
+boolean lora_running = false;  // lora_task is scheduled
+uint32_t lora_mark;            // sched_millis() and os_getTime() at the last clock catch up
+ostime_t lora_os_mark;
+
 void onEvent(ev_t ev) {
 	Serial.print(os_getTime());
 	Serial.print(": ");
 	switch (ev) {
 	case EV_JOINING:
 		Serial.println(F("EV_JOINING"));
-		BLINK_INTERVAL = 500;
 		break;
 	case EV_JOINED:
 		Serial.println(F("EV_JOINED"));
-		BLINK_INTERVAL = 1;
 		isJoined = true;
-		// Reporting
-		os_setCallback(&lora_report, lora_send);
 		break;
 	case EV_RFU1:
 		Serial.println(F("EV_RFU1 - unhandled event"));
 		break;
 	case EV_JOIN_FAILED:
 		Serial.println(F("EV_JOIN_FAILED"));
-		BLINK_INTERVAL = 100;
-		os_clearCallback(&lora_setup);
-		Serial.println(F("Retry joining in 120 seconds"));
-		os_setTimedCallback(&lora_setup, os_getTime() + sec2osticks(RETRY_JOIN), lora_init);
+		joinFailed = true;
 		break;
 	case EV_TXCOMPLETE:
 		Serial.println(F("EV_TXCOMPLETE (includes waiting for RX windows)"));
@@ -110,120 +93,188 @@ void onEvent(ev_t ev) {
 	}
 }
 
-// Jobs
+// MAC event loop
 
-void blinkfunc(osjob_t* job)
+// The MAC has an operation in progress, its jobs have to be run
+boolean lora_busy(void)
 {
-	digitalWrite(LED_BUILTIN, !digitalRead(LED_BUILTIN));
+	return (LMIC.opmode & (OP_JOINING | OP_REJOIN | OP_TXDATA | OP_POLL | OP_TXRXPEND)) != 0;
+}
 
-	if (BLINK_INTERVAL >= 10)
-		os_setTimedCallback(job, os_getTime() + ms2osticks(BLINK_INTERVAL), blinkfunc);
-	else
-		os_setTimedCallback(job, os_getTime() + sec2osticks(BLINK_INTERVAL), blinkfunc);
+/*
+	The LMIC clock is micros(), stopped in the deep sleep, while sched_millis() keeps the RTC time
+	The time LMIC missed is taken off its pending times : the MAC job (join backoff, duty cycle wait) and the
+	band availability, so that the waits end when they're due in real time
+*/
+void lora_catch_up(void)
+{
+	uint32_t now = sched_millis();
+	ostime_t os_now = os_getTime();
+	int32_t lost = (int32_t)(now - lora_mark) - (int32_t)osticks2ms(os_now - lora_os_mark);
+	if (lost > 0 && lost <= LORA_CLOCK_SLACK_MS) {
+		return; // Rounding and drift, added up until it's worth a catch up
+	}
+	lora_mark = now;
+	lora_os_mark = os_now;
+	if (lost <= 0) {
+		return;
+	}
+	ostime_t ticks = ms2osticks(lost);
+	if (lora_busy() && !(LMIC.opmode & OP_TXRXPEND) && LMIC.osjob.deadline - os_now > 0) {
+		os_setTimedCallback(&LMIC.osjob, LMIC.osjob.deadline - ticks, LMIC.osjob.func);
+	}
+#if defined(CFG_eu868)
+	for (uint8_t b = 0; b < MAX_BANDS; b++) {
+		LMIC.bands[b].avail -= ticks;
+	}
+#endif
+	LMIC.globalDutyAvail -= ticks;
+}
+
+void lora_task(void)
+{
+	lora_catch_up();
+	os_runloop_once();
+	// On air and in the receive windows, timed to the millisecond : the other tasks wait until the MAC is done
+	while (LMIC.opmode & OP_TXRXPEND) {
+		sched_idle();
+		os_runloop_once();
+	}
+	if (lora_busy()) {
+		// LMIC waits for a time (duty cycle, join backoff), deep sleep until its job is due
+		ostime_t wait = LMIC.osjob.deadline - os_getTime();
+		uint32_t ms = (wait > 0) ? osticks2ms(wait) + 1 : 1;
+		sched_resume_ms(min(ms, LORA_MAC_WAIT_MAX_MS), false);
+	}
+	else {
+		lora_running = false; // Nothing left
+	}
+}
+
+// Makes sure the LMIC jobs are run
+void lora_start(void)
+{
+	if (!lora_running) {
+		lora_running = (sched_add_task_ms(lora_task, 0, 0, SCHED_PRIORITY_HIGH) != (uint8_t)-1);
+	}
 }
 
 
 enum comm_status_code comm_setup(void)
 {
-	Serial.println(F("Connecting to gateway..."));
-	// Blink job
-	os_setCallback(&blinkjob, blinkfunc);
+	Serial.println(F("LMIC setup"));
+	os_init();
 
 	// Reset the MAC state. Session and pending data transfers will be discarded.
 	LMIC_reset();
+	isJoined = false;
+	lora_mark = sched_millis();
+	lora_os_mark = os_getTime();
+	return COMM_OK;
+}
 
-	LMIC_startJoining();
+// FPort of a report type
+uint8_t lora_report_port(uint8_t type)
+{
+	switch (type) {
+	case COMM_REPORT_SUMMARY: return LORA_PORT_SUMMARY;
+	case COMM_REPORT_ALARM: return LORA_PORT_ALARM;
+	case COMM_REPORT_PROFILE: return LORA_PORT_PROFILE;
+	case COMM_REPORT_RANGE: return LORA_PORT_RANGE;
+	default: return LORA_PORT_DATA;
+	}
+}
 
-	ostime_t start = os_getTime();
-	while ((os_getTime() - start < JOIN_TIME) && (!isJoined))
-	{
-		os_runloop_once();
+enum comm_status_code comm_start_report(uint16_t totallen, uint8_t type, char * url)
+{
+	// The device is known by its DevEUI, no report header, the report type is given by the port
+	lora_catch_up();
+	if (!lora_joining) {
+		lora_len = 0;
+		lora_port = lora_report_port(type);
+		if (isJoined) {
+			return COMM_OK;
+		}
+		Serial.println(F("Connecting to gateway..."));
+		joinFailed = false;
+		LMIC_startJoining();
+		lora_joining = true;
+		lora_since = sched_millis();
+		lora_start();
+		return COMM_PENDING;
+	}
+
+	if (isJoined) {
+		lora_joining = false;
+		return COMM_OK;
 	}
-	
-	if (!isJoined)
-	{
+	if (joinFailed || sched_millis() - lora_since >= LORA_JOIN_TIMEOUT) {
 		Serial.println(F("Connection timeout"));
-		BLINK_INTERVAL = 100;
-		os_clearCallback(&lora_setup);
-		LMIC_shutdown();
-		Serial.println(F("Retry joining in RETRY_JOIN seconds"));
-		os_setTimedCallback(&lora_setup, os_getTime() + sec2osticks(RETRY_JOIN), lora_init); // Retry joining
+		lora_joining = false;
+		LMIC_reset(); // Stops joining, lora_task ends on its next call
 		return COMM_ERR_RETRY_LATER;
 	}
-	else
-	{
-		return COMM_OK;
+	return COMM_PENDING;
+}
+
+enum comm_status_code comm_fill_report(const uint8_t *buffer, int length)
+{
+	if (length > LORA_MAX_PAYLOAD - lora_len) {
+		length = LORA_MAX_PAYLOAD - lora_len;
 	}
+	memcpy(lora_buffer + lora_len, buffer, length);
+	lora_len += length;
+	return COMM_OK;
 }
 
-enum comm_status_code comm_send_report(void)
+enum comm_status_code comm_send_report(uint8_t *buffer)
 {
-	if (isJoined) // otherwise, "LMIC_setTxData" will call LMIC_startJoining even though we had an error returned by comm_setup
-	{
+	lora_catch_up();
+	if (!lora_sending) {
+		if (!isJoined) { // otherwise, "LMIC_setTxData" will call LMIC_startJoining
+			Serial.println(F("Not connected to gateway"));
+			return COMM_ERR_RETRY_LATER;
+		}
 		// Check if there is not a current TX/RX job running
-		if (LMIC.opmode & OP_TXRXPEND)
-		{
+		if (LMIC.opmode & OP_TXRXPEND) {
 			Serial.println(F("OP_TXRXPEND, not sending"));
-			os_clearCallback(&lora_report);
-			//comm_abort();
-			Serial.println(F("Trying again in TX_INTERVAL seconds"));
-			os_setTimedCallback(&lora_report, os_getTime() + sec2osticks(TX_INTERVAL), lora_send);
 			return COMM_ERR_RETRY_LATER;
 		}
-		else
-		{
-			Serial.println(F("Starting Report"));
-			isSent  = false;
-
-			// (Re)Configure serial interface to the box
-			Serial1.begin(38400);
-
-			// Get sample data
-			uint8_t buff[SAMPLE_SIZE];
-			uint8_t code = -1; // get_data_from_box(buff);
-
-			if (code != 0) { // Something wrong with sampling
-				db("sampling failed - send '0'");
-				for (int i = 0; i < SAMPLE_SIZE; i++)
-					buff[i] = '0';
-			}
-
-			// Prepare upstream data transmission at the next possible time. 
-			LMIC_setTxData2(1, buff, sizeof(buff), 0);
-			Serial.println(F("Packet queued"));
-
-			ostime_t start = os_getTime();
-			while ((!isSent) && (os_getTime() - start < TX_TIME))
-			{
-				os_runloop_once();
-			}
-
-			if (!isSent)
-			{
-				Serial.println(F("TX timeout"));
-				Serial1.end();
-				os_clearCallback(&lora_report);
-				//comm_abort();
-				Serial.println(F("Trying again in TX_INTERVAL seconds"));
-				os_setTimedCallback(&lora_report, os_getTime() + sec2osticks(TX_INTERVAL), lora_send);
-				return COMM_ERR_RETRY_LATER;
-			}
-			Serial1.end();
-			Serial.println(F("Scheduling next transmission..."));
-			os_setTimedCallback(&lora_report, os_getTime() + sec2osticks(TX_INTERVAL), lora_send); // Next transmission in 60 secondes
-			//comm_abort();
-			return COMM_OK;
+		Serial.println(F("Starting Report"));
+		isSent = false;
+
+		// Prepare upstream data transmission at the next possible time.
+		LMIC_setTxData2(lora_port, lora_buffer, lora_len, 0);
+		Serial.println(F("Packet queued"));
+		lora_sending = true;
+		lora_since = sched_millis();
+		lora_start();
+		return COMM_PENDING;
+	}
+
+	if (isSent) {
+		lora_sending = false;
+		if (buffer != NULL) {
+			memcpy(buffer, LMIC.frame + LMIC.dataBeg, min(LMIC.dataLen, LORA_MAX_REPLY));
 		}
+		return COMM_OK;
+	}
+	if (sched_millis() - lora_since >= LORA_TX_TIMEOUT) {
+		Serial.println(F("TX timeout"));
+		lora_sending = false;
+		LMIC_clrTxData();
+		return COMM_ERR_RETRY_LATER;
 	}
-	Serial.println(F("Not connected to gateway"));
-	return COMM_ERR_RETRY_LATER;
+	return COMM_PENDING;
 }
 
 enum comm_status_code comm_abort(void)
 {
 	Serial.println(F("Abort"));
+	lora_joining = false;
+	lora_sending = false;
+	LMIC_clrTxData(); // The session is kept, no need to join again
 	os_radio(RADIO_RST); // put radio to sleep
-	delay(2000);
 	digitalWrite(LED_BUILTIN, LOW);
 	return COMM_OK;
 }
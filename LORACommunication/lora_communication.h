@@ -1,63 +1,43 @@
-#ifndef _COMMUNICATION_H_
-#define _COMMUNICATION_H_
+#ifndef _LORA_COMMUNICATION_H_
+#define _LORA_COMMUNICATION_H_
 
 #include "Arduino.h"
+#include "communication.h"
+#include <lmic.h>
+#include <hal/hal.h>
+#include <SPI.h>
 
 /*
-	Communication library for the Feather FONA GSM board and the Feather LORA
-
-*/
-
-enum comm_status_code {
-	COMM_OK,          // Function executed
-	COMM_ERR_RETRY,       // Module unexpected error, retry a few times or abort
-	COMM_ERR_RETRY_LATER    // Connection error, connection closed, data discarded, report aborted, module shutdown
-};
-
-/*
-	Configure Serial and IO pins to operate the communication module. If the module is ON, turn it OFF
-	Always returns COMM_OK
+	LoRaWAN implementation of the communication interface (see communication.h), on top of LMIC
+
+	The LMIC jobs are run by lora_task, a scheduler task that lives as long as the MAC has some work in progress
+	(join, transmission, receive windows). It holds the CPU from the start of a transmission to the end of the
+	receive windows, and deep sleeps until the next MAC job in between (the LMIC clock is caught up after it)
+	The comm_ functions only start the operations and return COMM_PENDING until the LMIC events tell they're over
+	A report is a single uplink, the data filled in is truncated to LORA_MAX_PAYLOAD bytes
+	The URL parameters are dropped, the report type gives the FPort of the uplink, the downlink of the receive
+	windows is the server reply
 */
-enum comm_status_code comm_setup(void);
 
-/*
-	Turn on the module, connect to the network, start a session and prepare to send data
-	Returns COMM_OK if the module is connected and a data session was open.
-	Returns COMM_ERR_RETRY if the boot or some of the issued commands failed.
-	Returns COMM_ERR_RETRY_LATER if the timeout of the network subscription was reached
-*/
-enum comm_status_code comm_start_report(uint16_t totallen);
+#define LORA_MAX_PAYLOAD    55      // Bytes, at the slowest data rate
+#define LORA_MAX_REPLY      50      // Bytes of the downlink given back as the server reply
+#define LORA_MAC_WAIT_MAX_MS 60000ul // Longest sleep while the MAC waits (duty cycle, join backoff)
+#define LORA_CLOCK_SLACK_MS 10      // LMIC clock lag left for the next catch up
+#define LORA_JOIN_TIMEOUT   60000ul // ms
+#define LORA_TX_TIMEOUT     120000ul // ms
 
-/*
-	Send binary data for the report contents
-	Always returns COMM_OK, no overflow check is performed
-*/
-enum comm_status_code comm_fill_report(const uint8_t *buffer, int length);
+// FPort of each report type (COMM_REPORT_)
+#define LORA_PORT_DATA      1       // Compressed samples, and the setup test
+#define LORA_PORT_SUMMARY   2       // Window summary record
+#define LORA_PORT_ALARM     3       // Alarm masks and record
+#define LORA_PORT_PROFILE   4       // Scheduler profile record
+#define LORA_PORT_RANGE     5       // Stored records asked again by the server
 
-/*
-	Issue the report and await for results, then shut down the module
-	Returns COMM_OK on a successfuly sent report. Returns COMM_ERR_RETRY on module error. Returns COMM_ERR_RETRY_LATER on timeouts and connection errors
-*/
-enum comm_status_code comm_send_report(void);
+extern const lmic_pinmap lmic_pins;
 
 /*
-	Stop any on-going opperation and shut down the module. Performs a hardware reset if the module is not responding (might take several seconds)
-	Returns COMM_OK if the module was shut down, COMM_ERR_RETRY if the module didn't answer to the shutdown command even after reset
+	Runs the LMIC jobs that are due, added by the comm_ functions when they need the MAC
 */
-enum comm_status_code comm_abort(void);
-
-
-
-#ifdef __GSM_TEST__
-// Expose internal functions for test suite
-extern const char OK_REPLY[];
-enum comm_status_code power_on(void);
-enum comm_status_code power_off(void);
-inline enum comm_status_code get_reply(const char * tosend, const char * expected_reply, uint16_t timeout);
-enum comm_status_code get_reply(const uint8_t *tosend, const uint8_t *expected_reply, uint16_t timeout);
-inline void flush_input(void);
-#endif
-
-
+void lora_task(void);
 
-#endif // !_COMMUNICATION_H_
+#endif // !_LORA_COMMUNICATION_H_
@@ -5,6 +5,7 @@
 #define DB_MODULE "Storage"
 #include "debug.h"
 #include <stdio.h>
+#include "task_scheduler.h"
 # include <string.h>
 
 #define fx_expect_false(expr)  (expr)
@@ -37,30 +38,64 @@ typedef unsigned char u8;
 
 /* constants */
 #define WIP_MASK      0x01
+#define WEL_MASK      0x02
 #define PAGE_SIZE     128
-#define MEMORY_SIZE   60000   /* Dernier octet accord  la partition de mmoire ddie aux donnes brutes de la batterie */
-#define MEMORY_COMPRESSED_MAX 65535   /* Dernier octet accord  la partition de la mmoire ddie aux donnes compresses */
-#define Dernier_echantillon 240   /* 1 chantillon par minutes pendant 4 heures */
+#define MEMORY_SIZE   60000   /* Dernier octet accord au dmarrage  la partition de mmoire ddie aux donnes brutes de la batterie */
+#define MEMORY_COMPRESSED_MAX (65535 - 2 * PAGE_SIZE)   /* Dernier octet accord  la partition de la mmoire ddie aux donnes compresses */
+#define PAGE_CONFIG   (MEMORY_COMPRESSED_MAX + 1)   /* Avant-derniere page, configuration gardee d'un demarrage a l'autre */
+#define PAGE_TEST     (PAGE_CONFIG + PAGE_SIZE)   /* Derniere page de la memoire, reservee a stor_test() */
+#define CONFIG_MAGIC  0xC5   /* Premier octet d'une page de configuration valide */
+#define TAILLE_BLOC   4560   /* Octets bruts par paquet compresse (240 echantillons de 19 octets), quelle que soit la cadence */
+#define PARTITION_BRUTE_MIN   (LZFX_MAX_OFF + PAGE_SIZE)   /* Taille minimale des partitions (fenetre LZFX pour les donnees brutes) */
+#define PARTITION_COMP_MIN    4096
+#define ATTENTE_RAMENEE_MAX   32   /* Donnees brutes en attente recopiees au debut de la partition pour la deplacer (un enregistrement) */
 
 /* variables */
+uint16_t limite_partition = MEMORY_SIZE;   /* Dernier octet de la partition des donnes brutes, dplac par ajuster_partition() */
 uint16_t adr_ecr = MEMORY_SIZE - 3*19 - 1;    /* adresse  laquelle sont crites les donnes de la batterie */
 uint16_t adr_lir = MEMORY_SIZE - 3*19 - 1;    /* adresse o sont lues les donnes de la batterie */
 uint16_t adr_lir_committed = MEMORY_SIZE - 3*19 - 1;   /* adresse repre de lecture des donnes de la batterie */
-uint32_t adr_lir_deb = MEMORY_SIZE - 3 * 19 - 1;   /* adresse du premier octet d'un paquet de 4h dans les donnees de la batterie */
+uint32_t adr_lir_deb = MEMORY_SIZE - 3 * 19 - 1;   /* adresse du premier octet du paquet en cours dans les donnees de la batterie */
 uint32_t adr_lir_comp = MEMORY_COMPRESSED_MAX - 3 * 19 - 1;   /* adresse o sont lues les donnes compresses */
 uint16_t adr_lir_committed_comp = MEMORY_COMPRESSED_MAX - 3 * 19 - 1;   /* adresse repre de lecture des donnes compresses */
 uint32_t adr_ecr_comp = MEMORY_COMPRESSED_MAX - 3 * 19 - 1;   /* adresse  laquelle sont crites les donnes compresses */
 uint32_t resultat;   /* variable nulle lorsque la compression s'est bien passe ou indicatrice d'erreur */
-uint16_t compteur_echantillon = 0;
+uint16_t compteur_echantillon = 0;   /* Rang de l'echantillon dans le paquet en cours */
+uint16_t octets_bloc = 0;   /* Octets bruts du paquet en cours */
+bool dernier_du_bloc = false;   /* L'echantillon en cours ferme le paquet */
 int longueur_initiale_totale = 0;
 int longueur_compressee_totale = 0;
+uint16_t longueur_echantillon = 19;   /* longueur de l'echantillon en cours de compression (variable en mode deadband) */
+uint16_t longueur_echantillon_prec = 19;   /* longueur de l'echantillon precedent */
+
+/* Index temporel des donnees brutes */
+#define INDEX_TAILLE  16   /* Nombre de points d'index */
+#define INDEX_PAS     16   /* Un point d'index tous les INDEX_PAS enregistrements */
+struct point_index {
+	uint32_t temps;      /* Temps de l'enregistrement (secondes) */
+	uint32_t position;   /* Position de l'enregistrement dans le flux des octets ecrits */
+};
+struct point_index index_temps[INDEX_TAILLE];
+uint8_t index_nb = 0;   /* Nombre de points valides */
+uint8_t index_tete = 0;   /* Prochain point a ecrire */
+uint8_t enregistrements_sans_point = INDEX_PAS;
+uint32_t octets_ecrits = 0;   /* Nombre total d'octets ecrits dans la partition brute */
+uint32_t index_base_position = 0;   /* Position et adresse de reference pour retrouver l'adresse d'un point */
+uint16_t index_base_adresse = 0;
+uint32_t dernier_temps = 0;
+bool premier_enregistrement = true;
 
 /* Prototypes */
 uint8_t wait_memory(uint16_t timeout);
 uint8_t memory_is_busy(void);
+uint8_t lire_status(void);
+uint8_t tester_page(uint8_t masque);
 uint8_t write_eeprom(uint8_t *data, uint16_t address, uint16_t len);
 uint8_t write_eeprom_page(uint8_t *data, uint16_t address, uint16_t len);
 uint8_t read_eeprom(uint8_t *buffer, uint16_t address, uint16_t len);
+void ajuster_partition(void);
+uint8_t ramener_attente(uint16_t attente);
+void vider_index(void);
 
 /*
 	Set up memory interface, configure interfaces and pins
@@ -69,6 +104,7 @@ void stor_setup(void) {
 	db("Setup");
 	pinMode(SLAVESELECT, OUTPUT);
 	digitalWrite(SLAVESELECT, HIGH); //disable device
+	vider_index();
 }
 
 uint8_t stor_start(void) {
@@ -99,10 +135,113 @@ void stor_end(void) {
 void stor_end_comp(void) {
 	db("End comp");
 	adr_lir_committed_comp = adr_lir_comp;
+	adr_lir_deb = adr_lir;
+	ajuster_partition();
 	compteur_echantillon = 0;
+	octets_bloc = 0;
+	dernier_du_bloc = false;
 	longueur_initiale_totale = 0;
 	longueur_compressee_totale = 0;
-	adr_lir_deb = adr_lir;
+}
+
+/*
+* Deplace la limite entre les partitions brute et compressee selon le taux de compression
+* mesure sur le dernier paquet et les donnees en attente dans chaque partition.
+* Appelee en debut de paquet, par compression() et apres un rapport confirme : la limite n'est
+* deplacee que si aucune donnee en attente ne se trouve dans la zone qui change de partition.
+* En debut de paquet seul le nouvel echantillon attend dans la partition brute, il est recopie
+* au debut de la partition si la nouvelle limite le laisserait dehors.
+*/
+void ajuster_partition(void)
+{
+	uint32_t total = (uint32_t)MEMORY_COMPRESSED_MAX + 1;
+	uint32_t bloc = TAILLE_BLOC;
+
+	/* Taux de compression en 1/256, 1 tant qu'aucun paquet n'a ete mesure */
+	uint32_t taux = 256;
+	if (longueur_initiale_totale > 0 && longueur_compressee_totale > 0) {
+		taux = ((uint32_t)longueur_compressee_totale << 8) / longueur_initiale_totale;
+	}
+
+	/* Besoins : donnees en attente + le prochain paquet */
+	uint16_t attente_brute = stor_available();
+	uint16_t attente_comp = stor_available_comp();
+	uint32_t besoin_brut = attente_brute + bloc;
+	uint32_t besoin_comp = attente_comp + ((bloc * taux) >> 8);
+
+	uint32_t taille_brute;
+	if (besoin_brut + besoin_comp < total) {
+		taille_brute = besoin_brut;   /* Tout le reste sert a l'historique compresse */
+	}
+	else {
+		taille_brute = (total * ((besoin_brut << 8) / (besoin_brut + besoin_comp))) >> 8;   /* Partage au prorata des besoins */
+	}
+	if (taille_brute < PARTITION_BRUTE_MIN) taille_brute = PARTITION_BRUTE_MIN;
+	if (taille_brute > total - PARTITION_COMP_MIN) taille_brute = total - PARTITION_COMP_MIN;
+	taille_brute = (taille_brute + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
+	uint16_t nouvelle_limite = taille_brute - 1;
+
+	if (nouvelle_limite == limite_partition) {
+		return;
+	}
+
+	/* Donnees brutes en attente : [adr_lir, adr_ecr[ doit rester sous la nouvelle limite sans rebouclage */
+	bool ramener = attente_brute != 0 && (adr_lir > adr_ecr || adr_ecr > nouvelle_limite + 1);
+	if (ramener && attente_brute > ATTENTE_RAMENEE_MAX) {
+		db("Partition brute occupee, limite inchangee");
+		return;
+	}
+	/* Donnees compressees en attente : [adr_lir_comp, adr_ecr_comp[ doit rester au-dessus, sans rebouclage */
+	if (attente_comp != 0 && (adr_lir_comp > adr_ecr_comp || adr_lir_comp <= nouvelle_limite)) {
+		db("Partition compressee occupee, limite inchangee");
+		return;
+	}
+	if (ramener && ramener_attente(attente_brute)) {
+		db("Recopie impossible, limite inchangee");
+		return;
+	}
+
+	limite_partition = nouvelle_limite;
+	if (attente_brute == 0) {
+		adr_ecr = 0;
+		adr_lir = 0;
+		adr_lir_committed = 0;
+		adr_lir_deb = 0;
+	}
+	vider_index();   /* Les adresses des anciens points ne sont plus valides */
+	if (attente_comp == 0) {
+		adr_ecr_comp = limite_partition + 1;
+		adr_lir_comp = limite_partition + 1;
+		adr_lir_committed_comp = limite_partition + 1;
+	}
+	db_module(); db_print("Nouvelle limite de partition : "); db_println(limite_partition);
+}
+
+/*
+* Recopie les 'attente' octets bruts en attente au debut de la partition brute, qui devient
+* [0, attente[ : ils ne genent plus le deplacement de la limite.
+* Return : 0 si ok, les pointeurs ne changent pas en cas d'erreur
+*/
+uint8_t ramener_attente(uint16_t attente)
+{
+	uint8_t tampon[ATTENTE_RAMENEE_MAX];
+	if (adr_lir + attente > limite_partition + 1) {
+		uint16_t lit_bas = limite_partition + 1 - adr_lir;
+		if (read_eeprom(tampon, adr_lir, lit_bas) || read_eeprom(tampon + lit_bas, 0, attente - lit_bas)) {
+			return 1;
+		}
+	}
+	else if (read_eeprom(tampon, adr_lir, attente)) {
+		return 1;
+	}
+	if (write_eeprom(tampon, 0, attente)) {
+		return 1;
+	}
+	adr_lir = 0;
+	adr_lir_committed = 0;
+	adr_lir_deb = 0;
+	adr_ecr = attente;
+	return 0;
 }
 
 void stor_erase_eeprom()
@@ -119,73 +258,95 @@ void stor_erase_eeprom()
 	wait_memory(1000);
 }
 
-uint8_t stor_test(void) 
+/*
+* Test non destructif de la memoire, en quelques millisecondes :
+* liaison SPI et registre d'etat (bit WEL apres WREN puis WRDI), puis ecriture et relecture
+* d'une page complete avec un motif et son inverse, dans la page de test reservee.
+* Les partitions et leurs pointeurs ne sont pas modifies.
+* Return : 'O' si le test a reussi
+*/
+uint8_t stor_test(void)
 {
-	stor_start();
-
-	uint16_t adr = 0x000100;
-	const uint16_t len = 10;
-	uint8_t buf[len];
-	uint8_t data[len];
-	for (int i = 0; i < len; i++)
-		data[i] = i;
+	if (stor_start()) {
+		db("Memoire occupee");
+		stor_abort();
+		return -1;
+	}
 
 	uint8_t result = 'O';
 
-	read_eeprom(buf, adr, len);
-#ifdef _DEBUG
-	for (int i = 0; i < len; i++) {
-		Serial.print(" ");
-		Serial.print(buf[i], HEX);
-	}
-	Serial.println("");
-#endif
-	stor_erase_eeprom();
-	read_eeprom(buf, adr, len);
-	for (int i = 0; i < len; i++) {
-#ifdef _DEBUG
-		Serial.print(" ");
-		Serial.print(buf[i], HEX);
-#endif
-		if (buf[i] != 0xFF)
-			result = -1;
+	/* Registre d'etat */
+	digitalWrite(SLAVESELECT, LOW);
+	SPI.transfer(WREN);
+	digitalWrite(SLAVESELECT, HIGH);
+	if ((lire_status() & WEL_MASK) == 0) {
+		db("WREN sans effet");
+		result = -1;
 	}
-#ifdef _DEBUG
-	Serial.print("\nStorage : Write 1st\n");
-#endif
-	write_eeprom(data, adr, len);
-	read_eeprom(buf, adr, len);
-	for (int i = 0; i < len; i++) {
-#ifdef _DEBUG
-		Serial.print(" ");
-		Serial.print(buf[i], HEX);
-#endif
-		if (buf[i] != data[i])
-			result = -1;
+	digitalWrite(SLAVESELECT, LOW);
+	SPI.transfer(WRDI);
+	digitalWrite(SLAVESELECT, HIGH);
+	if (lire_status() & WEL_MASK) {
+		db("WRDI sans effet");
+		result = -1;
 	}
-#ifdef _DEBUG
-	Serial.print("\nStorage : Write 2nd\n");
-#endif
-	// overwrite test
-	for (int i = 0; i < len; i++)
-		data[i] = 2*i;
-	write_eeprom(data, adr, len);
-	read_eeprom(buf, adr, len);
-	for (int i = 0; i < len; i++) {
-#ifdef _DEBUG
-		Serial.print(" ");
-		Serial.print(buf[i], HEX);
-#endif
-		if (buf[i] != data[i])
-			result = -1;
+
+	/* Ecriture de page */
+	if (tester_page(0x00) || tester_page(0xFF)) {
+		db("Page de test corrompue");
+		result = -1;
 	}
-#ifdef _DEBUG
-	Serial.print("\n");
-#endif
-	stor_end();
+
+	stor_abort();
 	return result;
 }
 
+/* Somme de controle de la configuration, jamais nulle sur une page effacee (0xFF) */
+uint8_t somme_config(uint8_t *data, uint8_t len)
+{
+	uint8_t somme = len;
+	for (uint8_t i = 0; i < len; i++) {
+		somme += data[i];
+	}
+	return ~somme;
+}
+
+/*
+* Page de configuration : CONFIG_MAGIC, longueur, les 'len' octets, somme de controle
+*/
+uint8_t stor_write_config(uint8_t *data, uint8_t len)
+{
+	if (len > PAGE_SIZE - 3 || stor_start()) {
+		db("Configuration non ecrite");
+		stor_abort();
+		return -1;
+	}
+	uint8_t entete[2] = { CONFIG_MAGIC, len };
+	uint8_t somme = somme_config(data, len);
+	uint8_t code = write_eeprom(entete, PAGE_CONFIG, 2) || write_eeprom(data, PAGE_CONFIG + 2, len)
+		|| write_eeprom(&somme, PAGE_CONFIG + 2 + len, 1);
+	stor_abort();
+	return code ? -1 : 0;
+}
+
+uint8_t stor_read_config(uint8_t *buffer, uint8_t maxlen)
+{
+	if (stor_start()) {
+		stor_abort();
+		return 0;
+	}
+	uint8_t entete[2];
+	uint8_t somme;
+	uint8_t len = 0;
+	if (read_eeprom(entete, PAGE_CONFIG, 2) == 0 && entete[0] == CONFIG_MAGIC && entete[1] <= maxlen
+		&& read_eeprom(buffer, PAGE_CONFIG + 2, entete[1]) == 0 && read_eeprom(&somme, PAGE_CONFIG + 2 + entete[1], 1) == 0
+		&& somme == somme_config(buffer, entete[1])) {
+		len = entete[1];
+	}
+	stor_abort();
+	return len;
+}
+
 
 /*
 * Ce fonction va stocker un chantillon de donnes dans la mmoire  partir de la
@@ -195,9 +356,9 @@ uint8_t stor_write(uint8_t *data, uint16_t len)
 {
 	
 	db("Write sample");
-	if (adr_ecr + len > MEMORY_SIZE)
+	if (adr_ecr + len > limite_partition)
 	{
-		uint16_t ecrit_bas = MEMORY_SIZE - adr_ecr+1 ;
+		uint16_t ecrit_bas = limite_partition - adr_ecr+1 ;
 		if (write_eeprom(data, adr_ecr, ecrit_bas))
 		{
 			db("Probleme d'ecriture au bas de la memoire");
@@ -226,6 +387,150 @@ uint8_t stor_write(uint8_t *data, uint16_t len)
 
 
 
+/*
+* Stocke un enregistrement horodate : delai depuis l'enregistrement precedent (secondes, entier
+* variable de 7 bits par octet), longueur, puis les 'len' octets de 'data'.
+* Le premier apres un redemarrage est precede d'un marqueur (enregistrement vide de delai nul) : les temps
+* repartent de 0, le delai du premier enregistrement est compte depuis le demarrage.
+* Ajoute un point a l'index temporel tous les INDEX_PAS enregistrements.
+* Return : longueur totale ecrite (marqueur compris), 0 en cas d'erreur
+*/
+uint16_t stor_write_timed(uint32_t temps, uint8_t *data, uint8_t len)
+{
+	uint8_t entete[2 + 6];
+	uint8_t lh = 0;
+	if (premier_enregistrement) {
+		entete[lh++] = 0;   /* Marqueur de redemarrage */
+		entete[lh++] = 0;
+		dernier_temps = 0;
+	}
+	uint8_t marqueur = lh;
+	uint32_t delai = temps - dernier_temps;
+	do {
+		entete[lh] = delai & 0x7F;
+		delai >>= 7;
+		if (delai) entete[lh] |= 0x80;
+		lh++;
+	} while (delai);
+	entete[lh++] = len;
+
+	uint16_t adr_debut = adr_ecr;
+	if (stor_write(entete, lh) || stor_write(data, len)) {
+		adr_ecr = adr_debut;   /* L'enregistrement partiel sera ecrase par le suivant, le flux reste aligne */
+		return 0;
+	}
+
+	/* Point d'index seulement une fois l'enregistrement complet */
+	if (enregistrements_sans_point >= INDEX_PAS) {
+		index_temps[index_tete].temps = temps;
+		index_temps[index_tete].position = octets_ecrits + marqueur;
+		index_tete = (index_tete + 1) % INDEX_TAILLE;
+		if (index_nb < INDEX_TAILLE) index_nb++;
+		enregistrements_sans_point = 0;
+	}
+	enregistrements_sans_point++;
+	octets_ecrits += lh + len;
+	dernier_temps = temps;
+	premier_enregistrement = false;
+	return lh + len;
+}
+
+void vider_index(void)
+{
+	index_nb = 0;
+	index_tete = 0;
+	enregistrements_sans_point = INDEX_PAS;
+	index_base_position = octets_ecrits;
+	index_base_adresse = adr_ecr;
+}
+
+/*
+* Lit 'len' octets de la partition brute a partir de la position 'position' du flux, en rebouclant
+*/
+uint8_t lire_anneau(uint8_t *buffer, uint32_t position, uint16_t len)
+{
+	uint32_t taille = (uint32_t)limite_partition + 1;
+	uint16_t adresse = (index_base_adresse + (position - index_base_position)) % taille;
+	if (adresse + len > taille) {
+		uint16_t lit_bas = taille - adresse;
+		return read_eeprom(buffer, adresse, lit_bas) || read_eeprom(buffer + lit_bas, 0, len - lit_bas);
+	}
+	return read_eeprom(buffer, adresse, len);
+}
+
+/*
+* Copie dans 'buffer' les enregistrements horodates dont le temps est compris entre 't0' et 't1',
+* en partant du point d'index le plus proche au lieu de relire toute la partition.
+* Les enregistrements sont copies tels que stockes, 'premier' recoit le temps du premier copie.
+* Avec 'buffer' NULL, rien n'est copie : seule la longueur est comptee.
+* Seuls les enregistrements encore presents dans la partition brute peuvent etre relus.
+* Return : nombre d'octets copies (enregistrements entiers, au plus 'maxlen')
+*/
+uint16_t stor_read_range(uint32_t t0, uint32_t t1, uint8_t *buffer, uint16_t maxlen, uint32_t *premier)
+{
+	db("Read range");
+	uint32_t taille = (uint32_t)limite_partition + 1;
+
+	/* Point valide le plus recent dont le temps est <= t0, sinon le plus ancien valide */
+	int8_t choix = -1;
+	for (uint8_t i = 0; i < index_nb; i++) {
+		uint8_t k = (index_tete + INDEX_TAILLE - index_nb + i) % INDEX_TAILLE;
+		if (octets_ecrits - index_temps[k].position > taille - 2 * PAGE_SIZE) {
+			continue;   /* Ecrase par les ecritures suivantes */
+		}
+		if (choix < 0 || index_temps[k].temps <= t0) {
+			choix = k;
+		}
+		if (index_temps[k].temps > t0) {
+			break;
+		}
+	}
+	if (choix < 0) {
+		return 0;
+	}
+
+	uint32_t position = index_temps[choix].position;
+	uint32_t temps = index_temps[choix].temps;
+	bool premier_lu = true;
+	uint16_t copie = 0;
+	while (position < octets_ecrits) {
+		uint8_t entete[6];
+		if (lire_anneau(entete, position, sizeof(entete))) {
+			db("Read error");
+			break;
+		}
+		uint32_t delai = 0;
+		uint8_t lh = 0;
+		do {
+			delai |= (uint32_t)(entete[lh] & 0x7F) << (7 * lh);
+		} while ((entete[lh++] & 0x80) && lh < 5);
+		uint16_t total = lh + 1 + entete[lh];
+
+		if (!premier_lu) {
+			temps += delai;   /* Le temps du point est deja celui de son enregistrement */
+		}
+		premier_lu = false;
+		if (temps > t1) {
+			break;
+		}
+		if (temps >= t0) {
+			if (copie + total > maxlen) {
+				break;
+			}
+			if (copie == 0) {
+				*premier = temps;
+			}
+			if (buffer != NULL && lire_anneau(buffer + copie, position, total)) {
+				db("Read error");
+				break;
+			}
+			copie += total;
+		}
+		position += total;
+	}
+	return copie;
+}
+
 /*
 * Ce fonction va lire et retourner les donnes avec longueur 'len' qui sont stocks
 * dans la mmoire  partir de l'adresse 'addresse_lu'.
@@ -235,9 +540,9 @@ uint16_t stor_read(uint8_t *buffer, uint16_t maxlen)
 {
 	db("Read sample");
 	uint16_t len = min(stor_available(), maxlen);
-	if (adr_lir + len > MEMORY_SIZE)
+	if (adr_lir + len > limite_partition)
 	{
-		uint16_t lit_bas = MEMORY_SIZE + 1 - adr_lir;
+		uint16_t lit_bas = limite_partition + 1 - adr_lir;
 		if (read_eeprom(buffer, adr_lir, lit_bas))
 		{
 			db("Erreur de lecture au bas de la memoire");
@@ -284,7 +589,7 @@ uint16_t stor_read_comp(uint8_t *buffer, uint16_t maxlen)
 			db("Erreur de lecture au bas de la memoire");
 			return 0;
 		}
-		adr_lir_comp = MEMORY_SIZE + 1;
+		adr_lir_comp = limite_partition + 1;
 		if (read_eeprom((buffer + lit_bas), adr_lir_comp, (len - lit_bas)))
 		{
 			db("Erreur de lecture en haut de la memoire");
@@ -314,7 +619,7 @@ uint16_t stor_available(void)
 	}
 	else
 	{
-		return adr_ecr + (MEMORY_SIZE + 1 - adr_lir) ;
+		return adr_ecr + (limite_partition + 1 - adr_lir) ;
 	}
 }
 
@@ -327,27 +632,70 @@ uint16_t stor_available_comp(void)
 	}
 	else
 	{
-		return ((adr_ecr_comp - MEMORY_SIZE - 1 ) + (MEMORY_COMPRESSED_MAX + 1 - adr_lir_comp));
+		return ((adr_ecr_comp - limite_partition - 1 ) + (MEMORY_COMPRESSED_MAX + 1 - adr_lir_comp));
 	}
 }
 
 uint8_t memory_is_busy()
+{
+	return ((lire_status() & WIP_MASK) == 1);
+}
+
+uint8_t lire_status(void)
 {
 	digitalWrite(SLAVESELECT, LOW);
 	SPI.transfer(RDSR);
 	uint8_t status_reg = SPI.transfer(0xFF);
 	digitalWrite(SLAVESELECT, HIGH);
+	return status_reg;
+}
+
+/*
+* Ecrit la page de test en une seule ecriture de page, avec un motif genere (xor 'masque'), puis la relit
+* Return : 0 si la relecture est identique
+*/
+uint8_t tester_page(uint8_t masque)
+{
+	digitalWrite(SLAVESELECT, LOW);
+	SPI.transfer(WREN);
+	digitalWrite(SLAVESELECT, HIGH);
 
-	return ((status_reg & WIP_MASK) == 1);
+	digitalWrite(SLAVESELECT, LOW);
+	SPI.transfer(WRIT);
+	SPI.transfer((uint8_t)(PAGE_TEST >> 8));
+	SPI.transfer((uint8_t)(PAGE_TEST));
+	for (uint16_t i = 0; i < PAGE_SIZE; i++) {
+		SPI.transfer((uint8_t)(i * 7 + 0x5A) ^ masque);
+	}
+	digitalWrite(SLAVESELECT, HIGH);
+	if (wait_memory(100)) {
+		return -1;
+	}
+
+	uint8_t erreurs = 0;
+	digitalWrite(SLAVESELECT, LOW);
+	SPI.transfer(READ);
+	SPI.transfer((uint8_t)(PAGE_TEST >> 8));
+	SPI.transfer((uint8_t)(PAGE_TEST));
+	for (uint16_t i = 0; i < PAGE_SIZE; i++) {
+		if (SPI.transfer(0xFF) != ((uint8_t)(i * 7 + 0x5A) ^ masque)) {
+			erreurs = 1;
+		}
+	}
+	digitalWrite(SLAVESELECT, HIGH);
+	return erreurs;
 }
 
 
 uint8_t wait_memory(uint16_t timeout) {
-	while (timeout && memory_is_busy()) {
-		delay(1);
-		timeout--;
+	unsigned long debut = millis();
+	while (memory_is_busy()) {
+		if (millis() - debut >= timeout) {
+			return 1; // timeout
+		}
+		sched_idle(); /* Sommeil leger jusqu'a la prochaine interruption (timer de millis) */
 	}
-	return !timeout; // 0 on ok, 1 on timeout
+	return 0;
 }
 
 
@@ -448,31 +796,31 @@ void write_1_byte (uint8_t donnee, uint16_t adresse){
 
 void recopiage(uint8_t* lit, uint16_t* adresse_entree, uint16_t* adresse_entree_debut, uint16_t* adresse_entree_fin, uint16_t* adresse_sortie, uint16_t* adresse_sortie_debut, uint16_t* adresse_sortie_fin, uint16_t* ilen, uint16_t* olen) {
 
-	db("Ecriture des 19 premiers octets");
+	db("Ecriture du premier echantillon");
 	uint16_t adresse_sortie_lit_1;
 	*lit = 0; 
-	*adresse_sortie == MEMORY_COMPRESSED_MAX ? *adresse_sortie = MEMORY_SIZE + 1 : *adresse_sortie = *adresse_sortie + 1;
+	*adresse_sortie == MEMORY_COMPRESSED_MAX ? *adresse_sortie = limite_partition + 1 : *adresse_sortie = *adresse_sortie + 1;
 
 
 	while (*adresse_entree >= *adresse_entree_debut ? (*adresse_entree < *adresse_entree_debut + *ilen) : (*adresse_entree < *adresse_entree_fin)) {
 
 		
 		*lit = *lit + 1;
-		write_1_byte(read_1_byte(*adresse_entree > MEMORY_SIZE ? 0 : *adresse_entree), *adresse_sortie > MEMORY_COMPRESSED_MAX ? MEMORY_SIZE + 1 : *adresse_sortie);
-		*adresse_entree == MEMORY_SIZE ? *adresse_entree = 0 : *adresse_entree = *adresse_entree + 1;
-		*adresse_sortie == MEMORY_COMPRESSED_MAX ? *adresse_sortie = MEMORY_SIZE + 1 : *adresse_sortie = *adresse_sortie + 1;
+		write_1_byte(read_1_byte(*adresse_entree > limite_partition ? 0 : *adresse_entree), *adresse_sortie > MEMORY_COMPRESSED_MAX ? limite_partition + 1 : *adresse_sortie);
+		*adresse_entree == limite_partition ? *adresse_entree = 0 : *adresse_entree = *adresse_entree + 1;
+		*adresse_sortie == MEMORY_COMPRESSED_MAX ? *adresse_sortie = limite_partition + 1 : *adresse_sortie = *adresse_sortie + 1;
 
 
 		if (fx_expect_false(*lit == LZFX_MAX_LIT)) {
-			if (*adresse_sortie - (MEMORY_SIZE + 1) < *lit + 1) {
-				adresse_sortie_lit_1 = MEMORY_COMPRESSED_MAX + 1 - (*lit + 1 - (*adresse_sortie - (MEMORY_SIZE + 1)));
+			if (*adresse_sortie - (limite_partition + 1) < *lit + 1) {
+				adresse_sortie_lit_1 = MEMORY_COMPRESSED_MAX + 1 - (*lit + 1 - (*adresse_sortie - (limite_partition + 1)));
 			}
 			else {
 				adresse_sortie_lit_1 = *adresse_sortie - *lit - 1;
 			}
 			write_1_byte(*lit - 1, adresse_sortie_lit_1); /* Terminate literal run */
 			*lit = 0; 
-			*adresse_sortie == MEMORY_COMPRESSED_MAX ? *adresse_sortie = MEMORY_SIZE + 1 : *adresse_sortie = *adresse_sortie + 1; 
+			*adresse_sortie == MEMORY_COMPRESSED_MAX ? *adresse_sortie = limite_partition + 1 : *adresse_sortie = *adresse_sortie + 1; 
 			
 		}
 
@@ -486,16 +834,16 @@ void Literal_run(uint16_t *adresse_entree, uint16_t *adresse_sortie, uint16_t *a
 	uint16_t adresse_sortie_lit_1;
 
 	if (*lit == 0) {
-		*adresse_sortie == MEMORY_COMPRESSED_MAX ? *adresse_sortie = MEMORY_SIZE + 1 : *adresse_sortie = *adresse_sortie + 1;
+		*adresse_sortie == MEMORY_COMPRESSED_MAX ? *adresse_sortie = limite_partition + 1 : *adresse_sortie = *adresse_sortie + 1;
 	}
 	*lit = *lit + 1;
-	write_1_byte(read_1_byte(*adresse_entree > MEMORY_SIZE ? 0 : *adresse_entree), *adresse_sortie > MEMORY_COMPRESSED_MAX ? MEMORY_SIZE + 1 : *adresse_sortie);
-	*adresse_entree = *adresse_entree + 1 > MEMORY_SIZE ?  0 : *adresse_entree + 1;
-	*adresse_sortie == MEMORY_COMPRESSED_MAX ? *adresse_sortie = MEMORY_SIZE + 1 : *adresse_sortie = *adresse_sortie + 1;
+	write_1_byte(read_1_byte(*adresse_entree > limite_partition ? 0 : *adresse_entree), *adresse_sortie > MEMORY_COMPRESSED_MAX ? limite_partition + 1 : *adresse_sortie);
+	*adresse_entree = *adresse_entree + 1 > limite_partition ?  0 : *adresse_entree + 1;
+	*adresse_sortie == MEMORY_COMPRESSED_MAX ? *adresse_sortie = limite_partition + 1 : *adresse_sortie = *adresse_sortie + 1;
 	
 	if (fx_expect_false(*lit == LZFX_MAX_LIT)) {
-		if (*adresse_sortie - (MEMORY_SIZE + 1) < *lit + 1) {
-			adresse_sortie_lit_1 = MEMORY_COMPRESSED_MAX + 1 - (*lit + 1 - (*adresse_sortie - (MEMORY_SIZE + 1)));
+		if (*adresse_sortie - (limite_partition + 1) < *lit + 1) {
+			adresse_sortie_lit_1 = MEMORY_COMPRESSED_MAX + 1 - (*lit + 1 - (*adresse_sortie - (limite_partition + 1)));
 			write_1_byte(*lit - 1, adresse_sortie_lit_1); /* Terminate literal run */
 		}
 		else {
@@ -504,7 +852,7 @@ void Literal_run(uint16_t *adresse_entree, uint16_t *adresse_sortie, uint16_t *a
 		}
 
 		*lit = 0; 
-		*adresse_sortie == MEMORY_COMPRESSED_MAX ? *adresse_sortie = MEMORY_SIZE + 1 : *adresse_sortie = *adresse_sortie + 1;
+		*adresse_sortie == MEMORY_COMPRESSED_MAX ? *adresse_sortie = limite_partition + 1 : *adresse_sortie = *adresse_sortie + 1;
 		
 	}
 
@@ -515,26 +863,26 @@ void Encodage_compression(unsigned int* len, int32_t* off, uint16_t* adresse_ent
 	db("Encodage de la compression");
 	/* Format 1: [LLLooooo oooooooo] */
 	if (*len < 7) {
-		write_1_byte((*off >> 8) + (*len << 5), *adresse_sortie > MEMORY_COMPRESSED_MAX ? MEMORY_SIZE + 1 : *adresse_sortie);
-		*adresse_sortie == MEMORY_COMPRESSED_MAX ? *adresse_sortie = MEMORY_SIZE + 1 : *adresse_sortie = *adresse_sortie + 1;
-		write_1_byte(*off, *adresse_sortie > MEMORY_COMPRESSED_MAX ? MEMORY_SIZE + 1 : *adresse_sortie);
-		*adresse_sortie == MEMORY_COMPRESSED_MAX ? *adresse_sortie = MEMORY_SIZE + 1 : *adresse_sortie = *adresse_sortie + 1;
+		write_1_byte((*off >> 8) + (*len << 5), *adresse_sortie > MEMORY_COMPRESSED_MAX ? limite_partition + 1 : *adresse_sortie);
+		*adresse_sortie == MEMORY_COMPRESSED_MAX ? *adresse_sortie = limite_partition + 1 : *adresse_sortie = *adresse_sortie + 1;
+		write_1_byte(*off, *adresse_sortie > MEMORY_COMPRESSED_MAX ? limite_partition + 1 : *adresse_sortie);
+		*adresse_sortie == MEMORY_COMPRESSED_MAX ? *adresse_sortie = limite_partition + 1 : *adresse_sortie = *adresse_sortie + 1;
 	}
 
 	/* Format 2: [111ooooo LLLLLLLL oooooooo] */
 	else {
-		write_1_byte((*off >> 8) + (7 << 5), *adresse_sortie > MEMORY_COMPRESSED_MAX ? MEMORY_SIZE + 1 : *adresse_sortie);
-		*adresse_sortie == MEMORY_COMPRESSED_MAX ? *adresse_sortie = MEMORY_SIZE + 1 : *adresse_sortie = *adresse_sortie + 1;
-		write_1_byte(*len - 7, *adresse_sortie > MEMORY_COMPRESSED_MAX ? MEMORY_SIZE + 1 : *adresse_sortie);
-		*adresse_sortie == MEMORY_COMPRESSED_MAX ? *adresse_sortie = MEMORY_SIZE + 1 : *adresse_sortie = *adresse_sortie + 1;
-		write_1_byte(*off, *adresse_sortie > MEMORY_COMPRESSED_MAX ? MEMORY_SIZE + 1 : *adresse_sortie);
-		*adresse_sortie == MEMORY_COMPRESSED_MAX ? *adresse_sortie = MEMORY_SIZE + 1 : *adresse_sortie = *adresse_sortie + 1;
+		write_1_byte((*off >> 8) + (7 << 5), *adresse_sortie > MEMORY_COMPRESSED_MAX ? limite_partition + 1 : *adresse_sortie);
+		*adresse_sortie == MEMORY_COMPRESSED_MAX ? *adresse_sortie = limite_partition + 1 : *adresse_sortie = *adresse_sortie + 1;
+		write_1_byte(*len - 7, *adresse_sortie > MEMORY_COMPRESSED_MAX ? limite_partition + 1 : *adresse_sortie);
+		*adresse_sortie == MEMORY_COMPRESSED_MAX ? *adresse_sortie = limite_partition + 1 : *adresse_sortie = *adresse_sortie + 1;
+		write_1_byte(*off, *adresse_sortie > MEMORY_COMPRESSED_MAX ? limite_partition + 1 : *adresse_sortie);
+		*adresse_sortie == MEMORY_COMPRESSED_MAX ? *adresse_sortie = limite_partition + 1 : *adresse_sortie = *adresse_sortie + 1;
 	}
 
 	*lit = 0;
 	*adresse_entree = *adresse_entree + *len + 2;  /* ip = initial ip + #octets */
-	if (*adresse_entree > MEMORY_SIZE) {
-		unsigned int haut = *adresse_entree - MEMORY_SIZE - 1;
+	if (*adresse_entree > limite_partition) {
+		unsigned int haut = *adresse_entree - limite_partition - 1;
 		*adresse_entree = haut;
 	}
 
@@ -544,18 +892,18 @@ void Fin_Literal_run(uint16_t* adresse_sortie, uint16_t* adresse_sortie_debut, u
 	
 	db("Fin du recopiage litteral");
 	if (*lit == 0) {
-		*adresse_sortie == MEMORY_COMPRESSED_MAX ? *adresse_sortie = MEMORY_SIZE + 1 : *adresse_sortie = *adresse_sortie + 1;
+		*adresse_sortie == MEMORY_COMPRESSED_MAX ? *adresse_sortie = limite_partition + 1 : *adresse_sortie = *adresse_sortie + 1;
 	}
 	uint16_t adresse_sortie_lit_1;
 
-	if ((*lit+1) > (*adresse_sortie - (MEMORY_SIZE + 1))) {
-		adresse_sortie_lit_1 = MEMORY_COMPRESSED_MAX + 1 - (*lit + 1 - (*adresse_sortie - (MEMORY_SIZE + 1)));  
+	if ((*lit+1) > (*adresse_sortie - (limite_partition + 1))) {
+		adresse_sortie_lit_1 = MEMORY_COMPRESSED_MAX + 1 - (*lit + 1 - (*adresse_sortie - (limite_partition + 1)));  
 		*adresse_sortie -= !(*lit);               /* Undo run if length is zero */
 	}
 	else {
 		adresse_sortie_lit_1 = *adresse_sortie - *lit - 1;
 		*adresse_sortie -= !(*lit);               /* Undo run if length is zero */
-		*adresse_sortie == MEMORY_SIZE ? *adresse_sortie = MEMORY_COMPRESSED_MAX : *adresse_sortie = *adresse_sortie;
+		*adresse_sortie == limite_partition ? *adresse_sortie = MEMORY_COMPRESSED_MAX : *adresse_sortie = *adresse_sortie;
 	}
 	
 	write_1_byte(*lit - 1, adresse_sortie_lit_1); /* Terminate literal run */
@@ -571,23 +919,23 @@ void Recopiage_final(uint16_t* adresse_entree, uint16_t* adresse_entree_debut, u
 	while (*adresse_entree_debut < *adresse_entree ? (*ilen - *adresse_entree + *adresse_entree_debut > 0) : (*adresse_entree < *adresse_entree_fin)) {
 
 		if (*lit == 0) {
-			*adresse_sortie == MEMORY_COMPRESSED_MAX ? *adresse_sortie = MEMORY_SIZE + 1 : *adresse_sortie = *adresse_sortie + 1;
+			*adresse_sortie == MEMORY_COMPRESSED_MAX ? *adresse_sortie = limite_partition + 1 : *adresse_sortie = *adresse_sortie + 1;
 		}
 		*lit = *lit + 1;
-		write_1_byte(read_1_byte(*adresse_entree > MEMORY_SIZE ? 0 : *adresse_entree), *adresse_sortie > MEMORY_COMPRESSED_MAX ? MEMORY_SIZE + 1 : *adresse_sortie);
-		*adresse_entree == MEMORY_SIZE ? *adresse_entree = 0 : *adresse_entree = *adresse_entree + 1;
-		*adresse_sortie == MEMORY_COMPRESSED_MAX ? *adresse_sortie = MEMORY_SIZE + 1 : *adresse_sortie = *adresse_sortie + 1;
+		write_1_byte(read_1_byte(*adresse_entree > limite_partition ? 0 : *adresse_entree), *adresse_sortie > MEMORY_COMPRESSED_MAX ? limite_partition + 1 : *adresse_sortie);
+		*adresse_entree == limite_partition ? *adresse_entree = 0 : *adresse_entree = *adresse_entree + 1;
+		*adresse_sortie == MEMORY_COMPRESSED_MAX ? *adresse_sortie = limite_partition + 1 : *adresse_sortie = *adresse_sortie + 1;
 		
 		if (fx_expect_false(*lit == LZFX_MAX_LIT)) {
-			if (*adresse_sortie - (MEMORY_SIZE + 1) < *lit + 1) {
-				adresse_sortie_lit_1 = MEMORY_COMPRESSED_MAX + 1 - (*lit + 1 - (*adresse_sortie - (MEMORY_SIZE + 1)));
+			if (*adresse_sortie - (limite_partition + 1) < *lit + 1) {
+				adresse_sortie_lit_1 = MEMORY_COMPRESSED_MAX + 1 - (*lit + 1 - (*adresse_sortie - (limite_partition + 1)));
 			}
 			else {
 				adresse_sortie_lit_1 = *adresse_sortie - *lit - 1;
 			}
 			write_1_byte(*lit - 1, adresse_sortie_lit_1); /* Terminate literal run */
 			*lit = 0; 
-			*adresse_sortie == MEMORY_COMPRESSED_MAX ? *adresse_sortie = MEMORY_SIZE + 1 : *adresse_sortie = *adresse_sortie + 1;
+			*adresse_sortie == MEMORY_COMPRESSED_MAX ? *adresse_sortie = limite_partition + 1 : *adresse_sortie = *adresse_sortie + 1;
 
 		}
 	}
@@ -607,13 +955,13 @@ void Continuite(uint32_t* resultat, unsigned int* len, int32_t* off, uint16_t* a
 		*(uint32_t*)off = ((*resultat & (uint32_t)0x1F0000) >> (uint32_t)8) + (*resultat & (uint32_t)0x0000FF);
 	}
 	*adresse_sortie_fin = sortie_fin;
-	*ref = (*adresse_entree - *off - 1 > 0 ? *adresse_entree - *off - 1 : MEMORY_SIZE - *off + *adresse_entree);
+	*ref = (*adresse_entree - *off - 1 > 0 ? *adresse_entree - *off - 1 : limite_partition - *off + *adresse_entree);
 	
 	/* Vrification des valeurs des 2 adresses suivantes */
-	if (*ref + 2 > MEMORY_SIZE) {
-		unsigned int haut = *ref + 2 - MEMORY_SIZE;
+	if (*ref + 2 > limite_partition) {
+		unsigned int haut = *ref + 2 - limite_partition;
 		*ref_2 = haut - 1;
-		if (*ref + 1 > MEMORY_SIZE) {
+		if (*ref + 1 > limite_partition) {
 			*ref_1 = 0;
 		}
 		else {
@@ -625,16 +973,16 @@ void Continuite(uint32_t* resultat, unsigned int* len, int32_t* off, uint16_t* a
 		*ref_1 = *ref + 1;
 	}
 
-	/* Deduction de MAXLEN selon le numero de l'echantillon */
-	if (compteur_echantillon < Dernier_echantillon) {
-		*maxlen = *len + 18;
+	/* Deduction de MAXLEN selon la place de l'echantillon dans le paquet */
+	if (!dernier_du_bloc) {
+		*maxlen = *len + longueur_echantillon - 1;
 	}
-	else if (compteur_echantillon == Dernier_echantillon) {
-		*maxlen = *len + 16;
+	else {
+		*maxlen = *len + longueur_echantillon - 3;
 	}
 	
 	/* Verification de la longueur du motif en commenant par comparer le 4e octet */
-	while ((*len < *maxlen) && read_1_byte(*ref + *len > MEMORY_SIZE ? *len - (MEMORY_SIZE - *ref + 1) : *ref + *len) == read_1_byte(*adresse_entree + *len > MEMORY_SIZE ? *len - (MEMORY_SIZE - *adresse_entree + 1) : *adresse_entree + *len)) {
+	while ((*len < *maxlen) && read_1_byte(*ref + *len > limite_partition ? *len - (limite_partition - *ref + 1) : *ref + *len) == read_1_byte(*adresse_entree + *len > limite_partition ? *len - (limite_partition - *adresse_entree + 1) : *adresse_entree + *len)) {
 		(*len)++;
 	}
 	*len = *len - 2;
@@ -643,15 +991,22 @@ void Continuite(uint32_t* resultat, unsigned int* len, int32_t* off, uint16_t* a
 
 }
 
-void compression() {
+void compression(uint16_t len) {
 	db("Compression");
-	compteur_echantillon++;
-	if (compteur_echantillon > Dernier_echantillon) {
-		compteur_echantillon = 1;
+	longueur_echantillon_prec = longueur_echantillon;
+	longueur_echantillon = len;
+	if (dernier_du_bloc) {   /* Le paquet precedent est ferme, celui-ci en commence un nouveau */
+		compteur_echantillon = 0;
+		octets_bloc = 0;
 		longueur_initiale_totale = 0;
 		longueur_compressee_totale = 0;
 		adr_lir_deb = adr_lir;
+		ajuster_partition();   /* La limite suit le taux de compression sans attendre un rapport confirme */
 	}
+	compteur_echantillon++;
+	octets_bloc += len;
+	/* Le paquet est ferme quand un echantillon de plus le ferait depasser TAILLE_BLOC octets bruts */
+	dernier_du_bloc = octets_bloc + len > TAILLE_BLOC;
 #ifdef _DEBUG
 	db("Numero de l'echantillon");	
 	Serial.println(compteur_echantillon);
@@ -666,10 +1021,10 @@ uint32_t lzfx_compress(uint16_t adresse_entree, uint16_t adresse_sortie) {
 	db("Bienvenue dans LZFX");
 
 	/* Dclaration, dfinitions, initialisations des adresses de dbut et fin du "buffer" d'entre */
-	uint16_t adresse_entree_debut = adr_ecr - 19;
+	uint16_t ilen = longueur_echantillon;
+	uint16_t adresse_entree_debut = adr_ecr >= ilen ? adr_ecr - ilen : limite_partition + 1 - (ilen - adr_ecr);
 	uint16_t adresse_entree_1;
 	uint16_t adresse_entree_2;
-	uint16_t ilen = 19;
 	uint16_t adresse_entree_fin = adr_ecr; // La fin des donnees correspond  l'octet suivant le dernier lu (le prochain  lire)
 
 	
@@ -686,7 +1041,7 @@ uint32_t lzfx_compress(uint16_t adresse_entree, uint16_t adresse_sortie) {
 	else
 	{
 		uint16_t bas = MEMORY_COMPRESSED_MAX - adresse_sortie_debut + 1;
-		adresse_sortie_fin = MEMORY_SIZE + 1 + olen - bas;
+		adresse_sortie_fin = limite_partition + 1 + olen - bas;
 	}
 
 	/* Dclaration, dfinitions, initialisations de variables */
@@ -737,10 +1092,10 @@ uint32_t lzfx_compress(uint16_t adresse_entree, uint16_t adresse_sortie) {
 			else {
 
 				/* Verification des valeurs des 2 adresses suivantes */
-				if (adresse_entree + 2 > MEMORY_SIZE) {
-					unsigned int haut = adresse_entree + 2 - MEMORY_SIZE;
+				if (adresse_entree + 2 > limite_partition) {
+					unsigned int haut = adresse_entree + 2 - limite_partition;
 					adresse_entree_2 = haut - 1;
-					if (adresse_entree + 1 > MEMORY_SIZE) {
+					if (adresse_entree + 1 > limite_partition) {
 						adresse_entree_1 = 0;
 					}
 					else {
@@ -755,10 +1110,10 @@ uint32_t lzfx_compress(uint16_t adresse_entree, uint16_t adresse_sortie) {
 				ref = adresse_entree - 1;
 
 				/* Verification des valeurs des 2 adresses suivantes */
-				if (ref + 2 > MEMORY_SIZE) {
-					unsigned int haut = ref + 2 - MEMORY_SIZE;
+				if (ref + 2 > limite_partition) {
+					unsigned int haut = ref + 2 - limite_partition;
 					ref_2 = haut - 1;
-					if (ref + 1 > MEMORY_SIZE) {
+					if (ref + 1 > limite_partition) {
 						ref_1 = 0;
 					}
 					else {
@@ -771,7 +1126,7 @@ uint32_t lzfx_compress(uint16_t adresse_entree, uint16_t adresse_sortie) {
 				}
 
 				/* Decrementation de ref  la recherche d'un motif redondant */
-				while ((adresse_entree < adr_lir_deb ? (((ref >= 0) && (ref < adresse_entree)) || ((ref > adr_lir_deb + 1) && (ref <= MEMORY_SIZE))) : ((ref > adr_lir_deb + 1) && (ref < adresse_entree)))
+				while ((adresse_entree < adr_lir_deb ? (((ref >= 0) && (ref < adresse_entree)) || ((ref > adr_lir_deb + 1) && (ref <= limite_partition))) : ((ref > adr_lir_deb + 1) && (ref < adresse_entree)))
 
 					&& ((read_1_byte(adresse_entree) != read_1_byte(ref))
 						|| (read_1_byte(adresse_entree_1) != read_1_byte(ref_1))
@@ -780,14 +1135,14 @@ uint32_t lzfx_compress(uint16_t adresse_entree, uint16_t adresse_sortie) {
 					ref--;
 
 					if (ref < 0) {
-						ref = MEMORY_SIZE;
+						ref = limite_partition;
 					}
 
 					// Verification des valeurs des 2 adresses suivantes
-					if (ref + 2 > MEMORY_SIZE) {
-						unsigned int haut = ref + 2 - MEMORY_SIZE;
+					if (ref + 2 > limite_partition) {
+						unsigned int haut = ref + 2 - limite_partition;
 						ref_2 = haut - 1;
-						if (ref + 1 > MEMORY_SIZE) {
+						if (ref + 1 > limite_partition) {
 							ref_1 = 0;
 						}
 						else {
@@ -802,11 +1157,11 @@ uint32_t lzfx_compress(uint16_t adresse_entree, uint16_t adresse_sortie) {
 				}
 
 
-				if (compteur_echantillon < Dernier_echantillon) {
+				if (!dernier_du_bloc) {
 					
 					/* Redondance */
 					if (((ref < adresse_entree) | (adresse_entree < adr_lir_deb))
-						&& ((off = (adresse_entree - ref - 1) > 0 ? (adresse_entree - ref - 1) : (MEMORY_SIZE - ref + adresse_entree)) < LZFX_MAX_OFF)
+						&& ((off = (adresse_entree - ref - 1) > 0 ? (adresse_entree - ref - 1) : (limite_partition - ref + adresse_entree)) < LZFX_MAX_OFF)
 
 						&& (ref > adr_lir_deb ? 1 : (adr_lir_deb > adresse_entree))
 						&& (read_1_byte(ref) == read_1_byte(adresse_entree))
@@ -823,13 +1178,13 @@ uint32_t lzfx_compress(uint16_t adresse_entree, uint16_t adresse_sortie) {
 								LZFX_MAX_REF : adresse_entree_fin - adresse_entree;
 						}
 						else {
-							maxlen = (MEMORY_SIZE + 1  - adresse_entree + adresse_entree_fin) > LZFX_MAX_REF ? LZFX_MAX_REF : MEMORY_SIZE + 1 - adresse_entree + adresse_entree_fin ;
+							maxlen = (limite_partition + 1  - adresse_entree + adresse_entree_fin) > LZFX_MAX_REF ? LZFX_MAX_REF : limite_partition + 1 - adresse_entree + adresse_entree_fin ;
 						}
 						Fin_Literal_run(&adresse_sortie, &adresse_sortie_debut, &adresse_sortie_fin, &lit, &olen);
 						
 
 						/* Verification de la longueur du motif en commenant par comparer le 4e octet */
-						while ((len < maxlen) && read_1_byte(ref + len > MEMORY_SIZE ? len - (MEMORY_SIZE - ref + 1) : ref + len) == read_1_byte(adresse_entree + len > MEMORY_SIZE ? len - (MEMORY_SIZE - adresse_entree + 1) : adresse_entree + len)) {
+						while ((len < maxlen) && read_1_byte(ref + len > limite_partition ? len - (limite_partition - ref + 1) : ref + len) == read_1_byte(adresse_entree + len > limite_partition ? len - (limite_partition - adresse_entree + 1) : adresse_entree + len)) {
 							len++;
 						}
 
@@ -845,7 +1200,7 @@ uint32_t lzfx_compress(uint16_t adresse_entree, uint16_t adresse_sortie) {
 							}
 							else
 							{
-								olen = MEMORY_COMPRESSED_MAX + 1 - adresse_sortie_debut + adresse_sortie - MEMORY_SIZE - 1;
+								olen = MEMORY_COMPRESSED_MAX + 1 - adresse_sortie_debut + adresse_sortie - limite_partition - 1;
 							}
 							longueur_compressee_totale = longueur_compressee_totale + olen;
 							longueur_initiale_totale = longueur_initiale_totale + ilen;
@@ -867,20 +1222,20 @@ uint32_t lzfx_compress(uint16_t adresse_entree, uint16_t adresse_sortie) {
 						
 						/* Cas du premier octet du 2nd echantillon : recopiage */
 						if (compteur_echantillon == 2 && adresse_entree == adresse_entree_debut) {
-							lit = 19;
+							lit = longueur_echantillon_prec;
 						}
 						Literal_run(&adresse_entree, &adresse_sortie, &adresse_sortie_debut, &adresse_sortie_fin, &lit, &olen);
 					}
 
-				} /* echantillons < Dernier_echantillon */
+				} /* echantillons avant le dernier du paquet */
 
-				else if (compteur_echantillon == Dernier_echantillon) {
+				else {
 
 					db("Dernier echantillon !");
 
 					/* Redondance */
 					if (((ref < adresse_entree) | (adresse_entree < adr_lir_deb))
-						&& ((off = (adresse_entree - ref - 1) > 0 ? (adresse_entree - ref - 1) : (MEMORY_SIZE - ref + adresse_entree)) < LZFX_MAX_OFF)
+						&& ((off = (adresse_entree - ref - 1) > 0 ? (adresse_entree - ref - 1) : (limite_partition - ref + adresse_entree)) < LZFX_MAX_OFF)
 						&& (adresse_entree + 4 < adresse_entree_fin ? 1 : (ilen - adresse_entree - adresse_entree_debut > 4))  /* Backref takes up to 3 bytes, so don't bother */
 						&& (ref > adr_lir_deb ? 1 : (adr_lir_deb > adresse_entree))
 						&& (read_1_byte(ref) == read_1_byte(adresse_entree))
@@ -895,12 +1250,12 @@ uint32_t lzfx_compress(uint16_t adresse_entree, uint16_t adresse_sortie) {
 								LZFX_MAX_REF : adresse_entree_fin - adresse_entree - 2;
 						}
 						else {
-							maxlen = (MEMORY_SIZE + 1 - adresse_entree + adresse_entree_fin - 2) > LZFX_MAX_REF ? LZFX_MAX_REF : MEMORY_SIZE + 1 - adresse_entree + adresse_entree_fin - 2;
+							maxlen = (limite_partition + 1 - adresse_entree + adresse_entree_fin - 2) > LZFX_MAX_REF ? LZFX_MAX_REF : limite_partition + 1 - adresse_entree + adresse_entree_fin - 2;
 						}
 						Fin_Literal_run(&adresse_sortie, &adresse_sortie_debut, &adresse_sortie_fin, &lit, &olen);
 						
 						/* Verification de la longueur du motif en commenant par comparer le 4e octet */
-						while ((len < maxlen) && read_1_byte(ref + len > MEMORY_SIZE ? len - (MEMORY_SIZE - ref + 1) : ref + len) == read_1_byte(adresse_entree + len > MEMORY_SIZE ? len - (MEMORY_SIZE - adresse_entree + 1) : adresse_entree + len)) {
+						while ((len < maxlen) && read_1_byte(ref + len > limite_partition ? len - (limite_partition - ref + 1) : ref + len) == read_1_byte(adresse_entree + len > limite_partition ? len - (limite_partition - adresse_entree + 1) : adresse_entree + len)) {
 							len++;
 						}
 
@@ -929,7 +1284,7 @@ uint32_t lzfx_compress(uint16_t adresse_entree, uint16_t adresse_sortie) {
 		db("Derniers octets !");
 
 		/* Cas des echantillons dont les derniers octets suivent un Literal Run */
-		if (compteur_echantillon != Dernier_echantillon) {
+		if (!dernier_du_bloc) {
 			adr_lir = adresse_entree;
 			adr_ecr_comp = adresse_sortie;
 			if (adresse_sortie > adresse_sortie_debut)
@@ -938,7 +1293,7 @@ uint32_t lzfx_compress(uint16_t adresse_entree, uint16_t adresse_sortie) {
 			}
 			else
 			{
-				olen = MEMORY_COMPRESSED_MAX + 1 - adresse_sortie_debut + adresse_sortie - MEMORY_SIZE - 1;
+				olen = MEMORY_COMPRESSED_MAX + 1 - adresse_sortie_debut + adresse_sortie - limite_partition - 1;
 			}
 			longueur_compressee_totale = longueur_compressee_totale + olen;
 			longueur_initiale_totale = longueur_initiale_totale + ilen;
@@ -961,7 +1316,7 @@ uint32_t lzfx_compress(uint16_t adresse_entree, uint16_t adresse_sortie) {
 	}
 	else
 	{
-		olen = MEMORY_COMPRESSED_MAX + 1 - adresse_sortie_debut + adresse_sortie - MEMORY_SIZE - 1;
+		olen = MEMORY_COMPRESSED_MAX + 1 - adresse_sortie_debut + adresse_sortie - limite_partition - 1;
 	}
 
 	/* Calcul de l'adresse de fin des donnees compressees */
@@ -972,7 +1327,7 @@ uint32_t lzfx_compress(uint16_t adresse_entree, uint16_t adresse_sortie) {
 	else
 	{
 		uint16_t bas = MEMORY_COMPRESSED_MAX + 1 - adresse_sortie_debut;
-		adresse_sortie_fin = MEMORY_SIZE + 1 + olen - bas;
+		adresse_sortie_fin = limite_partition + 1 + olen - bas;
 	}
 
 	/* Calcul des longueurs totales de donnees  */
@@ -980,15 +1335,15 @@ uint32_t lzfx_compress(uint16_t adresse_entree, uint16_t adresse_sortie) {
 	longueur_initiale_totale = longueur_initiale_totale + ilen;
 
 	/* Mise a jour des pointeurs */
-	adr_lir = adresse_entree_fin > MEMORY_SIZE ? 0 : adresse_entree_fin;
-	adr_ecr_comp = adresse_sortie  > MEMORY_COMPRESSED_MAX ? MEMORY_SIZE + 1 : adresse_sortie;
+	adr_lir = adresse_entree_fin > limite_partition ? 0 : adresse_entree_fin;
+	adr_ecr_comp = adresse_sortie  > MEMORY_COMPRESSED_MAX ? limite_partition + 1 : adresse_sortie;
 	
 	//Affichages
 #ifdef _DEBUG
 	int k,m;
 	if (compteur_echantillon == 1) {
 		for (k = 0; k < olen ; k++) {
-			Serial.println (read_1_byte (adr_lir_comp + k > MEMORY_COMPRESSED_MAX ? MEMORY_SIZE + adr_lir_comp + k - MEMORY_COMPRESSED_MAX : adr_lir_comp + k));
+			Serial.println (read_1_byte (adr_lir_comp + k > MEMORY_COMPRESSED_MAX ? limite_partition + adr_lir_comp + k - MEMORY_COMPRESSED_MAX : adr_lir_comp + k));
 		}
 	}
 	else {
@@ -1002,7 +1357,7 @@ uint32_t lzfx_compress(uint16_t adresse_entree, uint16_t adresse_sortie) {
 				Serial.println(read_1_byte(adr_lir_comp + k));
 			}
 			for (m = 0; m < longueur_compressee_totale - (MEMORY_COMPRESSED_MAX + 1 - adr_lir_comp); m++) {
-				Serial.println(read_1_byte(MEMORY_SIZE + 1 + m));
+				Serial.println(read_1_byte(limite_partition + 1 + m));
 			}
 		}
 
@@ -7,7 +7,9 @@
 * --- GESTION DE LA MEMOIRE ---
 *
 * --- Structure de la mmoire ---
-* Concatenation de blocks de 18 bytes avec chaque block un chantillon de donnes.
+* Concatenation d'enregistrements avec chaque enregistrement un chantillon de donnes,
+* prcd de son dlai depuis l'enregistrement prcdent et de sa longueur (voir stor_write_timed).
+* Un enregistrement vide de delai nul marque chaque redemarrage, les temps repartent de 0.
 *
 * --- Fonctions accessibles aux autres parties du systme ---
 * 1) void stor_write(byte *sample)
@@ -44,8 +46,22 @@ void stor_end(void);
 
 void stor_end_comp(void);
 
+/*
+	Test non destructif de la memoire (SPI, registre d'etat, ecriture d'une page de test reservee)
+	Retourne 'O' si le test a reussi
+*/
 uint8_t stor_test(void);
 
+/*
+	Configuration gardee d'un demarrage a l'autre, dans une page reservee de la memoire (PAGE_SIZE - 3 octets au plus)
+	stor_write_config() enregistre les 'len' octets de 'data', retourne 0, -1 en cas d'erreur
+	stor_read_config() copie la configuration dans 'buffer', retourne sa longueur, 0 si aucune configuration valide
+	n'a ete enregistree ou si elle depasse 'maxlen'
+	La memoire est demarree et arretee par ces fonctions (comme stor_test)
+*/
+uint8_t stor_write_config(uint8_t *data, uint8_t len);
+uint8_t stor_read_config(uint8_t *buffer, uint8_t maxlen);
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -61,6 +77,12 @@ uint16_t stor_available(void);
 	premire addresse qui est libre.
 */
 uint8_t stor_write(uint8_t * data, uint16_t len);
+/*
+	Stocke un enregistrement precede de son delai depuis le precedent (secondes) et de sa longueur,
+	et met a jour l'index temporel. Le premier apres un redemarrage est precede du marqueur de redemarrage.
+	Retourne la longueur totale stockee, 0 en cas d'erreur.
+*/
+uint16_t stor_write_timed(uint32_t temps, uint8_t *data, uint8_t len);
 //uint8_t stor_write_comp(uint8_t * data, uint16_t len);
 /*
 	Ce fonction va lire et retourner les donnes qui sont stocks
@@ -68,13 +90,22 @@ uint8_t stor_write(uint8_t * data, uint16_t len);
 */
 uint16_t stor_read(uint8_t *buffer, uint16_t maxlen);
 uint16_t stor_read_comp(uint8_t *buffer, uint16_t maxlen);
+/*
+	Lit les enregistrements dont le temps est compris entre t0 et t1 en cherchant dans l'index temporel
+	(a appeler entre stor_start() et stor_end(), les pointeurs de lecture ne sont pas modifies)
+	Avec buffer NULL, retourne seulement la longueur qui serait lue
+*/
+uint16_t stor_read_range(uint32_t t0, uint32_t t1, uint8_t *buffer, uint16_t maxlen, uint32_t *premier);
 /*
 Query available lenght of data store
 */
 uint16_t stor_available(void);
 uint16_t stor_available_comp(void);
 
-void compression();
+/*
+	Compresse le dernier echantillon ecrit, de longueur 'len'
+*/
+void compression(uint16_t len);
 uint32_t lzfx_compress(uint16_t adresse_entree, uint16_t adresse_sortie);
 void recopiage(uint8_t* lit, uint16_t* adresse_entree, uint16_t* adresse_entree_debut, uint16_t* adresse_entree_fin, uint16_t* adresse_sortie, uint16_t* adresse_sortie_debut, uint16_t* adresse_sortie_fin, uint16_t* ilen, uint16_t* olen);
 void Literal_run (uint16_t* adresse_entree, uint16_t* adresse_sortie, uint16_t* adresse_sortie_debut, uint16_t* adresse_sortie_fin, uint8_t* lit, uint16_t* olen);
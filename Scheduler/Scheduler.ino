@@ -12,6 +12,8 @@
 #define DB_MODULE "Scheduler"
 #include "debug.h"
 
+#define BUTTON_PIN 3 // External interrupt (INT0 on the Feather 32u4), to ground
+
 void short_blink() {
 	digitalWrite(LED_BUILTIN, HIGH);
 	delay(20);
@@ -63,6 +65,10 @@ void setup()
 	sched_add_task(say_hello, 1, 3);
 	sched_add_task(say_hello_nicelly, 2, 3);
 
+	// Blinks as soon as the button is pressed, even in deep sleep
+	pinMode(BUTTON_PIN, INPUT_PULLUP);
+	sched_wake_pin(BUTTON_PIN, short_blink, FALLING);
+
 	Serial.println("Entering mainloop");
 	Serial.flush();
 
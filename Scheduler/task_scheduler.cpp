@@ -13,26 +13,117 @@
 
 
 /*
-	Simple scheduler
-	1Hz tick interruption updates the timers
-	mainloop calls tasks ready to be executed (non-preemptivelly) in a fifo execution order
-	made for cyclic tasks (looptime)
+	Simple tickless scheduler
+	The timer interrupt is programmed for the nearest task deadline instead of ticking every second
+	Deadlines are kept in milliseconds of sched_millis(), compared with wraparound so the 49 days wrap is harmless
+	The pending tasks are kept in a min-heap on their absolute due time, the ones that are due move to a second heap
+	ordered by priority, mainloop pops and calls them from there (non-preemptivelly)
+	Equal priorities run in deadline order, tasks due at the same time in the order they were queued
+	made for cyclic tasks (looptime), the catch-up policy tells what to do with the periods missed by a late task
 */
 
-#define SCHED_MAX_TASKS 8
+#define SCHED_MAX_SLEEP 3600000ul // Longest sleep when no task is pending, ms
 
 
 struct task_handle {
 	void (*task)(void);
-	volatile int32_t delay;
-	int32_t looptime;
+	uint32_t due;      // sched_millis() of the next call
+	uint32_t phase;    // sched_millis() the run in progress was due at, the next period is counted from there
+	int32_t looptime;  // ms
+	uint16_t seq;      // Queuing order, breaks the ties between equal due times
+	bool waiting;      // Suspended by sched_resume(), in the middle of a run
+	bool light;        // Suspended on a peripheral, the scheduler only sleeps lightly
+	uint8_t priority;
+	uint8_t catchup;   // enum sched_catchup
+	uint16_t missed;   // Periods skipped or merged by the catch-up policy
+	bool cancelled;    // Freed once its run is over
+	bool requested;    // sched_reschedule() came in while it was running, next run at <request> if that's earlier
+	uint32_t request;
 };
 
-struct task_handle task_list[SCHED_MAX_TASKS];
+// Binary heap of task slots, the first one according to <before> on top
+struct task_heap {
+	uint8_t slots[SCHED_MAX_TASKS];
+	uint8_t count;
+	bool (*before)(uint8_t a, uint8_t b);
+};
+
+bool task_before(uint8_t a, uint8_t b);
+bool task_first(uint8_t a, uint8_t b);
+
+struct task_handle task_list[SCHED_MAX_TASKS]; // Task slots, the index is the task number
+struct task_heap timers = { { 0 }, 0, task_before }; // Pending tasks, by due time
+struct task_heap ready = { { 0 }, 0, task_first };   // Tasks that are due, by priority
+uint16_t task_seq = 0;
+uint8_t task_current = SCHED_NO_TASK;          // Slot of the running task
+bool task_resume = false;                      // The running task asked to be called again
+uint32_t task_resume_delay;                    // ms
+bool task_resume_light;                        // The running task waits on a peripheral
+uint8_t task_waiting = 0;                      // Number of suspended tasks that need a light sleep
+
+#ifdef __AVR_ATmega32U4__
+volatile uint32_t sched_ms = 0;      // Milliseconds since setup, updated at the end of every watchdog period
+volatile uint32_t sched_seconds = 0; // Seconds since setup
+volatile uint16_t sched_subsec = 0;  // Milliseconds past sched_seconds
+volatile uint32_t sched_wake = 0;    // sched_ms of the next deadline
+volatile bool sched_awake = true;    // Tasks may be added while awake, keep to the shortest periods
+
+// Watchdog periods (nominal, the watchdog oscillator is only a few % accurate)
+// The longest one that doesn't go past the next deadline is chained
+const struct {
+	uint16_t ms;
+	uint8_t prescaler;
+} wdt_periods[] = {
+	{ 8000, (1 << WDP3) | (1 << WDP0) },
+	{ 4000, (1 << WDP3) },
+	{ 2000, (1 << WDP2) | (1 << WDP1) | (1 << WDP0) },
+	{ 1000, (1 << WDP2) | (1 << WDP1) },
+	{ 500, (1 << WDP2) | (1 << WDP0) },
+	{ 250, (1 << WDP2) },
+	{ 125, (1 << WDP1) | (1 << WDP0) },
+	{ 64, (1 << WDP1) },
+	{ 32, (1 << WDP0) },
+	{ 16, 0 }
+};
+
+#define WDT_PERIODS (sizeof(wdt_periods) / sizeof(wdt_periods[0]))
 
+volatile uint8_t wdt_period = WDT_PERIODS - 1; // Index in wdt_periods of the period in progress
+#elif __SAMD21G18A__
+volatile uint32_t rtc_epoch = 0; // RTC counter overflows, the upper half of the 64 bits tick count
+#endif
+
+#define SCHED_MAX_WAKE_PINS 4
+
+static_assert((SCHED_EVENT_QUEUE & (SCHED_EVENT_QUEUE - 1)) == 0 && SCHED_EVENT_QUEUE <= 128,
+	"SCHED_EVENT_QUEUE must be a power of 2");
 
-inline void tick_callback(void);
-void sched_sleep(void);
+// Posted events, the indexes run freely and wrap together with the queue
+void (*volatile event_queue[SCHED_EVENT_QUEUE])(void);
+volatile uint8_t event_head = 0; // Next free place, moved by sched_post()
+volatile uint8_t event_tail = 0; // Next event, moved by the mainloop
+
+// Wake up pins, one interrupt routine each since attachInterrupt() gives no context
+struct {
+	uint8_t pin;
+	void (*volatile task)(void);
+} wake_pins[SCHED_MAX_WAKE_PINS];
+
+void wake_isr0(void) { sched_post(wake_pins[0].task); }
+void wake_isr1(void) { sched_post(wake_pins[1].task); }
+void wake_isr2(void) { sched_post(wake_pins[2].task); }
+void wake_isr3(void) { sched_post(wake_pins[3].task); }
+
+void (*const wake_isrs[SCHED_MAX_WAKE_PINS])(void) = { wake_isr0, wake_isr1, wake_isr2, wake_isr3 };
+
+#ifdef SCHED_PROFILE
+struct sched_profile profile;
+uint32_t profile_since;   // sched_time() of the reset
+uint32_t profile_woken;   // micros() at the end of the last sleep
+#endif
+
+
+void sched_sleep(uint32_t wake);
 
 
 void sched_setup(void) {
@@ -42,13 +133,19 @@ void sched_setup(void) {
 	for (i = 0; i < SCHED_MAX_TASKS; i++) {
 		task_list[i].task = NULL;
 	}
+	timers.count = 0;
+	ready.count = 0;
+	task_waiting = 0;
+#ifdef SCHED_PROFILE
+	sched_profile_reset();
+#endif
 
 	// Clocks setup
 #ifdef __AVR_ATmega32U4__ /* Using ATmega32u4 - GSM module */
 	// Board setup
 
 	// We'll be using the Watchdog since it's always ON
-	// Configure the Watchdog for 1Hz interrupts
+	// Configure the Watchdog for its shortest period (16ms), the ISR chains the next ones
 	noInterrupts();
 	wdt_reset();
 	/* Setup Watchdog */ // Source : MICROCHIP APP NOTE AVR132
@@ -57,14 +154,33 @@ void sched_setup(void) {
 	WDTCSR = (1 << WDCE) | (1 << WDE);                     // Enable configuration change.
 	WDTCSR = (1 << WDIF) | (1 << WDIE) |                     // Enable Watchdog Interrupt Mode.
 		(1 << WDCE) | (0 << WDE) |                     // Disable Watchdog System Reset Mode if unintentionally enabled.
-		(0 << WDP3) | (1 << WDP2) | (1 << WDP1) | (0 << WDP0); // Set Watchdog Timeout period to 1.0 sec.
+		wdt_periods[wdt_period].prescaler;             // Set Watchdog Timeout period to 16ms.
 
 	wdt_reset();
 	interrupts();
 }
 
-ISR(WDT_vect) { // Watchdog interrupt. Interrupt driven tick, called every 1s, updates task delays
-	tick_callback();
+ISR(WDT_vect) { // Watchdog interrupt, end of a period
+	uint16_t ms = wdt_periods[wdt_period].ms;
+	sched_ms += ms;
+	sched_subsec += ms;
+	while (sched_subsec >= 1000) {
+		sched_subsec -= 1000;
+		sched_seconds++;
+	}
+
+	// Next period, the shortest one while awake or once the deadline is reached
+	int32_t remaining = sched_awake ? 0 : (int32_t)(sched_wake - sched_ms);
+	uint8_t i = 0;
+	while (i < WDT_PERIODS - 1 && wdt_periods[i].ms > remaining) {
+		i++;
+	}
+	if (i != wdt_period) {
+		wdt_period = i;
+		wdt_reset();
+		WDTCSR = (1 << WDCE) | (1 << WDE); // Timed sequence, interrupts are already disabled
+		WDTCSR = (1 << WDIE) | wdt_periods[i].prescaler;
+	}
 }  // After the IRC returns, the CPU runs the mainloop
 
 #endif
@@ -91,130 +207,633 @@ ISR(WDT_vect) { // Watchdog interrupt. Interrupt driven tick, called every 1s, u
 	while (GCLK->STATUS.bit.SYNCBUSY);
 	
 	// Reseting the module
-	// Using MODE 1 for set period overflow
-	RTC->MODE1.CTRL.reg &= ~RTC_MODE1_CTRL_ENABLE; // disable RTC
-	while (RTC->MODE1.STATUS.bit.SYNCBUSY);
-	RTC->MODE1.CTRL.reg |= RTC_MODE1_CTRL_SWRST; // software reset
-	while (RTC->MODE1.STATUS.bit.SYNCBUSY);
+	// Using MODE 0, the free running 32 bits counter (1024Hz) is the scheduler time and COMP0 the next deadline
+	// Its overflows are counted in rtc_epoch
+	RTC->MODE0.CTRL.reg &= ~RTC_MODE0_CTRL_ENABLE; // disable RTC
+	while (RTC->MODE0.STATUS.bit.SYNCBUSY);
+	RTC->MODE0.CTRL.reg |= RTC_MODE0_CTRL_SWRST; // software reset
+	while (RTC->MODE0.STATUS.bit.SYNCBUSY);
 
-	RTC->MODE1.CTRL.reg |= RTC_MODE1_CTRL_MODE_COUNT16 // 16bit counter mode
-		| RTC_MODE1_CTRL_PRESCALER_DIV1024; // 1hz count
-	RTC->MODE1.PER.reg |= RTC_MODE1_PER_PER(0); // count to 1 at 1hz for 1s period
+	RTC->MODE0.CTRL.reg |= RTC_MODE0_CTRL_MODE_COUNT32 // 32bit counter mode, no clear on match
+		| RTC_MODE0_CTRL_PRESCALER_DIV1; // 1024hz count
+	RTC->MODE0.COMP[0].reg = RTC_MODE0_COMP_COMP(1);
+	while (RTC->MODE0.STATUS.bit.SYNCBUSY);
 
-	RTC->MODE1.INTFLAG.reg = RTC_MODE1_INTFLAG_OVF; // clear flag
-	RTC->MODE1.INTENSET.reg |= RTC_MODE1_INTENSET_OVF; // enable overflow interrupt
-	//RTC->MODE1.INTENCLR.reg |= RTC_MODE1_INTENCLR_CMP0 | RTC_MODE1_INTENCLR_CMP1 | RTC_MODE1_INTENCLR_SYNCRDY; // Disable other interrupts
+	RTC->MODE0.INTFLAG.reg = RTC_MODE0_INTFLAG_CMP0 | RTC_MODE0_INTFLAG_OVF; // clear flags
+	RTC->MODE0.INTENSET.reg |= RTC_MODE0_INTENSET_CMP0 | RTC_MODE0_INTENSET_OVF; // enable compare and overflow interrupts
 
 	NVIC_EnableIRQ(RTC_IRQn); // enable RTC interrupt 
 
-	RTC->MODE1.CTRL.reg |= RTC_MODE1_CTRL_ENABLE; // enable RTC
-	while (RTC->MODE1.STATUS.bit.SYNCBUSY);
+	RTC->MODE0.CTRL.reg |= RTC_MODE0_CTRL_ENABLE; // enable RTC
+	while (RTC->MODE0.STATUS.bit.SYNCBUSY);
+
+	// Keep the counter synchronised to the bus clock, a read request would wait for a few 1khz clock cycles
+	RTC->MODE0.READREQ.reg = RTC_READREQ_RREQ | RTC_READREQ_RCONT | RTC_READREQ_ADDR(0x10); // COUNT
+	while (RTC->MODE0.STATUS.bit.SYNCBUSY);
 }
 
 void RTC_Handler(void)  // Fills in a weak reference on the Core definitions
 {
-	RTC->MODE1.INTFLAG.reg = RTC_MODE1_INTFLAG_OVF; // must clear flag (by writting 1 to it)
-	tick_callback();
+	if (RTC->MODE0.INTFLAG.bit.OVF) {
+		RTC->MODE0.INTFLAG.reg = RTC_MODE0_INTFLAG_OVF;
+		rtc_epoch++;
+	}
+	RTC->MODE0.INTFLAG.reg = RTC_MODE0_INTFLAG_CMP0; // must clear flag (by writting 1 to it)
+	// Only wakes up the CPU, the mainloop reads the counter
+}
 
+// RTC ticks (1/1024s) since setup
+uint64_t rtc_ticks(void) {
+	uint32_t primask = __get_PRIMASK(); // Also called with the interrupts disabled (sched_sleep)
+	__disable_irq();
+	while (RTC->MODE0.STATUS.bit.SYNCBUSY); // Continuously synchronised (READREQ.RCONT)
+	uint32_t count = RTC->MODE0.COUNT.reg;
+	uint32_t epoch = rtc_epoch;
+	if (RTC->MODE0.INTFLAG.bit.OVF && count < 0x80000000ul) { // Overflow not handled yet
+		epoch++;
+	}
+	__set_PRIMASK(primask);
+	return ((uint64_t)epoch << 32) | count;
+}
+#endif
+#ifdef SCHED_HOST
+	// The clock is the simulation's virtual one
 }
 #endif
 
 
-inline void tick_callback(void) {
-	uint8_t i;
-	// Interrupts should be already non-rentrant, and this one has a 1s cycle
-	for (i = 0; i < SCHED_MAX_TASKS; i++) { // For every (valid) task
-		if (task_list[i].task != NULL) {
-			task_list[i].delay -= 1;  // Update time by 1 tick
+// Tells if the task in slot <a> is due before the one in slot <b>
+bool task_before(uint8_t a, uint8_t b) {
+	int32_t diff = (int32_t)(task_list[a].due - task_list[b].due);
+	return diff < 0 || (diff == 0 && (int16_t)(task_list[a].seq - task_list[b].seq) < 0);
+}
+
+// Tells if the due task in slot <a> runs before the one in slot <b>
+bool task_first(uint8_t a, uint8_t b) {
+	if (task_list[a].priority != task_list[b].priority) {
+		return task_list[a].priority > task_list[b].priority;
+	}
+	return task_before(a, b);
+}
+
+// Moves <slot> up from <pos> to its place
+void heap_sift_up(struct task_heap *heap, uint8_t pos, uint8_t slot) {
+	while (pos > 0) {
+		uint8_t parent = (pos - 1) / 2;
+		if (!heap->before(slot, heap->slots[parent])) {
+			break;
+		}
+		heap->slots[pos] = heap->slots[parent];
+		pos = parent;
+	}
+	heap->slots[pos] = slot;
+}
+
+// Moves <slot> down from <pos> to its place
+void heap_sift_down(struct task_heap *heap, uint8_t pos, uint8_t slot) {
+	while (1) {
+		uint8_t child = 2 * pos + 1;
+		if (child >= heap->count) {
+			break;
 		}
+		if (child + 1 < heap->count && heap->before(heap->slots[child + 1], heap->slots[child])) {
+			child++;
+		}
+		if (!heap->before(heap->slots[child], slot)) {
+			break;
+		}
+		heap->slots[pos] = heap->slots[child];
+		pos = child;
 	}
+	heap->slots[pos] = slot;
 }
 
+void heap_push(struct task_heap *heap, uint8_t slot) {
+	heap_sift_up(heap, heap->count++, slot);
+}
 
-uint8_t sched_add_task(void (*task)(void), int32_t delay, int32_t looptime) {
+uint8_t heap_pop(struct task_heap *heap) {
+	uint8_t top = heap->slots[0];
+	heap_sift_down(heap, 0, heap->slots[--heap->count]);
+	return top;
+}
+
+// Takes <slot> out of the heap, returns false if it isn't in it
+bool heap_remove(struct task_heap *heap, uint8_t slot) {
+	uint8_t pos = 0;
+	while (pos < heap->count && heap->slots[pos] != slot) {
+		pos++;
+	}
+	if (pos == heap->count) {
+		return false;
+	}
+	uint8_t last = heap->slots[--heap->count];
+	if (pos < heap->count) { // The last one fills the hole
+		if (pos > 0 && heap->before(last, heap->slots[(pos - 1) / 2])) {
+			heap_sift_up(heap, pos, last);
+		}
+		else {
+			heap_sift_down(heap, pos, last);
+		}
+	}
+	return true;
+}
+
+// Queues the task of <slot> for its due time
+void task_queue(uint8_t slot) {
+	task_list[slot].seq = task_seq++;
+	heap_push(&timers, slot);
+}
+
+// Adds the tasks posted by the interrupts
+void event_drain(void) {
+	while (event_tail != event_head) {
+		void (*task)(void) = event_queue[event_tail % SCHED_EVENT_QUEUE];
+		event_tail++; // Frees the place, the interrupts only write at event_head
+		sched_add_task_ms(task, 0, 0, SCHED_PRIORITY_HIGH, SCHED_CATCHUP_ALL, SCHED_UNIQUE);
+	}
+}
+
+// Moves the tasks that are due to the ready heap
+void task_collect(void) {
+	event_drain();
+	uint32_t now = sched_millis();
+	while (timers.count > 0 && (int32_t)(task_list[timers.slots[0]].due - now) <= 0) {
+		heap_push(&ready, heap_pop(&timers));
+	}
+}
+
+/*
+	Next period of a cyclic task, once its run is over
+	With the ALL policy the periods already over are run back to back, otherwise the task goes on with the first
+	period in the future and the ones in between are counted as missed
+*/
+void task_next_period(struct task_handle *t) {
+	t->phase += t->looptime;
+	int32_t late = (int32_t)(sched_millis() - t->phase);
+	if (late < 0 || t->catchup == SCHED_CATCHUP_ALL) {
+		return;
+	}
+	uint32_t periods = late / t->looptime + 1;
+	t->phase += periods * t->looptime;
+	t->missed += periods;
+}
+
+// Tells if a SKIP task is so late that its whole period is over, it doesn't run then
+bool task_expired(struct task_handle *t) {
+	return t->catchup == SCHED_CATCHUP_SKIP && t->looptime > 0 && !t->waiting
+		&& (int32_t)(sched_millis() - t->phase) >= t->looptime;
+}
+
+
+uint8_t sched_add_task(void (*task)(void), int32_t delay, int32_t looptime, uint8_t priority, uint8_t catchup,
+	uint8_t flags) {
+	return sched_add_task_ms(task, delay * 1000, looptime * 1000, priority, catchup, flags);
+}
+
+uint8_t sched_add_task_ms(void (*task)(void), uint32_t delay, uint32_t looptime, uint8_t priority, uint8_t catchup,
+	uint8_t flags) {
 	db("Add task");
 	uint8_t i;
-	// Add to list
-	noInterrupts(); // Atomic access to the task list
+	if (flags & SCHED_UNIQUE) {
+		i = sched_find(task);
+		if (i != SCHED_NO_TASK) { // Merged with the pending one
+			sched_reschedule_ms(i, delay);
+			return i;
+		}
+	}
 	for (i = 0; i < SCHED_MAX_TASKS; i++) {// Find an empty slot
 		if (task_list[i].task == NULL) {
-			task_list[i].task = task;
-			task_list[i].delay = delay;
-			task_list[i].looptime = looptime;
 			break;
 		}
 	}
-	interrupts(); // End of atomic
 
 	if (i == SCHED_MAX_TASKS) {  // Max tasks limit reached
 		db("max tasks reached");
 		return -1;
 	}
+	task_list[i].task = task;
+	task_list[i].due = sched_millis() + delay;
+	task_list[i].phase = task_list[i].due;
+	task_list[i].looptime = looptime;
+	task_list[i].waiting = false;
+	task_list[i].light = false;
+	task_list[i].priority = priority;
+	task_list[i].catchup = catchup;
+	task_list[i].missed = 0;
+	task_list[i].cancelled = false;
+	task_list[i].requested = false;
+	task_queue(i);
+#ifdef SCHED_PROFILE
+	memset(&profile.tasks[i], 0, sizeof(profile.tasks[i]));
+#endif
 	db_print("task nb: ");
 	db_print(i);
 	db_println();
 	return i; // Return task index
 }
 
+void sched_resume(int32_t delay, bool light) {
+	sched_resume_ms(delay * 1000, light);
+}
+
+void sched_resume_ms(uint32_t delay, bool light) {
+	task_resume = true;
+	task_resume_delay = delay;
+	task_resume_light = light;
+}
+
+uint8_t sched_task_id(void) {
+	return task_current;
+}
+
+uint8_t sched_find(void (*task)(void)) {
+	for (uint8_t i = 0; i < SCHED_MAX_TASKS; i++) {
+		if (task_list[i].task == task && !task_list[i].cancelled) {
+			return i;
+		}
+	}
+	return SCHED_NO_TASK;
+}
+
+// Slot <id> holds a task
+bool task_valid(uint8_t id) {
+	return id < SCHED_MAX_TASKS && task_list[id].task != NULL && !task_list[id].cancelled;
+}
+
+uint8_t sched_cancel(uint8_t id) {
+	if (!task_valid(id)) {
+		return -1;
+	}
+	if (id == task_current || task_list[id].waiting) { // The run goes on, the mainloop frees the slot after it
+		task_list[id].cancelled = true;
+		return 0;
+	}
+	if (!heap_remove(&timers, id)) {
+		heap_remove(&ready, id);
+	}
+	task_list[id].task = NULL;
+	return 0;
+}
+
+uint8_t sched_reschedule(uint8_t id, int32_t delay) {
+	return sched_reschedule_ms(id, delay * 1000);
+}
+
+uint8_t sched_reschedule_ms(uint8_t id, uint32_t delay) {
+	if (!task_valid(id)) {
+		return -1;
+	}
+	struct task_handle *t = &task_list[id];
+	uint32_t due = sched_millis() + delay;
+	if (id == task_current || t->waiting) { // Applied once the run is over
+		if (!t->requested || (int32_t)(due - t->request) < 0) {
+			t->request = due;
+			t->requested = true;
+		}
+		return 0;
+	}
+	if ((int32_t)(due - t->due) < 0 && heap_remove(&timers, id)) { // Not due yet, and it would be later than asked
+		t->due = due;
+		if (t->looptime <= 0) {
+			t->phase = due;
+		}
+		task_queue(id);
+	}
+	return 0;
+}
+
+uint8_t sched_set_period(uint8_t id, int32_t looptime) {
+	return sched_set_period_ms(id, looptime * 1000);
+}
+
+uint8_t sched_set_period_ms(uint8_t id, uint32_t looptime) {
+	if (!task_valid(id)) {
+		return -1;
+	}
+	task_list[id].looptime = looptime;
+	return 0;
+}
+
+uint8_t sched_post(void (*task)(void)) {
+	// Also called out of the interrupts, the higher priority ones may interrupt an other post (SAMD)
+#ifdef __AVR_ATmega32U4__
+	uint8_t sreg = SREG;
+	cli();
+#elif __SAMD21G18A__
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+#endif
+	uint8_t code = 0;
+	uint8_t head = event_head;
+	if ((uint8_t)(head - event_tail) == SCHED_EVENT_QUEUE) { // Full
+		code = -1;
+	}
+	else {
+		event_queue[head % SCHED_EVENT_QUEUE] = task;
+		event_head = head + 1;
+	}
+#ifdef __AVR_ATmega32U4__
+	SREG = sreg;
+#elif __SAMD21G18A__
+	__set_PRIMASK(primask);
+#endif
+	return code;
+}
+
+uint8_t sched_wake_pin(uint8_t pin, void (*task)(void), uint8_t mode) {
+	int irq = digitalPinToInterrupt(pin);
+	if (irq == NOT_AN_INTERRUPT) {
+		return -1;
+	}
+	uint8_t i = 0;
+	while (i < SCHED_MAX_WAKE_PINS && wake_pins[i].task != NULL && wake_pins[i].pin != pin) { // Free or same pin
+		i++;
+	}
+	if (i == SCHED_MAX_WAKE_PINS) {
+		return -1;
+	}
+	wake_pins[i].pin = pin;
+	wake_pins[i].task = task;
+	attachInterrupt(irq, wake_isrs[i], mode);
+#ifdef __SAMD21G18A__
+	EIC->WAKEUP.reg |= 1 << g_APinDescription[pin].ulExtInt; // Wakes up the CPU from standby
+#endif
+	return 0;
+}
+
+void sched_release_pin(uint8_t pin) {
+	for (uint8_t i = 0; i < SCHED_MAX_WAKE_PINS; i++) {
+		if (wake_pins[i].task != NULL && wake_pins[i].pin == pin) {
+			detachInterrupt(digitalPinToInterrupt(pin));
+			wake_pins[i].task = NULL;
+		}
+	}
+}
+
+uint16_t sched_missed(uint8_t id) {
+	return (id < SCHED_MAX_TASKS) ? task_list[id].missed : 0;
+}
+
+#ifdef SCHED_PROFILE
+// Adds <us> microseconds to a milliseconds counter, the remainder is kept in <carry>
+void profile_add(uint32_t *ms, uint16_t *carry, uint32_t us) {
+	us += *carry;
+	*ms += us / 1000;
+	*carry = us % 1000;
+}
+
+// Profiles the call of task <slot>, started at <start> (micros()) and due <late> ms before
+void profile_call(uint8_t slot, uint32_t start, uint32_t late) {
+	struct sched_task_profile *p = &profile.tasks[slot];
+	uint32_t run = micros() - start;
+	if (p->calls == 0 || run < p->run_min) {
+		p->run_min = run;
+	}
+	if (run > p->run_max) {
+		p->run_max = run;
+	}
+	profile_add(&p->run_total, &p->run_carry, run);
+	if (run > SCHED_OVERRUN_MS * 1000ul) {
+		p->overruns++;
+	}
+	if (late > p->late_max) {
+		p->late_max = late;
+	}
+	p->late_total += late;
+	p->calls++;
+}
+
+void sched_profile_snapshot(struct sched_profile *out) {
+	uint32_t now = micros();
+	profile_add(&profile.awake, &profile.awake_carry, now - profile_woken); // Up to now
+	profile_woken = now;
+	*out = profile;
+	out->elapsed = sched_time() - profile_since;
+}
+
+void sched_profile_reset(void) {
+	memset(&profile, 0, sizeof(profile));
+	profile_since = sched_time();
+	profile_woken = micros();
+}
+#endif
+
+uint32_t sched_time(void) {
+#ifdef __AVR_ATmega32U4__
+	noInterrupts(); // Atomic access to the 32 bits counter
+	uint32_t t = sched_seconds;
+	interrupts();
+	return t;
+#elif __SAMD21G18A__
+	return rtc_ticks() >> 10;
+#elif defined(SCHED_HOST)
+	return (uint32_t)(sched_host_clock() / 1000);
+#else
+	return 0;
+#endif
+}
+
+uint32_t sched_millis(void) {
+#ifdef __AVR_ATmega32U4__
+	noInterrupts();
+	uint32_t t = sched_ms;
+	interrupts();
+	return t;
+#elif __SAMD21G18A__
+	return (uint32_t)((rtc_ticks() * 1000) >> 10);
+#elif defined(SCHED_HOST)
+	return (uint32_t)sched_host_clock();
+#else
+	return 0;
+#endif
+}
+
+/*
+	Runs the tasks that are due, by priority, until none is left
+	Returns true if a task ran
+*/
+bool sched_run_ready(void) {
+	bool ran = false;
+	task_collect();
+	while (ready.count > 0) { // Highest priority task that can be run
+		uint8_t i = heap_pop(&ready);
+		if (task_expired(&task_list[i])) {
+			task_list[i].missed++;
+			task_next_period(&task_list[i]);
+			task_list[i].due = task_list[i].phase;
+			task_queue(i);
+			continue;
+		}
+		db("Running task nb: ");
+		db_print("                 ");
+		db_print(i);
+		db_println();
+		task_current = i;
+		task_resume = false;
+#ifdef SCHED_PROFILE
+		uint32_t late = sched_millis() - task_list[i].due;
+		uint32_t start = micros();
+#endif
+		task_list[i].task();  // Run task
+#ifdef SCHED_PROFILE
+		profile_call(i, start, late);
+#endif
+		task_current = SCHED_NO_TASK;
+		db("End task nb:");
+		db_print("                 ");
+		db_print(i);
+		db_println();
+		ran = true;
+
+		if (task_resume) { // Waiting, called again to go on with the same run
+			task_list[i].waiting = true;
+			if (task_list[i].light != task_resume_light) {
+				task_list[i].light = task_resume_light;
+				task_waiting += task_resume_light ? 1 : -1;
+			}
+			task_list[i].due = sched_millis() + task_resume_delay;
+			task_queue(i);
+			task_collect();
+			continue;
+		}
+		task_list[i].waiting = false;
+		if (task_list[i].light) {
+			task_list[i].light = false;
+			task_waiting--;
+		}
+		if (task_list[i].cancelled) {
+			task_list[i].task = NULL;
+		}
+		else if (task_list[i].looptime > 0) { // Cyclic
+			task_next_period(&task_list[i]);
+			task_list[i].due = task_list[i].phase;
+			if (task_list[i].requested && (int32_t)(task_list[i].request - task_list[i].due) < 0) {
+				task_list[i].due = task_list[i].request; // Early run, in place of the next period
+			}
+			task_queue(i);
+		}
+		else if (task_list[i].requested) { // One-shot, called again
+			task_list[i].due = task_list[i].request;
+			task_list[i].phase = task_list[i].due;
+			task_queue(i);
+		}
+		else { // One-shot
+			task_list[i].task = NULL;
+		}
+		task_list[i].requested = false;
+		task_collect(); // Tasks that became due while this one was running
+	}
+	return ran;
+}
+
 void sched_mainloop(void) {
 	db("Mainloop");
 	// Run tasks and go to sleep
 	while (1) {
-		uint8_t i;
-		for (i = 0; i < SCHED_MAX_TASKS; i++) { // For every (valid) task
-			if (task_list[i].task != NULL && task_list[i].delay <= 0) {  // If it can be run
-				db("Running task nb: ");
-				db_print("                 ");
-				db_print(i);
-				db_println();
-				task_list[i].task();  // Run task
-				db("End task nb:");
-				db_print("                 ");
-				db_print(i);
-				db_println();
-
-				noInterrupts(); // Atomic access to the task delay
-				if (task_list[i].looptime > 0) { // Cyclic
-					task_list[i].delay += task_list[i].looptime;
-				}
-				else { // One-shot
-					task_list[i].task = NULL;
-				}
-				interrupts(); // End of atomic
-			}
-		}
-		
-		sched_sleep();
+		bool ran = sched_run_ready();
 
+		uint32_t wake = sched_millis() + SCHED_MAX_SLEEP;
+		if (timers.count > 0 && (int32_t)(task_list[timers.slots[0]].due - wake) < 0) {
+			wake = task_list[timers.slots[0]].due;
+		}
+#ifdef SCHED_PROFILE
+		profile_add(&profile.awake, &profile.awake_carry, micros() - profile_woken);
+#endif
+		sched_sleep(wake);
+#ifdef SCHED_PROFILE
+		profile_woken = micros();
+		profile.wakeups++;
+#endif
 		db_start();
 
-		// "I'm alive"
-		digitalWrite(LED_BUILTIN, HIGH);
-		delay(1);
-		digitalWrite(LED_BUILTIN, LOW);
+		if (ran) {
+			// "I'm alive"
+			digitalWrite(LED_BUILTIN, HIGH);
+			delay(1);
+			digitalWrite(LED_BUILTIN, LOW);
+		}
 	} // while(1)
 }
 
 
-void sched_sleep(void) {
+/*
+	Sleeps until sched_millis() reaches <wake> (or an other interrupt)
+	Only a light sleep while tasks are suspended on a peripheral, they are woken up every millisecond to check it
+	The deadline and the posted events are checked with the interrupts disabled, an interrupt pending at that point
+	still wakes up the CPU
+*/
+void sched_sleep(uint32_t wake) {
 #ifdef __AVR_ATmega32U4__
-	power_all_disable(); // Disable peripherals
+	bool light = (task_waiting != 0); // Suspended tasks wait on a peripheral and millis()
+	if (!light) {
+		power_all_disable(); // Disable peripherals
+	}
 
 #ifdef _DEBUG
 						 // Keep USB serial working...
 	set_sleep_mode(SLEEP_MODE_IDLE);
 #else
-	set_sleep_mode(SLEEP_MODE_PWR_DOWN);
+	set_sleep_mode(light ? SLEEP_MODE_IDLE : SLEEP_MODE_PWR_DOWN);
 #endif
-	sleep_enable();
-	sleep_cpu(); // Will wake up every 1s due to the WDT/RTC interrupt
-	sleep_disable();
+	noInterrupts();
+	sched_wake = wake;
+	sched_awake = false; // The next watchdog periods are chained up to the deadline
+	if ((int32_t)(wake - sched_ms) > 0 && event_head == event_tail) {
+		sleep_enable();
+		interrupts(); // The instruction after sei is always executed, no interrupt can slip in before the sleep
+		sleep_cpu(); // Wakes up at the end of the watchdog period
+		sleep_disable();
+	}
+	sched_awake = true;
 	interrupts();
 
-	power_all_enable(); // Enable peripherals
+	if (!light) {
+		power_all_enable(); // Enable peripherals
+	}
+
+#elif __SAMD21G18A__
+	bool light = (task_waiting != 0);
+	int32_t remaining = (int32_t)(wake - sched_millis());
+	if (remaining <= 0) {
+		return;
+	}
+	uint64_t ticks = rtc_ticks() + ((uint64_t)remaining * 1024 + 999) / 1000; // Rounded up, never wakes up early
+	RTC->MODE0.COMP[0].reg = RTC_MODE0_COMP_COMP((uint32_t)ticks);
+	while (RTC->MODE0.STATUS.bit.SYNCBUSY);
+
+	if (light) {
+		SCB->SCR &= ~SCB_SCR_SLEEPDEEP_Msk;
+	}
+	else {
+		SCB->SCR |= SCB_SCR_SLEEPDEEP_Msk;
+	}
+	__disable_irq();
+	// Checked once the compare value is synchronised, the match is still ahead
+	if ((int32_t)(wake - sched_millis()) > 0 && event_head == event_tail) {
+		__WFI(); // A pending interrupt still wakes up the CPU with the interrupts masked
+	}
+	__enable_irq();
+
+#elif defined(SCHED_HOST)
+	if ((int32_t)(wake - sched_millis()) > 0 && event_head == event_tail) {
+		sched_host_sleep(wake);
+	}
+#endif
+}
+
+void sched_idle(void) {
+#ifdef __AVR_ATmega32U4__
+	set_sleep_mode(SLEEP_MODE_IDLE); // CPU clock only, the UART and the timers keep running
+	sleep_enable();
+	sleep_cpu();
+	sleep_disable();
 
 #elif __SAMD21G18A__
-	SCB->SCR |= SCB_SCR_SLEEPDEEP_Msk;
+	SCB->SCR &= ~SCB_SCR_SLEEPDEEP_Msk;
 	__WFI();
+
+#elif defined(SCHED_HOST)
+	sched_host_sleep(sched_millis() + 1); // Next millis tick
 #endif
-}
\ No newline at end of file
+}
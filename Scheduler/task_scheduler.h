@@ -3,29 +3,255 @@
 
 #include "Arduino.h"
 
+#ifndef SCHED_MAX_TASKS
+#define SCHED_MAX_TASKS 8 // Task slots, can be set by the build flags
+#endif
+
+#define SCHED_NO_TASK 0xFF
+
+#ifndef SCHED_EVENT_QUEUE
+#define SCHED_EVENT_QUEUE 8 // Posted events not handled yet, a power of 2
+#endif
+
+// Run time profiling (see sched_profile_snapshot), on by default on SAMD, build flag on AVR where the RAM is short
+#if defined(__SAMD21G18A__) && !defined(SCHED_PROFILE)
+#define SCHED_PROFILE
+#endif
+
+#ifndef SCHED_OVERRUN_MS
+#define SCHED_OVERRUN_MS 1000 // A call longer than this delays the other tasks by a whole tick
+#endif
+
+#define SCHED_PRIORITY_LOW     0
+#define SCHED_PRIORITY_NORMAL  1
+#define SCHED_PRIORITY_HIGH    2
+
+// sched_add_task flags
+#define SCHED_UNIQUE  0x01 // At most one instance of the function, a pending one is rescheduled instead (if earlier)
+
+// What a late cyclic task does with the periods that are already over
+enum sched_catchup {
+	SCHED_CATCHUP_ALL,       // Runs them all, back to back
+	SCHED_CATCHUP_COALESCE,  // Runs once for all of them, then goes on with the next period in the future
+	SCHED_CATCHUP_SKIP       // Doesn't run a period once it is over, waits for the next period in the future
+};
+
 /**
 	Simple scheduler
 
 	Add tasks to be run cyclically
 	Call the mainloop to enter sleep and run tasks when they're ready
 
-	Tasks are executed after every interruption, if they are ready, and in the order they were added to the scheduler
-	If a task is late to be executed, it might be executed multiple times in a row with no interval until it's not ready anymore
+	Tasks are executed when they are ready, by priority then in deadline order (tasks due at the same time in the order
+	they were queued)
+	If a cyclic task is late, its catch-up policy tells if the periods it missed are run back to back, merged into a
+	single run or skipped, the merged and skipped periods are counted (sched_missed)
+	Long operations are written as cooperative tasks (see TASK_BEGIN), so the other tasks keep running while they wait
 
+	The scheduler is tickless : the MCU sleeps until the nearest task deadline instead of waking up every second
+	Delays are given in seconds, or in milliseconds with the _ms variants, so short waits are sleeps too
 	The sleep mode is configured to the one with the least energy comsumption
 */
 
 /*
 	Starts the timer system and turn on the required clocks and interruptions
 	Uses WDT on AVR architectures and RTC on SAMD ones
-	A 1hz interrupt is configured and handled by the scheduler
+	SAMD : the RTC counts 1/1024s and its compare interrupt is set to the next deadline
+	AVR : the watchdog periods (8s down to 16ms) are chained up to the next deadline, 16ms periods while tasks are
+	running, so the resolution is 16ms (no asynchronous timer on the ATmega32u4)
 */
 void sched_setup(void);
 
 /*
 	Adds the function to the task list, with a initial delay of <delay> seconds and to be run every <looptime> seconds from thereon
+	When several tasks are due, the one with the highest <priority> runs first
+	<catchup> only matters for the cyclic tasks (see enum sched_catchup)
+	Returns the task id (its slot), SCHED_NO_TASK if all the slots are taken
+*/
+uint8_t sched_add_task(void(*task)(void), int32_t delay, int32_t looptime,
+	uint8_t priority = SCHED_PRIORITY_NORMAL, uint8_t catchup = SCHED_CATCHUP_ALL, uint8_t flags = 0);
+
+/*
+	Same as sched_add_task(), <delay> and <looptime> in milliseconds
+*/
+uint8_t sched_add_task_ms(void(*task)(void), uint32_t delay, uint32_t looptime,
+	uint8_t priority = SCHED_PRIORITY_NORMAL, uint8_t catchup = SCHED_CATCHUP_ALL, uint8_t flags = 0);
+
+/*
+	Task ids
+	An id is the slot of the task, it's reused once the task is over : look the task up with sched_find() rather than
+	keeping its id. The functions below return -1 if there's no task in the slot
+	While a task is running, or suspended in the middle of a run, the changes take effect once its run is over
+*/
+
+/*
+	Returns the id of the task running <task>, SCHED_NO_TASK if there is none
+*/
+uint8_t sched_find(void(*task)(void));
+
+/*
+	Removes task <id>, it won't be called again
+*/
+uint8_t sched_cancel(uint8_t id);
+
+/*
+	Moves the next run of task <id> to <delay> seconds from now, if that's earlier than planned
+	A cyclic task keeps its periods, the early run takes the place of the next one
+*/
+uint8_t sched_reschedule(uint8_t id, int32_t delay);
+uint8_t sched_reschedule_ms(uint8_t id, uint32_t delay);
+
+/*
+	Sets the period of task <id> to <looptime> seconds, 0 makes it a one-shot
+	The next run is kept, the new period counts from it
+*/
+uint8_t sched_set_period(uint8_t id, int32_t looptime);
+uint8_t sched_set_period_ms(uint8_t id, uint32_t looptime);
+
+/*
+	Returns the number of periods task <id> skipped or merged to catch up
+*/
+uint16_t sched_missed(uint8_t id);
+
+/*
+	External events
+	An interrupt posts a task with sched_post(), that wakes up the mainloop which adds it right away (high priority,
+	SCHED_UNIQUE : the posts made before it runs make a single run)
+	The events go through a ring buffer, filled by the interrupts and emptied by the mainloop
+	AVR : the clock only moves at the end of the watchdog periods, after an external wake up sched_millis() lags behind
+	by the part of the period in progress (8s at most) until the period ends, the deadlines aren't affected
+*/
+
+/*
+	Posts <task> to be run as soon as possible, can be called from an interrupt
+	Returns -1 if the queue is full, the event is lost
+*/
+uint8_t sched_post(void(*task)(void));
+
+/*
+	Posts <task> when the interrupt of <pin> fires, <mode> as for attachInterrupt() (LOW, CHANGE, RISING, FALLING)
+	Returns -1 if the pin has no external interrupt or if the wake up pins are all taken
+	AVR : pins 0 to 3 (INT0-3) wake up from power down in every mode, pin 7 (INT6) only on LOW
+	SAMD : the EIC clock stops in standby, only LOW and HIGH wake up from the deep sleep, the edges need a light one
+*/
+uint8_t sched_wake_pin(uint8_t pin, void(*task)(void), uint8_t mode);
+
+void sched_release_pin(uint8_t pin);
+
+/*
+	Called by the running task, to be called again in <delay> seconds to go on with the same run
+	Cyclic tasks keep their period, counted from the time the run was due
+	<light> : the task waits on a peripheral, the scheduler only sleeps lightly meanwhile (peripherals and millis()
+	keep running). A task that only waits for a time, or for an interrupt, lets it deep sleep with false
+*/
+void sched_resume(int32_t delay, bool light = true);
+
+/*
+	Same as sched_resume(), <delay> in milliseconds
+*/
+void sched_resume_ms(uint32_t delay, bool light = true);
+
+/*
+	Returns the slot of the running task, SCHED_NO_TASK outside of the tasks
+*/
+uint8_t sched_task_id(void);
+
+/*
+	Cooperative tasks (protothreads)
+	A task that has to wait (modem answer, timeout...) returns instead of blocking the mainloop, and goes on from
+	where it stopped on its next call. Its position is kept in a task_lc, 0 when the task isn't in the middle of a run
+	The locals don't survive a wait, keep what's needed after it in static variables
+	One wait per line at most, no switch statement around a wait, and no initialised local in a block crossing a wait
+
+		void my_task(void) {
+			static task_lc lc = 0;
+			TASK_BEGIN(lc);
+			...
+			TASK_WAIT_UNTIL_MS(lc, Serial1.available(), 20);  // Checked again every 20ms
+			...
+			TASK_END(lc);
+		}
+
+	The waits keep the scheduler in a light sleep (see sched_resume), TASK_WAIT_UNTIL_MS_SLEEP tells which one
+*/
+typedef uint16_t task_lc;
+
+#define TASK_BEGIN(lc)      switch (lc) { case 0:
+#define TASK_END(lc)        } lc = 0
+#define TASK_EXIT(lc)       do { lc = 0; return; } while (0)
+#define TASK_SLEEP(lc, seconds) \
+	do { lc = __LINE__; sched_resume(seconds); return; case __LINE__:; } while (0)
+#define TASK_WAIT_UNTIL(lc, cond, seconds) \
+	do { lc = __LINE__; case __LINE__: if (!(cond)) { sched_resume(seconds); return; } } while (0)
+#define TASK_SLEEP_MS(lc, ms) \
+	do { lc = __LINE__; sched_resume_ms(ms); return; case __LINE__:; } while (0)
+#define TASK_WAIT_UNTIL_MS(lc, cond, ms) \
+	do { lc = __LINE__; case __LINE__: if (!(cond)) { sched_resume_ms(ms); return; } } while (0)
+#define TASK_WAIT_UNTIL_MS_SLEEP(lc, cond, ms, light) \
+	do { lc = __LINE__; case __LINE__: if (!(cond)) { sched_resume_ms(ms, light); return; } } while (0)
+
+/*
+	Returns the number of seconds elapsed since sched_setup()
+*/
+uint32_t sched_time(void);
+
+/*
+	Returns the number of milliseconds elapsed since sched_setup(), wraps after 49 days
+	Unlike millis(), it keeps counting in deep sleep
+*/
+uint32_t sched_millis(void);
+
+/*
+	Light sleep until the next interrupt of any source (UART receive, millis timer, tick...)
+	Peripherals are kept running, to be used by tasks waiting on a peripheral instead of spinning
+*/
+void sched_idle(void);
+
+#ifdef SCHED_HOST
+/*
+	Host build (build flag), the clock and the sleep are given by a simulation (see BoxSimulator/sched_sim.cpp)
+	sched_host_clock returns its virtual clock in ms, sched_host_sleep moves it up to <wake> or to an earlier event
+*/
+uint64_t sched_host_clock(void);
+void sched_host_sleep(uint32_t wake);
+#endif
+
+#ifdef SCHED_PROFILE
+/*
+	Run time profile, since the last sched_profile_reset()
+	Durations are measured with micros() (timer 0 on AVR, SysTick on SAMD), only while the CPU is awake
+	The sleep time is what is left of the elapsed time, the timers stop in deep sleep
+	A cooperative task counts one call per slice, the waits between the slices aren't part of its run time
+*/
+struct sched_task_profile {
+	uint16_t calls;
+	uint16_t overruns;    // Calls longer than SCHED_OVERRUN_MS
+	uint32_t late_max;    // Milliseconds between the due time and the call, worst one
+	uint32_t late_total;  // Milliseconds, all calls (mean = late_total / calls)
+	uint32_t run_min;     // Microseconds
+	uint32_t run_max;     // Microseconds
+	uint32_t run_total;   // Milliseconds (mean = run_total / calls)
+	uint16_t run_carry;   // Microseconds not counted in run_total yet
+};
+
+struct sched_profile {
+	uint32_t elapsed;     // Seconds since the reset
+	uint32_t awake;       // Milliseconds spent out of sched_sleep(), tasks included
+	uint16_t awake_carry; // Microseconds not counted in awake yet
+	uint16_t wakeups;
+	struct sched_task_profile tasks[SCHED_MAX_TASKS]; // By task slot, a new task starts a blank profile
+};
+
+/*
+	Copies the profile so far in <profile>, elapsed is filled in
+*/
+void sched_profile_snapshot(struct sched_profile *profile);
+
+/*
+	Starts a new profile, for every task
 */
-uint8_t sched_add_task(void(*task)(void), int32_t delay, int32_t looptime);
+void sched_profile_reset(void);
+#endif
 
 /*
 	Enters the scheduler main loop